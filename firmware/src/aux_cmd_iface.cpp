@@ -43,6 +43,8 @@ constexpr int CmdLoadMotorParamsFromDB  = 0;
 constexpr int CmdHardwareTest           = 1000;
 constexpr int CmdMotorIDStatic          = 1001;
 constexpr int CmdMotorIDRotating        = 1002;
+constexpr int CmdMotorIDBroadband       = 1003;
+constexpr int CmdMotorIDMechanical      = 1004;
 
 
 os::config::Param<int> g_param_cmd("exec_aux_command", -1, -1, 9999);
@@ -121,7 +123,23 @@ class Thread : public chibios_rt::BaseStaticThread<2048>
         // Saving the results
         const auto result = foc::getMotorParameters();
         g_logger.println("Motor params:\n%s", result.toString().c_str());
-        params::writeMotorParameters(result);
+
+        // The statistics are reported over UAVCAN so that the end-of-line test rig could reject bad motors
+        const auto stat = foc::getMotorIdentificationStatistics();
+        const bool repeatable = stat.isRepeatable(foc::getParameters().motor_id.max_relative_deviation);
+        using Variable = foc::motor_id::Statistics::Variable;
+        log(repeatable ? uavcan_node::LogLevel::INFO : uavcan_node::LogLevel::WARNING,
+            "MotorID runs %u RSD%% Rs %.2f Lq %.2f Phi %.2f J %.2f",
+            stat.getNumRuns(),
+            double(stat.get(Variable::Rs).getRelativeStandardDeviation() * 100.0F),
+            double(stat.get(Variable::Lq).getRelativeStandardDeviation() * 100.0F),
+            double(stat.get(Variable::Phi).getRelativeStandardDeviation() * 100.0F),
+            double(stat.get(Variable::RotorInertia).getRelativeStandardDeviation() * 100.0F));
+
+        if (repeatable)
+        {
+            params::writeMotorParameters(result);
+        }
     }
 
     void execute(const int cmd)
@@ -163,6 +181,14 @@ class Thread : public chibios_rt::BaseStaticThread<2048>
         {
             doMotorID(foc::motor_id::Mode::RotationWithoutMechanicalLoad);
         }
+        else if (cmd == CmdMotorIDBroadband)
+        {
+            doMotorID(foc::motor_id::Mode::StaticBroadband);
+        }
+        else if (cmd == CmdMotorIDMechanical)
+        {
+            doMotorID(foc::motor_id::Mode::Mechanical);
+        }
         else
         {
             g_logger.println("INVALID COMMAND %d", cmd);
@@ -82,6 +82,8 @@ namespace board
 namespace
 {
 
+std::uint32_t g_reset_flags = 0;        ///< Copy of RCC_CSR taken before the flags are cleared
+
 static void initLEDPWM()
 {
     {
@@ -121,6 +123,8 @@ os::watchdog::Timer init(unsigned watchdog_timeout_msec,
     halInit();
     chibios_rt::System::init();
 
+    g_reset_flags = RCC->CSR;
+
     /*
      * Serial port
      */
@@ -153,6 +157,9 @@ os::watchdog::Timer init(unsigned watchdog_timeout_msec,
     os::lowsyslog(PRODUCT_NAME_STRING " %d.%d.%08x / %d %s\n",
                   FW_VERSION_MAJOR, FW_VERSION_MINOR, GIT_HASH, config_init_res,
                   watchdogTriggeredLastReset() ? "WDTRESET" : "OK");
+
+    RCC->CSR |= RCC_CSR_RMVF;           // Clearing the reset flags so they don't accumulate across resets
+
     return wdt;
 }
 
@@ -170,6 +177,14 @@ void restart()
     NVIC_SystemReset();
 }
 
+bool wasLastResetCausedByBrownOut()
+{
+    // Note that the BOR flag is also set on power-on, so it only matters if the POR flag is not set
+    const bool brownout = ((g_reset_flags & RCC_CSR_BORRSTF) != 0) && ((g_reset_flags & RCC_CSR_PORRSTF) == 0);
+    const bool watchdog = (g_reset_flags & (RCC_CSR_WDGRSTF | RCC_CSR_WWDGRSTF)) != 0;
+    return brownout && !watchdog;
+}
+
 UniqueID readUniqueID()
 {
     UniqueID bytes;
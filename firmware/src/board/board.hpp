@@ -54,6 +54,13 @@ void die(int reason);
  */
 void restart();
 
+/**
+ * Returns true if the last reset was caused by a brown-out, i.e. a supply glitch while the system might have been
+ * operating, as opposed to a power cycle, a commanded restart, or a watchdog reset (which points at a fault).
+ * Meaningful only after @ref init().
+ */
+bool wasLastResetCausedByBrownOut();
+
 /**
  * Returns the 128-bit hardware UID, where only the first 96 bit are used, and the rest is
  * filled with zeros.
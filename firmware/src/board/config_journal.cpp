@@ -0,0 +1,448 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config_journal.hpp"
+#include "board.hpp"
+#include "motor.hpp"
+#include <hal.h>
+#include <cerrno>
+#include <cstring>
+
+
+namespace board
+{
+namespace
+{
+/*
+ * Sector layout:
+ *      magic word
+ *      record
+ *      record
+ *      ...
+ *      erased space
+ *
+ * Record layout:
+ *      word 0: (RecordTag << 16) | length in bytes
+ *      word 1: (offset << 16) | CRC16-CCITT of the offset, length, and data
+ *      data, length / 4 words
+ */
+constexpr std::uint32_t SectorMagic = 0x314A4643;       // "CFJ1"
+constexpr std::uint32_t RecordTag = 0xC5A3;
+constexpr unsigned RecordHeaderSize = 8;
+constexpr std::uint32_t ErasedWord = 0xFFFFFFFFU;
+
+/// How long the staged image must stay unmodified before it can be committed
+constexpr unsigned QuietPeriodMSec = 50;
+
+constexpr std::uint32_t FlashKey1 = 0x45670123U;
+constexpr std::uint32_t FlashKey2 = 0xCDEF89ABU;
+
+constexpr std::uint32_t FlashErrorMask = FLASH_SR_PGSERR | FLASH_SR_PGPERR | FLASH_SR_PGAERR | FLASH_SR_WRPERR;
+
+/// Generous margins over the worst case timings, the flash is considered broken if they are exceeded
+constexpr float FlashProgrammingTimeout = ConfigJournal::MaxWordProgrammingTime * 10.0F;   ///< Second
+constexpr float FlashErasureTimeout = 4.0F;                                                 ///< Second
+
+
+std::uint16_t computeCRC16(std::uint16_t crc, const std::uint8_t* data, unsigned len)
+{
+    while (len --> 0)
+    {
+        crc ^= std::uint16_t(*data++ << 8);
+        for (int i = 0; i < 8; i++)
+        {
+            crc = std::uint16_t((crc & 0x8000U) ? ((crc << 1) ^ 0x1021U) : (crc << 1));
+        }
+    }
+    return crc;
+}
+
+std::uint16_t computeRecordCRC(unsigned offset, unsigned length, const std::uint8_t* data)
+{
+    const std::uint8_t header[4] =
+    {
+        std::uint8_t(offset), std::uint8_t(offset >> 8), std::uint8_t(length), std::uint8_t(length >> 8)
+    };
+    return computeCRC16(computeCRC16(0xFFFFU, header, sizeof(header)), data, length);
+}
+
+void unlockFlash()
+{
+    if ((FLASH->CR & FLASH_CR_LOCK) != 0)
+    {
+        FLASH->KEYR = FlashKey1;
+        FLASH->KEYR = FlashKey2;
+    }
+}
+
+int waitWhileFlashBusy(const float timeout)
+{
+    const SmallTimeIntervalMeasurer measurer;
+    while ((FLASH->SR & FLASH_SR_BSY) != 0)
+    {
+        if (measurer.sample() > timeout)
+        {
+            return -ETIMEDOUT;
+        }
+    }
+
+    if ((FLASH->SR & FlashErrorMask) != 0)
+    {
+        FLASH->SR = FlashErrorMask;
+        return -EIO;
+    }
+    return 0;
+}
+
+int programFlashBlocking(std::uintptr_t address, const std::uint32_t* data, unsigned num_words)
+{
+    unlockFlash();
+
+    int res = waitWhileFlashBusy(FlashProgrammingTimeout);
+    for (unsigned i = 0; (i < num_words) && (res >= 0); i++)
+    {
+        FLASH->CR = FLASH_CR_PSIZE_1 | FLASH_CR_PG;
+        *reinterpret_cast<volatile std::uint32_t*>(address + i * 4U) = data[i];
+        res = waitWhileFlashBusy(FlashProgrammingTimeout);
+    }
+
+    FLASH->CR = FLASH_CR_LOCK;
+    return res;
+}
+
+} // namespace
+
+
+ConfigJournal* ConfigJournal::instance_ = nullptr;
+
+
+ConfigJournal::ConfigJournal(void* sector_address,
+                             unsigned sector_size,
+                             unsigned sector_index) :
+    sector_address_(reinterpret_cast<std::uintptr_t>(sector_address)),
+    sector_size_(sector_size),
+    sector_index_(sector_index)
+{
+    assert(instance_ == nullptr);
+    assert((sector_address_ % 4) == 0);
+    assert((sector_size_ % 4) == 0);
+    assert(sector_size_ > (LogicalSize + RecordHeaderSize + 4));
+
+    replay();
+    instance_ = this;
+}
+
+bool ConfigJournal::isWordModified(unsigned offset) const
+{
+    return std::memcmp(&staged_image_[offset], &committed_image_[offset], 4) != 0;
+}
+
+void ConfigJournal::replay()
+{
+    const auto word_at = [this](unsigned offset)
+    {
+        return *reinterpret_cast<const std::uint32_t*>(sector_address_ + offset);
+    };
+
+    staged_image_.fill(0xFF);
+
+    unsigned offset = 0;
+
+    if (word_at(0) == SectorMagic)
+    {
+        offset = 4;
+        while ((offset + RecordHeaderSize) <= sector_size_ && word_at(offset) != ErasedWord)
+        {
+            const std::uint32_t w0 = word_at(offset);
+            const std::uint32_t w1 = word_at(offset + 4);
+            const unsigned length = w0 & 0xFFFFU;
+            const unsigned image_offset = w1 >> 16;
+            const auto* const data = reinterpret_cast<const std::uint8_t*>(sector_address_ + offset + RecordHeaderSize);
+
+            const bool valid = ((w0 >> 16) == RecordTag) &&
+                               (length > 0) && ((length % 4) == 0) && ((image_offset % 4) == 0) &&
+                               ((image_offset + length) <= LogicalSize) &&
+                               ((offset + RecordHeaderSize + length) <= sector_size_) &&
+                               (computeRecordCRC(image_offset, length, data) == (w1 & 0xFFFFU));
+            if (!valid)
+            {
+                break;          // Incomplete or corrupted, everything past this point is discarded
+            }
+
+            std::memcpy(&staged_image_[image_offset], data, length);
+            offset += RecordHeaderSize + length;
+        }
+    }
+    else if (word_at(0) != ErasedWord)
+    {
+        // Legacy flat image; it has the same layout as the logical image, so it can be used as is
+        std::memcpy(staged_image_.data(), reinterpret_cast<const void*>(sector_address_), LogicalSize);
+        offset = sector_size_;
+    }
+    else
+    {
+        ;   // Blank sector, the magic will be written with the first commit
+    }
+
+    // New records can be appended only if the remaining space has not been touched
+    for (unsigned i = offset; i < sector_size_; i += 4)
+    {
+        if (word_at(i) != ErasedWord)
+        {
+            offset = sector_size_;
+            break;
+        }
+    }
+
+    write_pointer_ = offset;
+    compaction_required_ = (write_pointer_ >= sector_size_);
+    committed_image_ = staged_image_;
+}
+
+int ConfigJournal::read(std::size_t offset, void* data, std::size_t len)
+{
+    if ((offset + len) > LogicalSize)
+    {
+        return -EFBIG;
+    }
+
+    os::MutexLocker locker(mutex_);
+    std::memcpy(data, &staged_image_[offset], len);
+    return 0;
+}
+
+int ConfigJournal::write(std::size_t offset, const void* data, std::size_t len)
+{
+    if ((offset + len) > LogicalSize)
+    {
+        return -EFBIG;
+    }
+
+    os::MutexLocker locker(mutex_);
+    std::memcpy(&staged_image_[offset], data, len);
+    has_uncommitted_changes_ = true;
+    last_modification_ts_ = chVTGetSystemTimeX();
+    return 0;
+}
+
+int ConfigJournal::erase()
+{
+    os::MutexLocker locker(mutex_);
+    staged_image_.fill(0xFF);
+    has_uncommitted_changes_ = true;
+    last_modification_ts_ = chVTGetSystemTimeX();
+    return 0;
+}
+
+bool ConfigJournal::appendRecordToQueue(unsigned& inout_length, unsigned offset, unsigned size)
+{
+    const unsigned num_words = (RecordHeaderSize + size) / 4;
+    if (((inout_length + num_words) > QueueCapacityWords) ||
+        ((write_pointer_ + (inout_length + num_words) * 4U) > sector_size_))
+    {
+        return false;
+    }
+
+    queue_[inout_length++] = (RecordTag << 16) | size;
+    queue_[inout_length++] = (std::uint32_t(offset) << 16) |
+                             computeRecordCRC(offset, size, &staged_image_[offset]);
+
+    std::memcpy(&queue_[inout_length], &staged_image_[offset], size);
+    inout_length += size / 4;
+    return true;
+}
+
+int ConfigJournal::commit()
+{
+    os::MutexLocker locker(mutex_);
+
+    if (!has_uncommitted_changes_ ||
+        (chVTTimeElapsedSinceX(last_modification_ts_) < MS2ST(QuietPeriodMSec)) ||
+        (queue_position_ != queue_length_))
+    {
+        return 0;
+    }
+
+    if (compaction_required_)
+    {
+        return -EAGAIN;
+    }
+
+    unsigned length = 0;
+    unsigned num_records = 0;
+
+    if (write_pointer_ == 0)
+    {
+        queue_[length++] = SectorMagic;
+    }
+
+    unsigned offset = 0;
+    while (offset < LogicalSize)
+    {
+        if (!isWordModified(offset))
+        {
+            offset += 4;
+            continue;
+        }
+
+        // Extending the record until two unmodified words in a row are found; this is cheaper than a new header
+        unsigned end = offset + 4;
+        for (unsigned i = end; (i < LogicalSize) && ((i - end) < RecordHeaderSize); i += 4)
+        {
+            if (isWordModified(i))
+            {
+                end = i + 4;
+            }
+        }
+
+        if (!appendRecordToQueue(length, offset, end - offset))
+        {
+            compaction_required_ = true;
+            return -ENOSPC;
+        }
+
+        num_records++;
+        offset = end;
+    }
+
+    has_uncommitted_changes_ = false;
+    committed_image_ = staged_image_;
+
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    num_records_written_ += num_records;
+
+    {
+        motor::AbsoluteCriticalSectionLocker cs_locker;
+        queue_address_ = sector_address_ + write_pointer_;
+        queue_position_ = 0;
+        queue_length_ = length;
+    }
+
+    write_pointer_ += length * 4U;
+    return int(length * 4U);
+}
+
+int ConfigJournal::compact()
+{
+    os::MutexLocker locker(mutex_);
+
+    // The pending writes are dropped because the full image will be written anyway
+    {
+        motor::AbsoluteCriticalSectionLocker cs_locker;
+        blocking_operation_in_progress_ = true;
+        queue_position_ = queue_length_;
+    }
+
+    unlockFlash();
+    int res = waitWhileFlashBusy(FlashProgrammingTimeout);   // The IRQ may have been programming a word
+
+    if (res >= 0)
+    {
+        FLASH->CR = FLASH_CR_SER | (sector_index_ << 3);
+        FLASH->CR |= FLASH_CR_STRT;
+        res = waitWhileFlashBusy(FlashErasureTimeout);
+    }
+    FLASH->CR = FLASH_CR_LOCK;
+
+    num_compactions_++;
+    write_pointer_ = 0;
+
+    unsigned length = 0;
+    queue_[length++] = SectorMagic;
+
+    if (res >= 0)
+    {
+        const bool appended = appendRecordToQueue(length, 0, LogicalSize);
+        assert(appended);
+        (void) appended;
+        res = programFlashBlocking(sector_address_, queue_.data(), length);
+    }
+
+    if (res >= 0)
+    {
+        write_pointer_ = length * 4U;
+        compaction_required_ = false;
+        has_uncommitted_changes_ = false;
+        committed_image_ = staged_image_;
+    }
+    else
+    {
+        num_flash_errors_ = num_flash_errors_ + 1U;
+    }
+
+    blocking_operation_in_progress_ = false;
+    return res;
+}
+
+ConfigJournal::Statistics ConfigJournal::getStatistics() const
+{
+    Statistics out;
+    out.used_bytes = write_pointer_;
+    out.total_bytes = sector_size_;
+    out.num_records_written = num_records_written_;
+    out.num_compactions = num_compactions_;
+    out.num_flash_errors = num_flash_errors_;
+    return out;
+}
+
+void ConfigJournal::processPendingWriteFromIRQImpl()
+{
+    if (blocking_operation_in_progress_ ||
+        ((FLASH->SR & FLASH_SR_BSY) != 0))
+    {
+        return;         // The previous word is still being programmed, or the flash is used by someone else
+    }
+
+    if ((FLASH->SR & FlashErrorMask) != 0)
+    {
+        FLASH->SR = FlashErrorMask;
+        num_flash_errors_ = num_flash_errors_ + 1U;
+        compaction_required_ = true;            // The flash contents can't be trusted anymore
+        queue_position_ = queue_length_;
+    }
+
+    const unsigned position = queue_position_;
+    if (position < queue_length_)
+    {
+        unlockFlash();
+        FLASH->CR = FLASH_CR_PSIZE_1 | FLASH_CR_PG;
+        *reinterpret_cast<volatile std::uint32_t*>(queue_address_ + position * 4U) = queue_[position];
+        queue_position_ = position + 1U;
+    }
+    else if ((FLASH->CR & FLASH_CR_LOCK) == 0)
+    {
+        FLASH->CR = FLASH_CR_LOCK;              // All done, the flash is not needed anymore
+    }
+    else
+    {
+        ;   // Idle
+    }
+}
+
+}
@@ -0,0 +1,170 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <ch.hpp>
+#include <zubax_chibios/config/config.hpp>
+
+
+namespace board
+{
+/**
+ * Log-structured configuration storage backend.
+ *
+ * The configuration library sees a flat image that lives in RAM. When the image changes, the journal appends only
+ * the words that changed to the flash sector. Each record has a header with the offset, length, and CRC of the data.
+ * At startup, the records are replayed in order to restore the image. If a record is incomplete (e.g. power was lost
+ * while it was being written), the replay stops there, and the journal is compacted at the next opportunity.
+ *
+ * Appended records are programmed in the background one word at a time from the main motor control IRQ, while the
+ * power stage is inactive. The configuration can be committed at any time, including while the motor is running,
+ * but in that case the records stay queued in RAM and reach the flash only once the motor has stopped.
+ * Programming the flash while the motor is running is not supported: the MCU has a single flash bank, so any
+ * instruction fetch from the flash stalls until the word is programmed, and the control IRQs are far too large
+ * to be executed from RAM.
+ * Compaction rewrites the whole image into a freshly erased sector. The erase stalls the CPU for a long time, so
+ * it is done lazily: only when the sector is full or damaged, and only when the application allows it.
+ *
+ * There can be only one instance, because the MCU has only one flash controller.
+ */
+class ConfigJournal : public os::config::IStorageBackend
+{
+public:
+    static constexpr unsigned LogicalSize = 2048;               ///< Max size of the configuration image, bytes
+    static constexpr float MaxWordProgrammingTime = 100e-6F;    ///< Worst case per the datasheet, second
+
+    struct Statistics
+    {
+        unsigned used_bytes = 0;
+        unsigned total_bytes = 0;
+        unsigned num_records_written = 0;
+        unsigned num_compactions = 0;
+        unsigned num_flash_errors = 0;
+    };
+
+private:
+    /*
+     * Records separated by less than two unchanged words are merged, hence each record is followed by at least two
+     * unchanged words, so the header overhead can't exceed the size of the data. Two image sizes is enough.
+     */
+    static constexpr unsigned QueueCapacityWords = LogicalSize / 2;
+
+    const std::uintptr_t sector_address_;
+    const unsigned sector_size_;
+    const unsigned sector_index_;
+
+    /*
+     * The staged image is what the configuration library sees.
+     * The committed image is what is stored (or is being stored) in the flash.
+     */
+    alignas(4) std::array<std::uint8_t, LogicalSize> staged_image_;
+    alignas(4) std::array<std::uint8_t, LogicalSize> committed_image_;
+    bool has_uncommitted_changes_ = false;
+    ::systime_t last_modification_ts_ = 0;
+
+    unsigned write_pointer_ = 0;            ///< Offset of the first free byte in the sector
+    volatile bool compaction_required_ = false;
+    volatile bool blocking_operation_in_progress_ = false;
+
+    // Words to be programmed from the IRQ at consecutive addresses
+    std::array<std::uint32_t, QueueCapacityWords> queue_;
+    volatile unsigned queue_length_ = 0;
+    volatile unsigned queue_position_ = 0;
+    std::uintptr_t queue_address_ = 0;
+
+    unsigned num_records_written_ = 0;
+    unsigned num_compactions_ = 0;
+    volatile unsigned num_flash_errors_ = 0;
+
+    chibios_rt::Mutex mutex_;
+
+    static ConfigJournal* instance_;
+
+    bool isWordModified(unsigned offset) const;
+    void replay();
+    bool appendRecordToQueue(unsigned& inout_length, unsigned offset, unsigned size);
+    void processPendingWriteFromIRQImpl();
+
+public:
+    /**
+     * The journal is replayed from the flash immediately.
+     * If the sector contains an image in the legacy flat format, it is imported and converted on the next compaction.
+     * @param sector_address        Address of the flash sector dedicated to the configuration.
+     * @param sector_size           Size of the sector in bytes.
+     * @param sector_index          Index of the sector for the erase operation.
+     */
+    ConfigJournal(void* sector_address,
+                  unsigned sector_size,
+                  unsigned sector_index);
+
+    int read(std::size_t offset, void* data, std::size_t len) override;
+
+    /**
+     * These only modify the staged image in RAM; use @ref commit() to write the changes into the flash.
+     */
+    int write(std::size_t offset, const void* data, std::size_t len) override;
+    int erase() override;
+
+    bool hasUncommittedChanges() const { return has_uncommitted_changes_; }
+
+    /**
+     * Queues the changed words of the image for background programming. Never blocks.
+     * The configuration library saves the image in several calls, and the backend can't tell when the save is
+     * complete. Because of that, the changes are committed only after the image has been quiet for a short while.
+     * @return  Positive if the changes were queued.
+     *          Zero if there was nothing to do, the image is not quiet yet, or the previous commit is not finished.
+     *          Negative error code if the journal must be compacted first.
+     */
+    int commit();
+
+    bool isCompactionRequired() const { return compaction_required_; }
+
+    /**
+     * Erases the sector and writes the full staged image into it.
+     * This operation blocks the CPU for hundreds of milliseconds; the caller must make sure that nothing
+     * time-critical is running.
+     */
+    int compact();
+
+    Statistics getStatistics() const;
+
+    /**
+     * Programs at most one pending word into the flash. Never blocks.
+     * Must be invoked periodically from an IRQ that can't be preempted by the other users of this class.
+     */
+    static void processPendingWriteFromIRQ()
+    {
+        if (instance_ != nullptr)
+        {
+            instance_->processPendingWriteFromIRQImpl();
+        }
+    }
+};
+
+}
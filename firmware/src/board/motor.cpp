@@ -30,6 +30,7 @@
 #include <numeric>
 #include <cassert>
 #include "motor_board_features.hpp"
+#include "config_journal.hpp"
 
 
 namespace board
@@ -44,7 +45,8 @@ namespace
 constexpr unsigned SamplesPerADCPerIRQ = 2;
 
 /**
- * Some voltage samples will be re-used from the previous period of the fast IRQ.
+ * The voltage samples of two PWM periods are kept, because the conversion of the inverter voltage may complete after
+ * the fast IRQ has started; see readSynchronizedInverterVoltage().
  */
 constexpr unsigned InverterVoltageSampleBufferLength = 2 * SamplesPerADCPerIRQ;
 
@@ -59,9 +61,12 @@ static_assert(MainIRQPriority < CORTEX_PRIORITY_SVCALL, "Main IRQ must be able t
  */
 constexpr float MainIRQMinPeriod = 50e-6F;
 
-constexpr float InverterVoltageInnovationWeight = 0.1F;         ///< Has to account for possible aliasing effect
+constexpr float InverterVoltageInnovationWeight = 0.1F;         ///< For the status only, the control uses raw samples
 constexpr float TemperatureInnovationWeight     = 0.001F;       ///< The input is noisy, high damping is necessary
 
+/// The filtered temperature is considered settled after this many main IRQ periods, i.e. five time constants
+constexpr unsigned TemperatureSettlingNumSamples = unsigned(5.0F / TemperatureInnovationWeight);
+
 /*
  * Hardware-defined parameters
  */
@@ -96,6 +101,31 @@ constexpr math::Range<> PWMDeadTimeRangeNSec(50.0F, 500.0F);
 os::config::Param<float> g_config_pwm_frequency_khz ("drv.pwm_freq_khz", 0.0F, 0.0F, PWMFrequencyRangeKHz.max);
 os::config::Param<float> g_config_pwm_dead_time_nsec("drv.pwm_deadt_ns", 0.0F, 0.0F, PWMDeadTimeRangeNSec.max);
 
+/*
+ * Persisted current sensors zero offsets, per gain level (low, high) and phase (A, B); zero means unknown.
+ * The offsets are updated only if they change by more than the tolerance, in order to avoid excessive flash wear.
+ */
+constexpr float PersistedCurrentZeroOffsetTolerance = 3e-3F;          ///< Volt, a few ADC LSB
+
+os::config::Param<float> g_config_current_zero_offset_low_a ("drv.cs_ofs_lo_a", 0.0F, 0.0F, 3.3F);
+os::config::Param<float> g_config_current_zero_offset_low_b ("drv.cs_ofs_lo_b", 0.0F, 0.0F, 3.3F);
+os::config::Param<float> g_config_current_zero_offset_high_a("drv.cs_ofs_hi_a", 0.0F, 0.0F, 3.3F);
+os::config::Param<float> g_config_current_zero_offset_high_b("drv.cs_ofs_hi_b", 0.0F, 0.0F, 3.3F);
+
+os::config::Param<float>* const g_config_current_zero_offsets[2][2]     ///< Per gain level, per phase
+{
+    { &g_config_current_zero_offset_low_a,  &g_config_current_zero_offset_low_b },
+    { &g_config_current_zero_offset_high_a, &g_config_current_zero_offset_high_b }
+};
+
+/*
+ * Inverter temperature at which the offsets were obtained, Kelvin; zero means unknown.
+ * If the temperature has changed by more than the threshold, the short verification pass is not trusted.
+ */
+constexpr float MaxTemperatureChangeForCalibrationVerification = 20.0F;      ///< Kelvin
+
+os::config::Param<float> g_config_current_zero_offsets_temperature("drv.cs_ofs_temp", 0.0F, 0.0F, 500.0F);
+
 /*
  * Current state variables
  */
@@ -105,14 +135,27 @@ unsigned g_fast_irq_to_main_irq_period_ratio;
 
 math::Vector<2> g_phase_currents = math::Vector<2>::Zero();     ///< Most recent phase currents measurement
 
+/// Provided by the application for the next period, see setPredictedPhaseCurrents()
+math::Vector<2> g_predicted_phase_currents = math::Vector<2>::Zero();
+bool g_predicted_phase_currents_valid = false;
+
 /// Sometimes referred to as VBAT (ideally it should be volatile)
 float g_inverter_voltage;
 
 /// Raw output voltage of the temperature sensor (not converted to Kelvin) (ideally it should be volatile)
 float g_inverter_temperature_sensor_voltage;
 
+/// Saturates at TemperatureSettlingNumSamples
+unsigned g_inverter_temperature_num_samples = 0;
+
 BoardFeatures* g_board_features = nullptr;
 
+/// Inverter temperature at which the current zero offsets were obtained, Kelvin; zero if unknown
+float g_current_zero_offsets_temperature = 0.0F;
+
+/// Used to detect completion of the calibration from the thread context
+unsigned g_last_seen_current_zero_offsets_update_counter = 0;
+
 
 class IRQTimingStatistics
 {
@@ -514,9 +557,40 @@ inline void checkInvariants()
            (g_canary_d == CanaryValue));
 }
 
+/**
+ * The inverter voltage DMA buffer holds two sequences of samples, the one being written and the previous one.
+ * The DMA counter tells which sequence was completed last, which is normally the one of the current PWM period.
+ * If the conversion has not completed yet, the sequence of the previous period is used.
+ */
+inline float readSynchronizedInverterVoltage()
+{
+    constexpr unsigned NumSequences = InverterVoltageSampleBufferLength / SamplesPerADCPerIRQ;
+
+    const unsigned next_index = (InverterVoltageSampleBufferLength - unsigned(DMA2_Stream0->NDTR)) %
+                                InverterVoltageSampleBufferLength;
+    const unsigned last_sequence = ((next_index / SamplesPerADCPerIRQ) + NumSequences - 1U) % NumSequences;
+
+    std::uint16_t samples[SamplesPerADCPerIRQ];
+    std::copy_n(&g_dma_buffer_inverter_voltage[last_sequence * SamplesPerADCPerIRQ], SamplesPerADCPerIRQ, &samples[0]);
+
+    return g_board_features->convertADCVoltageToInverterVoltage(g_board_features->convertADCSamplesToVoltage(samples));
+}
+
 
 inline void setActive(bool active)
 {
+    if (active)
+    {
+        // The config journal may be programming a word, see the main IRQ; letting it finish before the outputs go live.
+        // The wait is bounded, because the flash can also be busy with the compaction, which takes much longer.
+        const SmallTimeIntervalMeasurer measurer;
+        while (((FLASH->SR & FLASH_SR_BSY) != 0) &&
+               (measurer.sample() < board::ConfigJournal::MaxWordProgrammingTime))
+        {
+            ;
+        }
+    }
+
     setRawPWM(0, 0, 0);
 
     palWritePad(GPIOA, GPIOA_EN_GATE, active);
@@ -529,6 +603,14 @@ inline void setActive(bool active)
     }
 }
 
+/**
+ * The temperature filter starts from zero at boot, so its output is meaningless until it has converged.
+ */
+bool isInverterTemperatureSettled()
+{
+    return g_inverter_temperature_num_samples >= TemperatureSettlingNumSamples;
+}
+
 } // namespace
 
 
@@ -681,7 +763,18 @@ bool PWMHandle::isUnique() const
 
 void beginCalibration()
 {
-    g_board_features->beginCalibration();
+    const float temperature =
+        g_board_features->convertADCVoltageToInverterTemperature(g_inverter_temperature_sensor_voltage);
+
+    // If the current temperature is not known yet (e.g. right after boot), relying on the verification pass alone
+    const bool temperature_known = isInverterTemperatureSettled() &&
+                                   getLimits().measurement_range.inverter_temperature.contains(temperature);
+
+    const bool allow_verification = !temperature_known ||
+                                    (std::abs(temperature - g_current_zero_offsets_temperature) <
+                                     MaxTemperatureChangeForCalibrationVerification);
+
+    g_board_features->beginCalibration(allow_verification);
 }
 
 bool isCalibrationInProgress()
@@ -689,6 +782,82 @@ bool isCalibrationInProgress()
     return g_board_features->isCalibrationInProgress();
 }
 
+bool restoreCalibration()
+{
+    std::array<math::Vector<2>, 2> offsets;
+
+    for (unsigned gain = 0; gain < 2; gain++)
+    {
+        for (unsigned phase = 0; phase < 2; phase++)
+        {
+            offsets[gain][phase] = g_config_current_zero_offsets[gain][phase]->get();
+
+            if (!os::float_eq::positive(offsets[gain][phase]))
+            {
+                return false;
+            }
+        }
+    }
+
+    g_board_features->setCurrentSensorsZeroOffsets(offsets);
+    g_current_zero_offsets_temperature = g_config_current_zero_offsets_temperature.get();
+
+    g_logger.println("Current sensors zero offsets restored: %s %s, obtained at %.1f C",
+                     math::toString(offsets[0]).c_str(), math::toString(offsets[1]).c_str(),
+                     double(math::convertKelvinToCelsius(g_current_zero_offsets_temperature)));
+    return true;
+}
+
+bool persistCalibration()
+{
+    if (g_board_features->isCalibrationInProgress() ||
+        !g_board_features->areCurrentSensorsZeroOffsetsValid())
+    {
+        return false;
+    }
+
+    // The temperature tag is assigned shortly after every completed calibration, once the temperature has settled
+    const unsigned update_counter = g_board_features->getCurrentSensorsZeroOffsetsUpdateCounter();
+    if (update_counter != g_last_seen_current_zero_offsets_update_counter)
+    {
+        if (!isInverterTemperatureSettled())
+        {
+            return false;
+        }
+        g_last_seen_current_zero_offsets_update_counter = update_counter;
+        g_current_zero_offsets_temperature = getStatus().inverter_temperature;
+    }
+
+    const auto offsets = g_board_features->getCurrentSensorsZeroOffsets();
+
+    bool up_to_date = std::abs(g_config_current_zero_offsets_temperature.get() - g_current_zero_offsets_temperature) <
+                      (MaxTemperatureChangeForCalibrationVerification * 0.5F);
+    for (unsigned gain = 0; gain < 2; gain++)
+    {
+        for (unsigned phase = 0; phase < 2; phase++)
+        {
+            up_to_date = up_to_date &&
+                         (std::abs(g_config_current_zero_offsets[gain][phase]->get() - offsets[gain][phase]) <
+                          PersistedCurrentZeroOffsetTolerance);
+        }
+    }
+
+    if (up_to_date)
+    {
+        return false;
+    }
+
+    for (unsigned gain = 0; gain < 2; gain++)
+    {
+        for (unsigned phase = 0; phase < 2; phase++)
+        {
+            (void) g_config_current_zero_offsets[gain][phase]->set(offsets[gain][phase]);
+        }
+    }
+    (void) g_config_current_zero_offsets_temperature.set(g_current_zero_offsets_temperature);
+    return true;
+}
+
 PWMParameters getPWMParameters()
 {
     return g_pwm_params;
@@ -750,6 +919,11 @@ void printStatus()
     {
         std::printf("\t%s\n", math::toString(ofs).c_str());
     }
+    std::printf("Obtained at %.1f C; failed verifications: %u\n",
+                double(math::convertKelvinToCelsius(g_current_zero_offsets_temperature)),
+                g_board_features->getNumberOfFailedCalibrationVerifications());
+
+    std::printf("Power stage:\n%s\n", getPowerStageCharacteristics().toString().c_str());
 
     std::puts("IRQ timing statistics:");
     std::printf("\tFast: %s\n", g_irq_timing_stat_fast.toString().c_str());
@@ -774,6 +948,9 @@ Status getStatus()
     s.inverter_voltage = g_inverter_voltage;
 
     s.current_sensor_gain = g_board_features->getCurrentGain();
+    s.current_gain_switches_to_low = g_board_features->getNumberOfCurrentGainSwitchesToLow();
+    s.current_gain_switches_to_high = g_board_features->getNumberOfCurrentGainSwitchesToHigh();
+    s.blanked_current_samples = g_board_features->getNumberOfBlankedCurrentSamples();
 
     s.power_ok  =  palReadPad(GPIOC, GPIOC_POWER_GOOD);
     s.overload  = !palReadPad(GPIOC, GPIOC_OVER_TEMP_WARNING_INVERSE);
@@ -787,6 +964,17 @@ const Limits& getLimits()
     return g_board_features->getLimits();
 }
 
+const PowerStageCharacteristics& getPowerStageCharacteristics()
+{
+    return g_board_features->getPowerStageCharacteristics();
+}
+
+void setPredictedPhaseCurrents(const math::Vector<2>& phase_currents_ab)
+{
+    g_predicted_phase_currents = phase_currents_ab;
+    g_predicted_phase_currents_valid = true;
+}
+
 }
 }
 
@@ -808,7 +996,7 @@ CH_FAST_IRQ_HANDLER(STM32_ADC_HANDLER)
     /*
      * By the time we get here, the DMA controller should have completed all transfers.
      * Making sure this assumption is true.
-     * Note that we're not checking the inverter voltage DMA channel, because it works asynchronously (see constants).
+     * Note that we're not checking the inverter voltage DMA channel, see readSynchronizedInverterVoltage().
      */
 #ifndef NDEBUG
     constexpr unsigned DMATransferCompleteMask = DMA_LISR_TCIF1 | DMA_LISR_TCIF2;
@@ -831,18 +1019,36 @@ CH_FAST_IRQ_HANDLER(STM32_ADC_HANDLER)
     const bool currents_valid = (PWMHandle::getTotalNumberOfActiveHandles() > 0) &&
                                 g_board_features->areCurrentSensorOutputsValid(phase_currents_adc_voltages);
 
-    g_phase_currents = currents_valid ?
-        g_board_features->convertADCVoltagesToPhaseCurrents(phase_currents_adc_voltages) :
-        math::Vector<2>::Zero();
+    // The prediction is made in the previous period for this one, so it's the best substitute for a bad sample
+    const bool prediction_valid = g_predicted_phase_currents_valid;
+    const math::Vector<2> prediction = g_predicted_phase_currents;
 
-    {
-        const float new_inverter_voltage = g_board_features->convertADCVoltageToInverterVoltage(
-            g_board_features->convertADCSamplesToVoltage(g_dma_buffer_inverter_voltage));
+    const bool currents_transitional = g_board_features->checkAndCountTransitionalCurrentSample();
 
-        g_inverter_voltage += InverterVoltageInnovationWeight * (new_inverter_voltage - g_inverter_voltage);
+    if (!currents_valid)
+    {
+        g_phase_currents = math::Vector<2>::Zero();
+    }
+    else if (currents_transitional)
+    {
+        if (prediction_valid)
+        {
+            g_phase_currents = prediction;
+        }
+        // Otherwise repeating the previous measurement
+    }
+    else
+    {
+        g_phase_currents = g_board_features->convertADCVoltagesToPhaseCurrents(phase_currents_adc_voltages);
     }
 
-    handleFastIRQ(g_phase_currents, g_inverter_voltage);
+    g_predicted_phase_currents_valid = false;       // Will be updated by the application, if supported
+
+    const float synchronized_inverter_voltage = readSynchronizedInverterVoltage();
+
+    g_inverter_voltage += InverterVoltageInnovationWeight * (synchronized_inverter_voltage - g_inverter_voltage);
+
+    handleFastIRQ(g_phase_currents, synchronized_inverter_voltage);
 
     /*
      * Current AGC, calibration, that kind of stuff goes here because it's not very time-critical.
@@ -853,7 +1059,17 @@ CH_FAST_IRQ_HANDLER(STM32_ADC_HANDLER)
     }
     else
     {
-        g_board_features->adjustCurrentGain(g_pwm_params.period, g_phase_currents);
+        const bool pwm_outputs_zero = currents_valid && !currents_transitional &&
+                                      ((TIM1->CCR1 | TIM1->CCR2 | TIM1->CCR3) == 0);
+        g_board_features->trackCurrentSensorsZeroOffsets(g_pwm_params.period, pwm_outputs_zero,
+                                                         prediction_valid ? &prediction : nullptr,
+                                                         phase_currents_adc_voltages);
+
+        // Switching right after the sampling instant, so that the amplifier has most of the period to settle
+        g_board_features->adjustCurrentGain(g_pwm_params.period,
+                                            g_phase_currents,
+                                            g_predicted_phase_currents_valid ? g_predicted_phase_currents :
+                                                                               g_phase_currents);
     }
 
     /*
@@ -910,6 +1126,21 @@ CH_FAST_IRQ_HANDLER(STM32_TIM8_CC_HANDLER)
         const float new_temperature = g_board_features->convertADCSamplesToVoltage(temperature_sample);
         g_inverter_temperature_sensor_voltage +=
             TemperatureInnovationWeight * (new_temperature - g_inverter_temperature_sensor_voltage);
+
+        if (g_inverter_temperature_num_samples < TemperatureSettlingNumSamples)
+        {
+            g_inverter_temperature_num_samples++;
+        }
+    }
+
+    /*
+     * Programming a flash word stalls the instruction fetch from the flash, and therefore the fast IRQ, for 16 us
+     * typical and up to 100 us worst case per the datasheet, which exceeds the PWM period. Hence the pending config
+     * records are programmed only while the power stage is inactive.
+     */
+    if (PWMHandle::getTotalNumberOfActiveHandles() == 0)
+    {
+        board::ConfigJournal::processPendingWriteFromIRQ();
     }
 }
 
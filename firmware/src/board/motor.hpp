@@ -88,6 +88,8 @@ public:
  * This function can be invoked to perform zero offset calibration.
  * It must be guaranteed that during such calibration the motor is NOT spinning,
  * and that no other component will be using the driver while the calibration is in progress.
+ * If the offsets are already known and the inverter temperature did not change much since they were obtained,
+ * the calibration completes in a few tens of milliseconds unless the known offsets turn out to be inconsistent.
  * See also @ref isCalibrationInProgress().
  */
 void beginCalibration();
@@ -97,6 +99,21 @@ void beginCalibration();
  */
 bool isCalibrationInProgress();
 
+/**
+ * The results of the zero offset calibration are persisted in the configuration parameters together with the
+ * inverter temperature, which allows the driver to replace the lengthy calibration with a short verification pass.
+ * This function loads the persisted results, if available, and returns true on success.
+ * Must not be invoked while calibration is in progress. Must not be invoked from IRQ context.
+ */
+bool restoreCalibration();
+
+/**
+ * Writes the results of the last calibration into the configuration parameters, unless they are already up to date.
+ * The parameters are not committed to the non-volatile storage; that is the responsibility of the application.
+ * Returns true if the parameters were updated. Must not be invoked from IRQ context.
+ */
+bool persistCalibration();
+
 /**
  * Static PWM parameters; guaranteed to stay constant as long as the firmware is running.
  */
@@ -156,6 +173,9 @@ struct Status
     float inverter_voltage = 0.0F;              ///< Volt
 
     float current_sensor_gain = 0.0F;           ///< Volt/Volt
+    unsigned current_gain_switches_to_low = 0;
+    unsigned current_gain_switches_to_high = 0;
+    unsigned blanked_current_samples = 0;       ///< Replaced with the prediction, see setPredictedPhaseCurrents()
 
     bool power_ok = false;                      ///< PWRGD
     bool overload = false;                      ///< OCTW
@@ -169,18 +189,23 @@ struct Status
 
     auto toString() const
     {
-        return os::heapless::format("Inverter Temperature: %.0f C\n"
-                                    "Inverter Voltage    : %.1f\n"
-                                    "Current Sensor Gain : %.1f\n"
-                                    "Power OK            : %u\n"
-                                    "Overload            : %u\n"
-                                    "Fault               : %u",
-                                    double(math::convertKelvinToCelsius(inverter_temperature)),
-                                    double(inverter_voltage),
-                                    double(current_sensor_gain),
-                                    power_ok,
-                                    overload,
-                                    fault);
+        return os::heapless::String<300>("Inverter Temperature: %.0f C\n"
+                                         "Inverter Voltage    : %.1f\n"
+                                         "Current Sensor Gain : %.1f\n"
+                                         "Gain Switches L/H   : %u/%u\n"
+                                         "Blanked Samples     : %u\n"
+                                         "Power OK            : %u\n"
+                                         "Overload            : %u\n"
+                                         "Fault               : %u").format(
+            double(math::convertKelvinToCelsius(inverter_temperature)),
+            double(inverter_voltage),
+            double(current_sensor_gain),
+            current_gain_switches_to_low,
+            current_gain_switches_to_high,
+            blanked_current_samples,
+            power_ok,
+            overload,
+            fault);
     }
 };
 
@@ -228,6 +253,49 @@ struct Limits
  */
 const Limits& getLimits();
 
+/**
+ * Board-specific characteristics of the power stage that are needed for the thermal modeling.
+ * All six MOSFETs are lumped together, sharing the same thermal path to the temperature sensor.
+ */
+struct PowerStageCharacteristics
+{
+    float mosfet_on_resistance = 0.0F;                  ///< Ohm, at the typical junction temperature
+    float mosfet_switching_time = 0.0F;                 ///< Second, rise plus fall
+    float junction_to_sensor_thermal_resistance = 0.0F; ///< Kelvin/Watt
+    float junction_thermal_time_constant = 0.0F;        ///< Second
+    float max_junction_temperature = 0.0F;              ///< Kelvin
+
+    auto toString() const
+    {
+        return os::heapless::format("MOSFET Rds(on)      : %.1f mOhm\n"
+                                    "MOSFET Switching    : %.0f ns\n"
+                                    "Junction-Sensor Rth : %.2f K/W, %.1f s\n"
+                                    "Max Junction Temp   : %.0f C",
+                                    double(mosfet_on_resistance * 1e3F),
+                                    double(mosfet_switching_time * 1e9F),
+                                    double(junction_to_sensor_thermal_resistance),
+                                    double(junction_thermal_time_constant),
+                                    double(math::convertKelvinToCelsius(max_junction_temperature)));
+    }
+};
+
+/**
+ * @ref PowerStageCharacteristics
+ */
+const PowerStageCharacteristics& getPowerStageCharacteristics();
+
+/**
+ * Phase currents that the application expects to be measured in the next PWM period, e.g. computed from the current
+ * setpoint and the angular position extrapolated one period ahead. This function can be invoked only from
+ * @ref handleFastIRQ(); the prediction is valid for the next period only, and it is discarded afterwards.
+ *
+ * The prediction is used by the current amplifier gain control logic, which switches to the low gain before
+ * the amplifier output saturates rather than after. Also, the sample that is taken right after the gain switch
+ * is replaced with the prediction, because the amplifier output is not settled yet; if no prediction is available,
+ * the previous measurement is repeated instead.
+ */
+void setPredictedPhaseCurrents(const math::Vector<2>& phase_currents_ab);
+
 /**
  * This external handler is invoked from the HIGHEST PRIORITY IRQ context shortly after the middle of every PWM
  * period, as soon as the corresponding ADC measurements are processed.
@@ -236,7 +304,9 @@ const Limits& getLimits();
  * This IRQ preempts every other process and maskable IRQ handler in the system.
  *
  * @param phase_currents_ab             Instant currents of phases A and B, in Amperes.
- * @param inverter_voltage              Low-pass filtered VBUS voltage of the inverter, in Volts.
+ * @param inverter_voltage              VBUS voltage of the inverter sampled in the same PWM period as the currents,
+ *                                      or in the previous one if the conversion has not completed yet; in Volts.
+ *                                      It is not filtered, so that the PWM can compensate for the bus voltage ripple.
  */
 extern void handleFastIRQ(const math::Vector<2>& phase_currents_ab,
                           const float inverter_voltage);
@@ -43,10 +43,37 @@ class BoardFeatures final
 
     static constexpr float CurrentOffsetCalibrationDuration = 1.0F;
 
+    /**
+     * If the offsets are already known (calibrated earlier or restored from the configuration), a short verification
+     * pass is performed instead of the full calibration. If the newly measured offsets deviate from the known ones
+     * by more than the tolerance, the full calibration is performed.
+     */
+    static constexpr float CurrentOffsetVerificationDuration  = 0.03F;                  ///< Second, per gain level
+    static constexpr float CurrentOffsetVerificationTolerance = 0.01F;                  ///< Volt
+
+    /**
+     * Zero PWM outputs alone do not imply zero phase currents: a rotating motor drives current through the
+     * low side switches. Therefore the offsets are tracked in the background only while the outputs are at zero
+     * AND the application's estimate of the phase currents is near zero as well; no estimate means no tracking.
+     * The settling time lets the current decay after the outputs have been zeroed; the window rejects samples
+     * that are clearly off. The time constant is long, since the offsets only drift with the temperature.
+     */
+    static constexpr float CurrentOffsetTrackingSettlingTime      = 0.002F;             ///< Second
+    static constexpr float CurrentOffsetTrackingWindow            = 0.005F;             ///< Volt
+    static constexpr float CurrentOffsetTrackingTimeConstant      = 5.0F;               ///< Second
+    static constexpr float CurrentOffsetTrackingMaxEstimatedCurrent = 0.1F;             ///< Ampere
+
     static constexpr float MaxUnipolarVoltageAtCurrentSensorOutput  = (ADCReferenceVoltage / 2.0F) * 0.9F;  ///< Volt
     static constexpr float MinCurrentGainSwitchInterval             = 0.01F;                                ///< Second
     static constexpr float CurrentGainAdjustmentHysteresisCoeff     = 0.9F;
 
+    /**
+     * The gain is switched from the fast IRQ right after the current samples are taken, in the middle of the PWM
+     * period; this gives the amplifier the longest possible time to settle before the next sampling instant.
+     * Nevertheless, the samples that are taken right after the switch may be distorted, so they are discarded.
+     */
+    static constexpr unsigned NumTransitionalCurrentSamples         = 1;
+
     /**
      * If both current sensors output voltages lower than this, we assume that the current amplifiers are
      * not yet activated.
@@ -62,11 +89,13 @@ class BoardFeatures final
         float duration = 0;
         math::CumulativeAverageComputer<math::Vector<2>> averager;
         bool in_progress = false;
+        bool verification = false;          ///< Short verification pass rather than full calibration
 
         void reset()
         {
             pwm_handle.release();
             in_progress = false;
+            verification = false;
             resetDurationAndAverage();
         }
 
@@ -92,6 +121,8 @@ class BoardFeatures final
 
         Limits limits;
 
+        PowerStageCharacteristics power_stage;
+
         struct DefaultSettings
         {
             float pwm_frequency = 0;
@@ -104,8 +135,16 @@ class BoardFeatures final
 
     // State variables
     std::array<math::Vector<2>, 2> current_zero_offsets_low_high_{};             ///< Per gain level
+    bool current_zero_offsets_valid_ = false;                                     ///< Calibrated or restored
+    unsigned current_zero_offsets_update_counter_ = 0;                           ///< Incremented on (re)calibration
+    unsigned num_failed_verifications_ = 0;
+    float time_since_pwm_outputs_were_zeroed_ = 0.0F;
     bool current_amplifier_high_gain_selected_ = true;
     float time_since_current_was_above_high_gain_threshold_ = 0.0F;
+    unsigned num_transitional_current_samples_left_ = 0;
+    unsigned num_current_gain_switches_to_low_ = 0;
+    unsigned num_current_gain_switches_to_high_ = 0;
+    unsigned num_blanked_current_samples_ = 0;
 
     CurrentZeroOffsetCalibrator current_zero_offset_calibrator_;
 
@@ -121,6 +160,19 @@ class BoardFeatures final
         current_amplifier_high_gain_selected_ = high;
     }
 
+    /**
+     * Same as above, but counts the switch events and marks the following samples as transitional.
+     */
+    void switchCurrentAmplifierGain(bool high)
+    {
+        if (high != current_amplifier_high_gain_selected_)
+        {
+            setCurrentAmplifierGain(high);
+            num_transitional_current_samples_left_ = NumTransitionalCurrentSamples;
+            (high ? num_current_gain_switches_to_high_ : num_current_gain_switches_to_low_)++;
+        }
+    }
+
 
     static BoardConfig detectBoardConfig()
     {
@@ -143,6 +195,14 @@ class BoardFeatures final
             lim.safe_operating_area.inverter_temperature.max = math::convertCelsiusToKelvin(85.0F);
             lim.safe_operating_area.inverter_voltage = { 8.0F, 51.0F };
 
+            // Conservative estimates; the thermal path is dominated by the PCB copper next to the sensor
+            PowerStageCharacteristics ps;
+            ps.mosfet_on_resistance = 3.5e-3F;
+            ps.mosfet_switching_time = 100e-9F;
+            ps.junction_to_sensor_thermal_resistance = 3.0F;
+            ps.junction_thermal_time_constant = 4.0F;
+            ps.max_junction_temperature = math::convertCelsiusToKelvin(125.0F);
+
             return {
                 "Pixhawk ESC v1.6",
                 compute_resistor_divider_gain(5100 * 2, 330 * 2),
@@ -150,6 +210,7 @@ class BoardFeatures final
                 { 10.0F, 40.0F },
                 temp_tf_MCP9700,
                 lim,
+                ps,
                 {
                     50e3F,
                     200e-9F
@@ -176,6 +237,8 @@ public:
 
     const Limits& getLimits() const { return board_config_.limits; }
 
+    const PowerStageCharacteristics& getPowerStageCharacteristics() const { return board_config_.power_stage; }
+
     const BoardConfig::DefaultSettings& getDefaultSettings() const { return board_config_.default_settings; }
 
     float convertADCVoltageToInverterVoltage(float voltage) const
@@ -183,8 +246,14 @@ public:
         return voltage * board_config_.inverter_voltage_gain;
     }
 
+    /**
+     * Must be invoked every PWM period while calibration is not in progress, right after the currents are sampled.
+     * @param measured_currents     Phase currents measured in the current period.
+     * @param predicted_currents    Phase currents expected in the next period; if not known, pass the measured ones.
+     */
     void adjustCurrentGain(const float period,
-                           const math::Vector<2>& currents)
+                           const math::Vector<2>& measured_currents,
+                           const math::Vector<2>& predicted_currents)
     {
         assert(!isCalibrationInProgress());
 
@@ -194,12 +263,14 @@ public:
 
         const float lower_threshold = upper_threshold * CurrentGainAdjustmentHysteresisCoeff;
 
-        const float peak = currents.lpNorm<Eigen::Infinity>();
+        // The prediction allows to switch to the low gain before the amplifier output saturates
+        const float peak = std::max(measured_currents.lpNorm<Eigen::Infinity>(),
+                                    predicted_currents.lpNorm<Eigen::Infinity>());
 
         if (peak > (current_amplifier_high_gain_selected_ ? upper_threshold : lower_threshold))
         {
             // Current above threshold, selecting low gain
-            setCurrentAmplifierGain(false);
+            switchCurrentAmplifierGain(false);
 
             time_since_current_was_above_high_gain_threshold_ = 0.0F;
         }
@@ -208,7 +279,7 @@ public:
             // Current below threshold, checking if we're allowed to switch
             if (time_since_current_was_above_high_gain_threshold_ > MinCurrentGainSwitchInterval)
             {
-                setCurrentAmplifierGain(true);
+                switchCurrentAmplifierGain(true);
             }
             else
             {
@@ -217,12 +288,96 @@ public:
         }
     }
 
+    /**
+     * Must be invoked once per PWM period before the current samples are processed.
+     * Returns true if the samples of the current period were taken while the amplifier was settling after
+     * a gain switch, in which case they must be discarded.
+     */
+    bool checkAndCountTransitionalCurrentSample()
+    {
+        if (num_transitional_current_samples_left_ > 0)
+        {
+            num_transitional_current_samples_left_--;
+            num_blanked_current_samples_++;
+            return true;
+        }
+        return false;
+    }
+
+    unsigned getNumberOfCurrentGainSwitchesToLow() const { return num_current_gain_switches_to_low_; }
+    unsigned getNumberOfCurrentGainSwitchesToHigh() const { return num_current_gain_switches_to_high_; }
+    unsigned getNumberOfBlankedCurrentSamples() const { return num_blanked_current_samples_; }
+
     float getCurrentGain() const
     {
         return board_config_.current_amplifier_low_high_gains[int(current_amplifier_high_gain_selected_)];
     }
 
-    auto getCurrentSensorsZeroOffsets() const { return current_zero_offsets_low_high_; }
+    /**
+     * The offsets are updated from the IRQ by the background tracking, hence the copy is made in a critical section.
+     */
+    std::array<math::Vector<2>, 2> getCurrentSensorsZeroOffsets() const
+    {
+        AbsoluteCriticalSectionLocker locker;
+        return current_zero_offsets_low_high_;
+    }
+
+    void setCurrentSensorsZeroOffsets(const std::array<math::Vector<2>, 2>& offsets)
+    {
+        AbsoluteCriticalSectionLocker locker;
+        assert(!isCalibrationInProgress());
+        current_zero_offsets_low_high_ = offsets;
+        current_zero_offsets_valid_ = true;
+    }
+
+    /**
+     * Returns true if the offsets were either calibrated or restored since boot.
+     */
+    bool areCurrentSensorsZeroOffsetsValid() const { return current_zero_offsets_valid_; }
+
+    /**
+     * Incremented every time the calibration or the verification pass completes.
+     * Background tracking does not affect this counter.
+     */
+    unsigned getCurrentSensorsZeroOffsetsUpdateCounter() const { return current_zero_offsets_update_counter_; }
+
+    unsigned getNumberOfFailedCalibrationVerifications() const { return num_failed_verifications_; }
+
+    /**
+     * Must be invoked every PWM period while calibration is not in progress.
+     * @param pwm_outputs_zero      True if the driver is active and all PWM outputs are at zero.
+     * @param estimated_currents    Phase currents estimated by the application for this sample, if available.
+     */
+    void trackCurrentSensorsZeroOffsets(const float period,
+                                        const bool pwm_outputs_zero,
+                                        const math::Vector<2>* const estimated_currents,
+                                        const math::Vector<2>& current_sensors_output_voltages)
+    {
+        assert(!isCalibrationInProgress());
+
+        const bool currents_zero =
+            (estimated_currents != nullptr) &&
+            (estimated_currents->lpNorm<Eigen::Infinity>() < CurrentOffsetTrackingMaxEstimatedCurrent);
+
+        if (!pwm_outputs_zero || !currents_zero || !current_zero_offsets_valid_)
+        {
+            time_since_pwm_outputs_were_zeroed_ = 0.0F;
+            return;
+        }
+
+        if (time_since_pwm_outputs_were_zeroed_ < CurrentOffsetTrackingSettlingTime)
+        {
+            time_since_pwm_outputs_were_zeroed_ += period;
+            return;
+        }
+
+        auto& offsets = current_zero_offsets_low_high_[int(current_amplifier_high_gain_selected_)];
+        const math::Vector<2> error = current_sensors_output_voltages - offsets;
+        if (error.lpNorm<Eigen::Infinity>() < CurrentOffsetTrackingWindow)
+        {
+            offsets += error * (period / (period + CurrentOffsetTrackingTimeConstant));
+        }
+    }
 
     math::Vector<2> convertADCVoltagesToPhaseCurrents(const math::Vector<2>& raw_voltages) const
     {
@@ -234,7 +389,11 @@ public:
         return board_config_.temperature_transfer_function(voltage);
     }
 
-    void beginCalibration()
+    /**
+     * @param allow_verification    If true, and the offsets are already known, only a short verification pass
+     *                              will be performed, which falls back to the full calibration if necessary.
+     */
+    void beginCalibration(const bool allow_verification)
     {
         AbsoluteCriticalSectionLocker locker;
 
@@ -244,6 +403,7 @@ public:
 
             current_zero_offset_calibrator_.reset();
             current_zero_offset_calibrator_.in_progress = true;
+            current_zero_offset_calibrator_.verification = allow_verification && current_zero_offsets_valid_;
             current_zero_offset_calibrator_.pwm_handle.setPWM(math::Vector<3>::Zero());
 
             assert(current_zero_offset_calibrator_.pwm_handle.isUnique());
@@ -265,16 +425,40 @@ public:
         current_zero_offset_calibrator_.averager.addSample(current_sensors_output_voltages);
         current_zero_offset_calibrator_.duration += period;
 
-        if (current_zero_offset_calibrator_.duration > CurrentOffsetCalibrationDuration)
+        const float required_duration = current_zero_offset_calibrator_.verification ?
+                                        CurrentOffsetVerificationDuration :
+                                        CurrentOffsetCalibrationDuration;
+
+        if (current_zero_offset_calibrator_.duration > required_duration)
         {
+            auto& offsets = current_zero_offsets_low_high_[int(current_amplifier_high_gain_selected_)];
+            const math::Vector<2> average = current_zero_offset_calibrator_.averager.getAverage();
+
+            if (current_zero_offset_calibrator_.verification &&
+                ((average - offsets).lpNorm<Eigen::Infinity>() > CurrentOffsetVerificationTolerance))
+            {
+                // The known offsets are no good, starting over with the full calibration
+                num_failed_verifications_++;
+                current_zero_offset_calibrator_.verification = false;
+                setCurrentAmplifierGain(false);
+                current_zero_offset_calibrator_.resetDurationAndAverage();
+                return;
+            }
+
+            if (!current_zero_offset_calibrator_.verification)
+            {
+                // A passed verification keeps the offsets, the short average is noisier than the calibrated one
+                offsets = average;
+            }
+
             if (current_amplifier_high_gain_selected_)
             {
-                current_zero_offsets_low_high_[1] = current_zero_offset_calibrator_.averager.getAverage();
+                current_zero_offsets_valid_ = true;
+                current_zero_offsets_update_counter_++;
                 current_zero_offset_calibrator_.reset();
             }
             else
             {
-                current_zero_offsets_low_high_[0] = current_zero_offset_calibrator_.averager.getAverage();
                 setCurrentAmplifierGain(true);
                 current_zero_offset_calibrator_.resetDurationAndAverage();
             }
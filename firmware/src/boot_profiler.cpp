@@ -0,0 +1,95 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "boot_profiler.hpp"
+#include <zubax_chibios/os.hpp>
+#include <cstdio>
+#include <array>
+
+
+namespace boot_profiler
+{
+namespace
+{
+
+struct Mark
+{
+    const char* stage = nullptr;
+    ::systime_t timestamp = 0;
+};
+
+std::array<Mark, 16> g_marks;
+unsigned g_num_marks = 0;
+
+std::uint32_t convertToMSec(::systime_t x)
+{
+    return std::uint32_t(ST2MS(x));
+}
+
+}
+
+void mark(const char* stage)
+{
+    os::CriticalSectionLocker locker;
+
+    if (g_num_marks < g_marks.size())
+    {
+        g_marks[g_num_marks].stage = stage;
+        g_marks[g_num_marks].timestamp = chVTGetSystemTimeX();
+        g_num_marks++;
+    }
+}
+
+std::uint32_t getTimeOfLastMarkMSec()
+{
+    os::CriticalSectionLocker locker;
+    return (g_num_marks > 0) ? convertToMSec(g_marks[g_num_marks - 1].timestamp) : 0;
+}
+
+void print()
+{
+    std::array<Mark, g_marks.size()> marks;
+    unsigned num_marks = 0;
+
+    {
+        os::CriticalSectionLocker locker;
+        marks = g_marks;
+        num_marks = g_num_marks;
+    }
+
+    std::puts("Boot stage                      Time [ms]  Delta [ms]");
+
+    ::systime_t prev_timestamp = 0;
+    for (unsigned i = 0; i < num_marks; i++)
+    {
+        std::printf("%-30s  %9lu  %10lu\n",
+                    marks[i].stage,
+                    static_cast<unsigned long>(convertToMSec(marks[i].timestamp)),
+                    static_cast<unsigned long>(convertToMSec(marks[i].timestamp - prev_timestamp)));
+        prev_timestamp = marks[i].timestamp;
+    }
+}
+
+}
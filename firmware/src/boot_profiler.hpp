@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+
+
+/**
+ * Boot-time profiler.
+ * Each initialization stage marks its completion; the timestamps are relative to the OS start.
+ * Stages may be marked from different threads, e.g. the CAN bus initialization is performed by the UAVCAN node thread
+ * concurrently with the motor driver calibration.
+ */
+namespace boot_profiler
+{
+/**
+ * Records the completion of a stage. The string must be static.
+ * Marks that don't fit into the internal buffer are ignored.
+ * Thread safe; must not be invoked from IRQ context.
+ */
+void mark(const char* stage);
+
+/**
+ * Returns the time of the most recent mark, in milliseconds since the OS start.
+ */
+std::uint32_t getTimeOfLastMarkMSec();
+
+/**
+ * Prints all marks into stdout.
+ */
+void print();
+
+}
@@ -38,6 +38,7 @@
 #include <foc/irq_debug.hpp>
 #include <motor_database/motor_database.hpp>
 #include <params.hpp>
+#include <boot_profiler.hpp>
 
 #include <cstdlib>
 #include <unistd.h>
@@ -206,6 +207,26 @@ public:
                             double(info.mechanical_rpm),
                             double(info.demand_factor_filtered * 100.0F),
                             static_cast<unsigned>(info.stall_count));
+
+                if (info.desync_count > 0)
+                {
+                    std::printf("%5u desyncs, last detected by %s\n",
+                                static_cast<unsigned>(info.desync_count),
+                                info.last_desync_cause);
+                }
+
+                std::printf("%6.0f Hz CL  %5.0f us CL delay\n",
+                            double(info.current_loop_bandwidth),
+                            double(info.current_loop_delay * 1e6F));
+
+                if (info.phase_resistance > 0)
+                {
+                    std::printf("%6.1f mOhm Rs %5.2f mWb phi %5.1f C wind%s\n",
+                                double(info.phase_resistance * 1e3F),
+                                double(info.field_flux * 1e3F),
+                                double(info.winding_temperature),
+                                info.parameter_estimate_frozen ? " (frozen)" : "");
+                }
                 printed = true;
             }
         }
@@ -251,6 +272,34 @@ public:
 
         assert(printed);
 
+        {
+            const auto th = foc::getThermalState();
+            std::printf("%5.1f C inv  %5.1f C junc  %5.1f W loss",
+                        double(th.inverter_temperature),
+                        double(th.junction_temperature),
+                        double(th.inverter_power_loss));
+            if (th.winding_model_enabled)
+            {
+                std::printf("  %5.1f C wind  %5.1f W loss",
+                            double(th.winding_temperature),
+                            double(th.winding_power_loss));
+            }
+            std::printf("  %5.1f A limit\n", double(th.current_limit));
+        }
+
+        {
+            const auto bus = foc::getBusState();
+            std::printf("%5.2f V bus  %5.2f A  %5.3f V ripple", double(bus.voltage), double(bus.current),
+                        double(bus.ripple));
+            if (bus.source_resistance_known)
+            {
+                std::printf("  %5.1f mOhm source  %5.2f V open circuit",
+                            double(bus.source_resistance * 1e3F),
+                            double(bus.open_circuit_voltage));
+            }
+            std::puts("");
+        }
+
         {
             const auto kv = foc::getDebugKeyValuePairs();
             if (std::any_of(kv.begin(), kv.end(), [](auto& item) { return !item.first.empty(); }))
@@ -613,7 +662,7 @@ class MotorIdentificationCommand : public os::shell::ICommandHandler
         {
             ios.print("Perform motor identification using the specified mode.\n");
             ios.print("Option -p will plot the real time values.\n");
-            ios.print("\t%s static|rotating [-p]\n", argv[0]);
+            ios.print("\t%s static|broadband|rotating|mechanical [-p]\n", argv[0]);
             return;
         }
 
@@ -637,10 +686,18 @@ class MotorIdentificationCommand : public os::shell::ICommandHandler
         {
             mode = foc::motor_id::Mode::Static;
         }
+        else if (mode_string == "broadband")
+        {
+            mode = foc::motor_id::Mode::StaticBroadband;
+        }
         else if (mode_string == "rotating")
         {
             mode = foc::motor_id::Mode::RotationWithoutMechanicalLoad;
         }
+        else if (mode_string == "mechanical")
+        {
+            mode = foc::motor_id::Mode::Mechanical;
+        }
         else
         {
             ios.print("ERROR: Invalid identification mode: %s\n", mode_string.c_str());
@@ -698,7 +755,17 @@ class MotorIdentificationCommand : public os::shell::ICommandHandler
             const auto params = foc::getMotorParameters();
             ios.puts(params.toString().c_str());
 
-            if (params.isValid())
+            const auto stat = foc::getMotorIdentificationStatistics();
+            if (stat.getNumRuns() > 1)
+            {
+                ios.puts(stat.toString().c_str());
+            }
+
+            if (!stat.isRepeatable(foc::getParameters().motor_id.max_relative_deviation))
+            {
+                ios.puts("Results are not repeatable, custom params are left unchanged");
+            }
+            else if (params.isValid())
             {
                 ios.puts("Overwriting custom motor params with identified values");
                 params::writeMotorParameters(params);
@@ -913,6 +980,50 @@ class PlotCommand : public os::shell::ICommandHandler
 } static cmd_plot;
 
 
+class BenchmarkCommand : public os::shell::ICommandHandler
+{
+    const char* getName() const override { return "bench"; }
+
+    void execute(os::shell::BaseChannelWrapper& ios, int, char**) override
+    {
+        ios.puts("Measuring the fast IRQ task dispatch, please wait...");
+
+        const auto res = foc::benchmarkTaskDispatch();
+
+        ios.print("Task            : %s\n", res.task_name);
+        ios.print("Static dispatch : %.1f cycles\n", double(res.static_dispatch_cycles));
+        ios.print("Virtual dispatch: %.1f cycles\n", double(res.virtual_dispatch_cycles));
+        ios.print("Samples         : %u\n", res.num_samples);
+    }
+} static cmd_bench;
+
+
+class EstimatorComparisonCommand : public os::shell::ICommandHandler
+{
+    const char* getName() const override { return "est"; }
+
+    void execute(os::shell::BaseChannelWrapper& ios, int, char**) override
+    {
+        foc::observer::EstimatorComparisonStatistics st;
+        if (!foc::getEstimatorComparisonStatistics(st))
+        {
+            ios.puts("Not available. The motor must be running with ctrl.est_shadow enabled.");
+            return;
+        }
+
+        static constexpr float RadToDeg = 180.0F / math::Pi;
+
+        ios.print("Primary / shadow   : %s / %s\n", st.primary_name, st.shadow_name);
+        ios.print("Samples            : %u\n", unsigned(st.num_samples));
+        ios.print("Angle error mean   : %.2f deg\n", double(st.angle_error_mean * RadToDeg));
+        ios.print("Angle error RMS    : %.2f deg\n", double(st.angle_error_rms * RadToDeg));
+        ios.print("Angle error max    : %.2f deg\n", double(st.angle_error_max * RadToDeg));
+        ios.print("Velocity error RMS : %.1f rad/s\n", double(st.angular_velocity_error_rms));
+        ios.print("Cycles per update  : %.0f / %.0f\n", double(st.primary_cycles), double(st.shadow_cycles));
+    }
+} static cmd_estimator_comparison;
+
+
 class SystemInfoCommand : public os::shell::ICommandHandler
 {
     const char* getName() const override { return "sysinfo"; }
@@ -1025,13 +1136,16 @@ class SystemInfoCommand : public os::shell::ICommandHandler
 
         ios.puts("\nThreads:");
         showThreads(ios);
+
+        ios.puts("\nBoot profile:");
+        boot_profiler::print();
     }
 } static cmd_sysinfo;
 
 
 class CLIThread : public chibios_rt::BaseStaticThread<2048>
 {
-    os::shell::Shell<20> shell_;
+    os::shell::Shell<24> shell_;
     os::Logger logger{"CLI"};
 
     void main() override
@@ -1083,6 +1197,8 @@ public:
         (void) shell_.addCommandHandler(&cmd_motor_database);
         (void) shell_.addCommandHandler(&cmd_plot);
         (void) shell_.addCommandHandler(&cmd_sysinfo);
+        (void) shell_.addCommandHandler(&cmd_bench);
+        (void) shell_.addCommandHandler(&cmd_estimator_comparison);
     }
 
     virtual ~CLIThread() { }
@@ -39,7 +39,7 @@ class BeepingTask : public ITask
 
     static constexpr Result::ExitCode ExitCodeBadHardwareStatus = 1;
 
-    const TaskContext context_;
+    const TaskContext& context_;     ///< Owned by the task handler, stays valid and immutable while the task exists
 
     Const excitation_period_ = 0;
 
@@ -0,0 +1,226 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <math/math.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+
+namespace foc
+{
+
+using math::Scalar;
+using math::Const;
+using math::Vector;
+
+/**
+ * Per PWM period samples of the DC bus collected by the fast IRQ.
+ * The voltage is accumulated relative to the first sample, otherwise the variance would be lost in the rounding.
+ */
+struct BusSampleAccumulator
+{
+    Scalar reference_voltage = 0;
+    Scalar sum_voltage_deviation = 0;
+    Scalar sum_voltage_deviation_squared = 0;
+    Scalar sum_current = 0;
+    std::uint32_t num_samples = 0;
+
+    /**
+     * @param inverter_voltage      Synchronized with the current sample, Volt.
+     * @param pwm_setpoint          Applied during the period when the currents were sampled.
+     * @param phase_currents_ab     Ampere.
+     */
+    void add(Const inverter_voltage,
+             const Vector<3>& pwm_setpoint,
+             const Vector<2>& phase_currents_ab)
+    {
+        // The bus current averaged over the PWM period is the sum of the phase currents weighted by the duty cycles
+        Const ic = -phase_currents_ab[0] - phase_currents_ab[1];
+        Const current = pwm_setpoint[0] * phase_currents_ab[0] +
+                        pwm_setpoint[1] * phase_currents_ab[1] +
+                        pwm_setpoint[2] * ic;
+
+        if (num_samples == 0)
+        {
+            reference_voltage = inverter_voltage;
+        }
+
+        Const deviation = inverter_voltage - reference_voltage;
+        sum_voltage_deviation += deviation;
+        sum_voltage_deviation_squared += deviation * deviation;
+        sum_current += current;
+        num_samples++;
+    }
+
+    void add(const BusSampleAccumulator& other)
+    {
+        if (num_samples == 0)
+        {
+            *this = other;
+            return;
+        }
+
+        // Moving the other sums to our reference
+        Const shift = other.reference_voltage - reference_voltage;
+        Const n = Scalar(other.num_samples);
+
+        sum_voltage_deviation_squared += other.sum_voltage_deviation_squared +
+                                         2.0F * shift * other.sum_voltage_deviation +
+                                         n * shift * shift;
+        sum_voltage_deviation += other.sum_voltage_deviation + n * shift;
+        sum_current += other.sum_current;
+        num_samples += other.num_samples;
+    }
+
+    Scalar getMeanVoltage() const
+    {
+        return reference_voltage + sum_voltage_deviation / Scalar(std::max(num_samples, std::uint32_t(1)));
+    }
+
+    Scalar getVoltageVariance() const
+    {
+        Const n = Scalar(std::max(num_samples, std::uint32_t(1)));
+        Const mean_deviation = sum_voltage_deviation / n;
+        return std::max(0.0F, sum_voltage_deviation_squared / n - mean_deviation * mean_deviation);
+    }
+
+    Scalar getMeanCurrent() const
+    {
+        return sum_current / Scalar(std::max(num_samples, std::uint32_t(1)));
+    }
+};
+
+/**
+ * Output of @ref BusMonitor.
+ */
+struct BusState
+{
+    Scalar voltage = 0;                 ///< Volt, averaged over the update interval
+    Scalar current = 0;                 ///< Ampere, estimated from the phase currents and the duty cycles
+    Scalar ripple = 0;                  ///< Volt RMS, within the update interval
+    Scalar source_resistance = 0;       ///< Ohm, internal resistance of the battery including the wiring
+    Scalar open_circuit_voltage = 0;    ///< Volt, extrapolated to zero current
+    bool source_resistance_known = false;
+};
+
+/**
+ * Monitors the DC bus voltage and estimates the impedance of the power source.
+ *
+ * The per-period samples are averaged over @ref UpdateInterval. The ripple is the RMS deviation of the voltage within
+ * the interval, i.e. it contains the components faster than the interval, which are mostly caused by the PWM current
+ * drawn from the bus capacitors. The source resistance is the low frequency impedance dV/dI, which is estimated by
+ * linear regression of the interval averages V = Voc - R*I with exponential forgetting. The estimate is held until
+ * the bus current has varied enough, e.g. due to a throttle change, and it is bounded to the plausible range.
+ */
+class BusMonitor
+{
+public:
+    static constexpr Scalar UpdateInterval              = 0.01F;    ///< Second
+    static constexpr Scalar ForgettingTimeConstant      = 5.0F;     ///< Second
+    static constexpr Scalar RippleTimeConstant          = 0.5F;     ///< Second
+
+    /// The regression is not trusted until the bus current has varied at least this much (standard deviation)
+    static constexpr Scalar MinCurrentDeviation         = 1.0F;     ///< Ampere
+
+    static constexpr Scalar MaxSourceResistance         = 1.0F;     ///< Ohm
+
+private:
+    BusSampleAccumulator window_;
+    Scalar window_time_ = 0;
+
+    BusState state_;
+
+    // Exponentially weighted moments of the interval averages
+    Scalar mean_voltage_ = 0;
+    Scalar mean_current_ = 0;
+    Scalar current_variance_ = 0;
+    Scalar covariance_ = 0;
+    bool initialized_ = false;
+
+public:
+    /**
+     * Must be invoked from the main IRQ continuously.
+     * @param dt            Time since the previous invocation, second.
+     * @param samples       Collected by the fast IRQ since the previous invocation.
+     */
+    void update(Const dt, const BusSampleAccumulator& samples)
+    {
+        window_.add(samples);
+        window_time_ += dt;
+
+        if ((window_time_ < UpdateInterval) || (window_.num_samples == 0))
+        {
+            return;
+        }
+
+        Const voltage = window_.getMeanVoltage();
+        Const current = window_.getMeanCurrent();
+        Const voltage_variance = window_.getVoltageVariance();
+
+        state_.voltage = voltage;
+        state_.current = current;
+
+        if (!initialized_)
+        {
+            initialized_ = true;
+            mean_voltage_ = voltage;
+            mean_current_ = current;
+            state_.ripple = std::sqrt(voltage_variance);
+        }
+
+        state_.ripple += (std::sqrt(voltage_variance) - state_.ripple) *
+                         std::min(window_time_ / RippleTimeConstant, 1.0F);
+
+        /*
+         * Incremental exponentially weighted variance and covariance.
+         * The deviations are taken before the means are updated, which keeps the estimates unbiased.
+         */
+        Const alpha = std::min(window_time_ / ForgettingTimeConstant, 1.0F);
+        Const dv = voltage - mean_voltage_;
+        Const di = current - mean_current_;
+        mean_voltage_ += alpha * dv;
+        mean_current_ += alpha * di;
+        current_variance_ = (1.0F - alpha) * (current_variance_ + alpha * di * di);
+        covariance_       = (1.0F - alpha) * (covariance_       + alpha * di * dv);
+
+        if (current_variance_ > (MinCurrentDeviation * MinCurrentDeviation))
+        {
+            state_.source_resistance = math::Range<>(0.0F, MaxSourceResistance).constrain(-covariance_ /
+                                                                                          current_variance_);
+            state_.source_resistance_known = true;
+        }
+
+        state_.open_circuit_voltage = mean_voltage_ + state_.source_resistance * mean_current_;
+
+        window_ = BusSampleAccumulator();
+        window_time_ = 0;
+    }
+
+    const BusState& getState() const { return state_; }
+};
+
+}
@@ -34,6 +34,9 @@
 #include "running_task.hpp"
 #include "hw_test/task.hpp"
 #include "motor_id/task.hpp"
+#include "thermal_model.hpp"
+#include <atomic>
+#include <unistd.h>
 
 
 /*
@@ -45,12 +48,149 @@ namespace foc
 namespace
 {
 
-TaskContext g_context;
+/**
+ * Double-buffered parameter store.
+ * New parameters are copied and validated in the thread context into the inactive buffer, then the index of that
+ * buffer is published. The main IRQ adopts the published buffer by updating the active index, no copying involved.
+ * The active buffer is never written by the threads, and the published buffer is retracted before it is rewritten,
+ * so the IRQ can't adopt a buffer while it is being written.
+ */
+class ParameterStore
+{
+public:
+    struct Entry
+    {
+        Parameters params;
+        bool valid = false;
+    };
+
+private:
+    std::array<Entry, 2> buffers_;
+    volatile unsigned active_index_ = 0;        ///< Modified only by the main IRQ
+    volatile unsigned published_index_ = 0;     ///< Modified only by the writers
+    chibios_rt::Mutex mutex_;                   ///< Serializes writers
+
+public:
+    /**
+     * Must be invoked before the IRQs are started.
+     */
+    void init(const Parameters& params)
+    {
+        buffers_[active_index_].params = params;
+        buffers_[active_index_].valid = params.isValid();
+    }
+
+    void publish(const Parameters& params)
+    {
+        os::MutexLocker locker(mutex_);
+
+        unsigned inactive_index = 0;
+        {
+            // Retracting the previous set if it wasn't adopted yet; the active index can't change after that
+            AbsoluteCriticalSectionLocker cs_locker;
+            published_index_ = active_index_;
+            inactive_index = active_index_ ^ 1U;
+        }
+
+        buffers_[inactive_index].params = params;
+        buffers_[inactive_index].valid = params.isValid();      // This may take a while, so it's done here
+
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        published_index_ = inactive_index;
+    }
+
+    /**
+     * Can be invoked only from the main IRQ.
+     */
+    bool isNewSetPublished() const { return published_index_ != active_index_; }
+
+    /**
+     * Can be invoked only from the main IRQ, under the global context sequence lock, see cloneGlobalContext().
+     */
+    void adoptPublished()
+    {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        active_index_ = published_index_;
+    }
+
+    /**
+     * Can be invoked from the IRQ, or from threads in a critical section or under the sequence lock.
+     */
+    const Entry& getActive() const
+    {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        return buffers_[active_index_];
+    }
+
+    /**
+     * Can be invoked only from the main IRQ, under the global context sequence lock.
+     */
+    Parameters& getActiveParametersForModification()
+    {
+        return buffers_[active_index_].params;
+    }
+} g_parameter_store;
+
+inline const Parameters& getActiveParameters() { return g_parameter_store.getActive().params; }
+
+/**
+ * The global context and the active parameters are modified only from the main IRQ (or before it is started).
+ * Threads make their copies using the sequence counter, so the IRQ never has to be blocked for that.
+ */
+GlobalContext g_context;
+volatile std::uint32_t g_context_sequence = 0;
+
+template <typename Modifier>
+void modifyGlobalContextFromIRQ(const Modifier& modifier)
+{
+    g_context_sequence = g_context_sequence + 1U;       // Odd value means that the context is being modified
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    modifier(g_context);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    g_context_sequence = g_context_sequence + 1U;
+}
+
+TaskContext cloneGlobalContext()
+{
+    TaskContext out;
+    std::uint32_t sequence = 0;
+    do
+    {
+        sequence = g_context_sequence;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        static_cast<GlobalContext&>(out) = g_context;
+        out.params = getActiveParameters();
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+    while (((sequence & 1U) != 0) || (sequence != g_context_sequence));
+    return out;
+}
 
 board::motor::PWMHandle g_pwm_handle;
 
 IRQDebugPlotter g_debug_plotter;
 
+/**
+ * The accumulators are filled by the fast IRQ and drained by the main IRQ.
+ */
+PhaseCurrentAccumulator g_phase_current_accumulator;
+BusSampleAccumulator g_bus_sample_accumulator;
+
+/// Applied during the current PWM period, i.e. set in the previous one; zero if the outputs are disabled
+Vector<3> g_applied_pwm_setpoint = Vector<3>::Zero();
+
+ThermalModel g_thermal_model;
+BusMonitor g_bus_monitor;
+
+void configureThermalModel()
+{
+    g_thermal_model.configure(board::motor::getPowerStageCharacteristics(),
+                              g_context.board.limits,
+                              g_context.board.pwm.period,
+                              getActiveParameters().motor,
+                              getActiveParameters().controller);
+}
+
 using motor_id::MotorIdentificationTask;
 using hw_test::HardwareTestingTask;
 
@@ -63,13 +203,86 @@ typedef TaskHandler
 , MotorIdentificationTask
 > TaskHandlerInstance;
 
-TaskHandlerInstance g_task_handler([]() { return g_context; });
+TaskHandlerInstance g_task_handler(&cloneGlobalContext);
+
+
+
+/**
+ * Invokes the fast IRQ hook of the current task.
+ * The running task is the only one whose hook is time-critical, so it is called directly, which allows the compiler
+ * to inline its body here; the other tasks go through the dispatch table.
+ */
+inline std::pair<Vector<3>, bool> dispatchFastIRQHook(const Vector<2>& phase_currents_ab,
+                                                      Const inverter_voltage)
+{
+    if (auto task = g_task_handler.as<RunningTask>())
+    {
+        return task->RunningTask::onNextPWMPeriod(phase_currents_ab, inverter_voltage);
+    }
+    return g_task_handler.dispatchOnNextPWMPeriod(phase_currents_ab, inverter_voltage);
+}
+
+
+/**
+ * Compares the cost of the fast IRQ task hook invoked via the static dispatch versus the virtual call.
+ * The measurement is performed on the real workload: while the benchmark is running, the fast IRQ alternates
+ * between the two dispatch methods and accumulates the cycle counts for each.
+ */
+class DispatchBenchmark
+{
+    volatile unsigned remaining_samples_ = 0;
+    std::array<std::uint64_t, 2> cycles_{};
+    std::array<unsigned, 2> counts_{};
+
+public:
+    void begin(const unsigned num_samples)
+    {
+        AbsoluteCriticalSectionLocker locker;
+        cycles_.fill(0);
+        counts_.fill(0);
+        remaining_samples_ = num_samples;
+    }
+
+    bool isRunning() const { return remaining_samples_ > 0; }
+
+    /**
+     * Invoked from the fast IRQ instead of the normal dispatch while the benchmark is running.
+     */
+    std::pair<Vector<3>, bool> invokeFastIRQHook(const Vector<2>& phase_currents_ab,
+                                                 Const inverter_voltage);
+
+    DispatchBenchmarkResult getResult() const
+    {
+        AbsoluteCriticalSectionLocker locker;
+        DispatchBenchmarkResult out;
+        out.static_dispatch_cycles  = Scalar(cycles_[0]) / Scalar(std::max(counts_[0], 1U));
+        out.virtual_dispatch_cycles = Scalar(cycles_[1]) / Scalar(std::max(counts_[1], 1U));
+        out.num_samples = counts_[0] + counts_[1];
+        return out;
+    }
+} g_dispatch_benchmark;
+
+std::pair<Vector<3>, bool> DispatchBenchmark::invokeFastIRQHook(const Vector<2>& phase_currents_ab,
+                                                                Const inverter_voltage)
+{
+    const unsigned index = remaining_samples_ % 2U;
+    const std::uint32_t started_at = DWT->CYCCNT;
+
+    const auto out = (index == 0) ?
+        dispatchFastIRQHook(phase_currents_ab, inverter_voltage) :
+        g_task_handler.get().onNextPWMPeriod(phase_currents_ab, inverter_voltage);
+
+    cycles_[index] += DWT->CYCCNT - started_at;
+    counts_[index]++;
+    remaining_samples_ = remaining_samples_ - 1U;
+    return out;
+}
 
 
 inline Scalar convertElectricalAngularVelocityToMechanicalRPM(Const eangvel)
 {
     return convertRotationRateElectricalToMechanical(convertAngularVelocityToRPM(eangvel),
-                                                     g_context.params.motor.num_poles);
+                                                     getActiveParameters().motor.num_poles);
 }
 
 } // namespace
@@ -79,37 +292,37 @@ void init(const Parameters& params)
 {
     board::motor::beginCalibration();
 
-    g_context.params = params;
+    g_parameter_store.init(params);
 
     g_context.board.pwm     = board::motor::getPWMParameters();
     g_context.board.limits  = board::motor::getLimits();
 
+    configureThermalModel();
+
     {
         AbsoluteCriticalSectionLocker locker;
         g_task_handler.select<IdleTask>();
     }
 
     DEBUG_LOG("FOC sizeof: %u %u %u %u\n",
-              sizeof(g_task_handler), sizeof(MotorIdentificationTask), sizeof(g_context), sizeof(g_context.params));
+              sizeof(g_task_handler), sizeof(MotorIdentificationTask), sizeof(g_context), sizeof(Parameters));
 }
 
 void setParameters(const Parameters& params)
 {
-    AbsoluteCriticalSectionLocker locker;
-    g_context.params = params;
-    g_task_handler.from<IdleTask>().to<IdleTask>(); // Cycling to reload new configuration and check it
+    g_parameter_store.publish(params);  // Will be picked up by the main IRQ, see handleMainIRQ()
 }
 
 Parameters getParameters()
 {
     AbsoluteCriticalSectionLocker locker;
-    return g_context.params;
+    return getActiveParameters();
 }
 
 MotorParameters getMotorParameters()
 {
     AbsoluteCriticalSectionLocker locker;
-    return g_context.params.motor;
+    return getActiveParameters().motor;
 }
 
 hw_test::Report getHardwareTestReport()
@@ -118,6 +331,24 @@ hw_test::Report getHardwareTestReport()
     return g_context.hw_test_report;
 }
 
+motor_id::Statistics getMotorIdentificationStatistics()
+{
+    AbsoluteCriticalSectionLocker locker;
+    return g_context.motor_id_statistics;
+}
+
+SpinupProfile getSpinupProfile()
+{
+    AbsoluteCriticalSectionLocker locker;
+    return g_context.spinup_profile;
+}
+
+void setSpinupProfile(const SpinupProfile& profile)
+{
+    AbsoluteCriticalSectionLocker locker;
+    modifyGlobalContextFromIRQ([&profile](GlobalContext& context) { context.spinup_profile = profile; });
+}
+
 void beginMotorIdentification(motor_id::Mode mode)
 {
     g_task_handler.from<IdleTask, BeepingTask>().to<MotorIdentificationTask>(mode);
@@ -162,6 +393,9 @@ bool isRunning(RunningStateInfo* out_info,
         if (out_info != nullptr)
         {
             out_info->stall_count = task->getNumSuccessiveStalls();
+            out_info->desync_count = task->getNumDesyncs();
+            out_info->last_desync_cause =
+                observer::DesyncDetector::getIndicatorName(task->getLastDesyncIndicator());
 
             const auto filt = task->getLowPassFilteredValues();
             out_info->inverter_power_filtered = filt.inverter_power;
@@ -169,6 +403,19 @@ bool isRunning(RunningStateInfo* out_info,
 
             out_info->mechanical_rpm =
                 convertElectricalAngularVelocityToMechanicalRPM(task->getElectricalAngularVelocity());
+
+            const auto cl = task->getCurrentLoopBandwidthAndDelay();
+            out_info->current_loop_bandwidth = cl.first;
+            out_info->current_loop_delay = cl.second;
+
+            observer::OnlineParameterEstimate est;
+            if (task->getOnlineParameterEstimate(est))
+            {
+                out_info->phase_resistance = est.phase_resistance;
+                out_info->field_flux = est.field_flux;
+                out_info->winding_temperature = est.winding_temperature;
+                out_info->parameter_estimate_frozen = est.frozen;
+            }
         }
 
         if (out_spinup_in_progress != nullptr)
@@ -180,6 +427,46 @@ bool isRunning(RunningStateInfo* out_info,
     return false;
 }
 
+bool getEstimatorComparisonStatistics(observer::EstimatorComparisonStatistics& out_stat)
+{
+    AbsoluteCriticalSectionLocker locker;
+    if (auto task = g_task_handler.as<RunningTask>())
+    {
+        return task->getEstimatorComparisonStatistics(out_stat);
+    }
+    return false;
+}
+
+ThermalState getThermalState()
+{
+    AbsoluteCriticalSectionLocker locker;
+
+    ThermalState out;
+    out.inverter_temperature  = math::convertKelvinToCelsius(g_thermal_model.getSensorTemperature());
+    out.junction_temperature  = math::convertKelvinToCelsius(g_thermal_model.getJunctionTemperature());
+    out.winding_temperature   = math::convertKelvinToCelsius(g_thermal_model.getWindingTemperature());
+    out.winding_model_enabled = g_thermal_model.isWindingModelEnabled();
+    out.inverter_power_loss   = g_thermal_model.getInverterPowerLoss();
+    out.winding_power_loss    = g_thermal_model.getWindingPowerLoss();
+
+    if (auto task = g_task_handler.as<RunningTask>())
+    {
+        out.current_limit = task->getCurrentLimit();
+    }
+    else
+    {
+        out.current_limit = getActiveParameters().motor.max_current * g_thermal_model.getCurrentLimitFactor();
+    }
+
+    return out;
+}
+
+BusState getBusState()
+{
+    AbsoluteCriticalSectionLocker locker;
+    return g_bus_monitor.getState();
+}
+
 bool isInactive(InactiveStateInfo* out_info)
 {
     AbsoluteCriticalSectionLocker locker;
@@ -214,21 +501,23 @@ void setSetpoint(ControlMode control_mode,
                  Const value,
                  Const request_ttl)
 {
-    AbsoluteCriticalSectionLocker locker;
-    if (auto task = g_task_handler.as<RunningTask>())
     {
-        task->setSetpoint(control_mode, value, request_ttl);
+        AbsoluteCriticalSectionLocker locker;
+        if (auto task = g_task_handler.as<RunningTask>())
+        {
+            task->setSetpoint(control_mode, value, request_ttl);
+            return;
+        }
+    }
+
+    // Task switching must be performed outside of the critical section
+    if (os::float_eq::closeToZero(value))
+    {
+        g_task_handler.from<FaultTask, MotorIdentificationTask>().to<IdleTask>();
     }
     else
     {
-        if (os::float_eq::closeToZero(value))
-        {
-            g_task_handler.from<FaultTask, MotorIdentificationTask>().to<IdleTask>();
-        }
-        else
-        {
-            g_task_handler.from<IdleTask, BeepingTask>().to<RunningTask>(control_mode, value, request_ttl);
-        }
+        g_task_handler.from<IdleTask, BeepingTask>().to<RunningTask>(control_mode, value, request_ttl);
     }
 }
 
@@ -237,6 +526,23 @@ void beep(Const frequency, Const duration)
     g_task_handler.from<IdleTask>().to<BeepingTask>(frequency, duration);
 }
 
+DispatchBenchmarkResult benchmarkTaskDispatch()
+{
+    static constexpr unsigned NumSamples = 100000;
+    static constexpr unsigned TimeoutMSec = 10000;
+
+    g_dispatch_benchmark.begin(NumSamples);
+
+    for (unsigned i = 0; (i < TimeoutMSec / 10U) && g_dispatch_benchmark.isRunning(); i++)
+    {
+        ::usleep(10000);
+    }
+
+    auto out = g_dispatch_benchmark.getResult();
+    out.task_name = getExtendedStatus().current_task_name;
+    return out;
+}
+
 void plotRealTimeValues()
 {
     g_debug_plotter.print();
@@ -292,6 +598,33 @@ void handleMainIRQ(Const period)
 {
     const auto hw_status = board::motor::getStatus();
 
+    /*
+     * Adopting the new parameters, if any. This only swaps the active buffer index, nothing is copied.
+     * No locking is needed here, because the parameters can't be accessed by the fast IRQ,
+     * and the threads can't preempt us.
+     */
+    if (g_parameter_store.isNewSetPublished())
+    {
+        modifyGlobalContextFromIRQ([](GlobalContext&) { g_parameter_store.adoptPublished(); });
+
+        const auto& entry = g_parameter_store.getActive();
+
+        configureThermalModel();
+
+        if (g_task_handler.is<IdleTask>())
+        {
+            g_task_handler.select<IdleTask>();                  // Cycling to reload new configuration and check it
+        }
+        else if (entry.valid)
+        {
+            g_task_handler.get().applyTunableParameters(entry.params);
+        }
+        else
+        {
+            ;   // Invalid parameters will be rejected by the next task, nothing to do
+        }
+    }
+
     static TaskHandlerInstance::SwitchCounter last_task_switch_counter;
     const auto new_task_switch_counter = g_task_handler.getTaskSwitchCounter();
     if (new_task_switch_counter != last_task_switch_counter)
@@ -306,20 +639,51 @@ void handleMainIRQ(Const period)
         }
     }
 
+    /*
+     * Thermal modeling and bus monitoring run regardless of the current task; e.g. the cooling is modeled while idle.
+     */
+    {
+        PhaseCurrentAccumulator phase_currents;
+        BusSampleAccumulator bus_samples;
+        {
+            AbsoluteCriticalSectionLocker locker;
+            phase_currents = g_phase_current_accumulator;
+            bus_samples = g_bus_sample_accumulator;
+            g_phase_current_accumulator = PhaseCurrentAccumulator();
+            g_bus_sample_accumulator = BusSampleAccumulator();
+        }
+
+        g_bus_monitor.update(period, bus_samples);
+
+        g_thermal_model.update(period, phase_currents, hw_status.inverter_voltage, hw_status.inverter_temperature);
+
+        if (auto task = g_task_handler.as<RunningTask>())
+        {
+            task->setCurrentLimit(getActiveParameters().motor.max_current * g_thermal_model.getCurrentLimitFactor());
+
+            observer::OnlineParameterEstimate estimate;
+            if (task->getOnlineParameterEstimate(estimate) && !estimate.frozen)
+            {
+                g_thermal_model.correctWindingTemperature(
+                    period, math::convertCelsiusToKelvin(estimate.winding_temperature));
+            }
+        }
+    }
+
     if (!board::motor::isCalibrationInProgress())
     {
         auto& task = g_task_handler.get();
 
-        const auto result = task.onMainIRQ(period, hw_status);
+        const auto result = g_task_handler.dispatchOnMainIRQ(period, hw_status);
 
         if (result.finished)
         {
-            AbsoluteCriticalSectionLocker locker;
-
-            g_pwm_handle.release();
-
-            task.applyResultToGlobalContext(g_context);
+            modifyGlobalContextFromIRQ([&task](GlobalContext& context)
+            {
+                task.applyResultToGlobalContext(context, g_parameter_store.getActiveParametersForModification());
+            });
 
+            // The finished task is destroyed here, so the reference can't be used past this point
             if (result.exit_code == result.ExitCodeOK)
             {
                 assert(!g_task_handler.is<IdleTask>());         // Idle task shouldn't finish
@@ -333,6 +697,9 @@ void handleMainIRQ(Const period)
                     std::uint16_t((g_task_handler.getTaskID() << 12) | (result.exit_code & 0x0FFFU));
                 g_task_handler.select<FaultTask>(fault_code);
             }
+
+            AbsoluteCriticalSectionLocker locker;
+            g_pwm_handle.release();
         }
         else
         {
@@ -350,21 +717,40 @@ void handleMainIRQ(Const period)
 void handleFastIRQ(const Vector<2>& phase_currents_ab,
                    Const inverter_voltage)
 {
+    g_bus_sample_accumulator.add(inverter_voltage, g_applied_pwm_setpoint, phase_currents_ab);
+
     if (board::motor::isCalibrationInProgress())
     {
         g_pwm_handle.release();
+        g_applied_pwm_setpoint.setZero();
     }
     else
     {
-        const auto out = g_task_handler.get().onNextPWMPeriod(phase_currents_ab, inverter_voltage);
+        const auto out = g_dispatch_benchmark.isRunning() ?
+            g_dispatch_benchmark.invokeFastIRQHook(phase_currents_ab, inverter_voltage) :
+            dispatchFastIRQHook(phase_currents_ab, inverter_voltage);
+
         if (out.second)
         {
             g_pwm_handle.setPWM(out.first);
+            g_applied_pwm_setpoint = out.first;
+
+            if (auto task = g_task_handler.as<RunningTask>())
+            {
+                const auto prediction = task->getPredictedPhaseCurrentsFromIRQ();
+                if (prediction.second)
+                {
+                    board::motor::setPredictedPhaseCurrents(prediction.first);
+                }
+            }
         }
         else
         {
             g_pwm_handle.release();
+            g_applied_pwm_setpoint.setZero();
         }
+
+        g_phase_current_accumulator.add(phase_currents_ab, out.second);
     }
 }
 
@@ -26,6 +26,7 @@
 
 #include "parameters.hpp"
 #include "running_task.hpp"
+#include "bus_monitor.hpp"
 #include "hw_test/report.hpp"
 #include "motor_id/task.hpp"
 #include <math/math.hpp>
@@ -44,7 +45,9 @@ void init(const Parameters& params);
 
 /**
  * Allows to change configuration parameters at runtime.
- * The new parameters will take effect on next state switch (e.g. motor start/stop, identification, etc).
+ * The new parameters are validated in the caller's context and then adopted by the main IRQ without blocking it.
+ * Hot-swappable parameters (current loop bandwidth, observer tuning, setpoint ramps) are applied immediately even
+ * if the motor is running; the rest will take effect on next state switch (e.g. motor start/stop, identification).
  */
 void setParameters(const Parameters& params);
 Parameters getParameters();
@@ -59,6 +62,20 @@ MotorParameters getMotorParameters();
  */
 hw_test::Report getHardwareTestReport();
 
+/**
+ * Returns the spread of the parameters over the runs of the last completed motor identification.
+ * See @ref motor_id::Parameters::num_runs.
+ */
+motor_id::Statistics getMotorIdentificationStatistics();
+
+/**
+ * The spinup profile is learned while the motor is running and updated once the motor is stopped.
+ * It is not persisted by this module; the application should store it and restore it after reboot.
+ * See @ref ControllerParameters::adaptive_spinup_enabled.
+ */
+SpinupProfile getSpinupProfile();
+void setSpinupProfile(const SpinupProfile& profile);
+
 /**
  * Begins the asynchronous process of motor identification.
  * See @ref MotorIdentificationMode.
@@ -101,9 +118,19 @@ bool isHardwareTestInProgress();
 struct RunningStateInfo
 {
     std::uint32_t stall_count       = 0;
+    std::uint32_t desync_count      = 0;    ///< Stalls caused by the loss of synchronization, at any speed
+    const char* last_desync_cause   = "none";
     Scalar inverter_power_filtered  = 0;
     Scalar demand_factor_filtered   = 0;
     Scalar mechanical_rpm           = 0;
+    Scalar current_loop_bandwidth   = 0;    ///< Effective, Hertz; may be lower than configured due to loop delay
+    Scalar current_loop_delay       = 0;    ///< Seconds, including the Idq filter group delay
+
+    /// Online estimates, zero if the parameter adaptation is disabled; see @ref ParameterAdaptationMode
+    Scalar phase_resistance         = 0;    ///< Ohm
+    Scalar field_flux               = 0;    ///< Weber
+    Scalar winding_temperature      = 0;    ///< Degree Celsius
+    bool parameter_estimate_frozen  = true;
 };
 
 /**
@@ -112,6 +139,37 @@ struct RunningStateInfo
 bool isRunning(RunningStateInfo* out_info = nullptr,
                bool* out_spinup_in_progress = nullptr);
 
+/**
+ * Returns true if the controller is running and the alternative estimator is running in the shadow mode.
+ * See @ref ControllerParameters::shadow_estimator_enabled.
+ */
+bool getEstimatorComparisonStatistics(observer::EstimatorComparisonStatistics& out_stat);
+
+/**
+ * @ref getThermalState().
+ */
+struct ThermalState
+{
+    Scalar inverter_temperature     = 0;    ///< Degree Celsius, measured
+    Scalar junction_temperature     = 0;    ///< Degree Celsius, estimated MOSFET junction temperature
+    Scalar winding_temperature      = 0;    ///< Degree Celsius, estimated; valid only if the model is enabled
+    bool winding_model_enabled      = false;
+    Scalar inverter_power_loss      = 0;    ///< Watt
+    Scalar winding_power_loss       = 0;    ///< Watt
+    Scalar current_limit            = 0;    ///< Ampere, the max current after the thermal derating
+};
+
+/**
+ * The thermal model runs continuously, regardless of the state of the controller; see @ref ThermalModel.
+ */
+ThermalState getThermalState();
+
+/**
+ * DC bus voltage, ripple, and the estimated internal resistance of the power source; see @ref BusMonitor.
+ * The estimates are updated continuously, regardless of the state of the controller.
+ */
+BusState getBusState();
+
 /**
  * @ref isInactive().
  * If the fault code is nonzero, the controller is in the fault state which needs to be reset
@@ -174,6 +232,21 @@ inline void stop()
 void beep(Const frequency,
           Const duration);
 
+struct DispatchBenchmarkResult
+{
+    const char* task_name = "";
+    Scalar static_dispatch_cycles = 0;
+    Scalar virtual_dispatch_cycles = 0;
+    unsigned num_samples = 0;
+};
+
+/**
+ * Compares the average number of CPU cycles spent in the fast IRQ task hook with the static dispatch (direct call
+ * for the running task, jump table for the others) versus the virtual call. The measurement is performed on the
+ * current task, so it makes sense to run it with the motor running. This function blocks for a few seconds.
+ */
+DispatchBenchmarkResult benchmarkTaskDispatch();
+
 /**
  * This command is intended for use with CLI plotting tool.
  * Refer to the project tools directory for more info.
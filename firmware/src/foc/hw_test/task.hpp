@@ -60,7 +60,7 @@ class HardwareTestingTask : public ITask
         Finished
     };
 
-    const TaskContext context_;
+    const TaskContext& context_;     ///< Owned by the task handler, stays valid and immutable while the task exists
 
     State state_ = State::Initialization;
     Scalar time_ = 0;
@@ -276,7 +276,7 @@ public:
         };
     }
 
-    void applyResultToGlobalContext(TaskContext& inout_context) const override
+    void applyResultToGlobalContext(GlobalContext& inout_context, Parameters&) const override
     {
         inout_context.hw_test_report = report_;
     }
@@ -0,0 +1,197 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "transforms.hpp"
+#include <math/math.hpp>
+#include <board/motor.hpp>
+#include <array>
+#include <cassert>
+
+
+namespace foc
+{
+
+using math::Scalar;
+using math::Const;
+using math::Vector;
+
+/**
+ * Detects the rotor position at standstill using the inductance saturation effect, before the spinup.
+ *
+ * Short voltage pulses are applied in several directions evenly distributed over the electrical revolution.
+ * Each pulse is followed by a pulse of the opposite polarity of the same length, which returns the current to zero,
+ * so that the next direction can be probed immediately. When the pulse is aligned with the magnet flux, the stator
+ * iron saturates further and the inductance decreases, so the current swing is larger. The angle of the first
+ * harmonic of the current swings over the directions is the angle of the north pole (the D axis), unambiguously.
+ * The second harmonic, which carries the saliency, is rejected by the discrete Fourier transform.
+ *
+ * The whole sequence takes (NumDirections * (PulseLength * 2 + 1)) PWM periods, which is under one millisecond
+ * at typical PWM frequencies. The rotor must be stationary.
+ *
+ * This class is invoked from the fast IRQ only, except for the getters.
+ */
+class InitialPositionDetector
+{
+public:
+    static constexpr unsigned NumDirections = 6;
+    static constexpr unsigned PulseLength = 2;                  ///< PWM periods
+
+    /// Detection is deemed failed if the saturation effect is weaker than this, relative to the average swing
+    static constexpr Scalar MinModulationDepth = 0.01F;
+
+    enum class Status
+    {
+        InProgress,
+        Succeeded,
+        Failed
+    };
+
+private:
+    static constexpr unsigned PeriodsPerDirection = PulseLength * 2 + 1;
+
+    Const pulse_voltage_;
+    Const pwm_upper_limit_;
+
+    unsigned step_ = 0;
+    std::array<Scalar, NumDirections> max_currents_{};
+    std::array<Scalar, NumDirections> min_currents_{};
+
+    Status status_ = Status::InProgress;
+    Scalar angular_position_ = 0;
+    Scalar modulation_depth_ = 0;
+
+    static Scalar getDirectionAngle(const unsigned index)
+    {
+        return math::Pi2 * Scalar(index) / Scalar(NumDirections);
+    }
+
+    void finalize()
+    {
+        Scalar sum = 0;
+        Vector<2> first_harmonic = Vector<2>::Zero();
+        for (unsigned i = 0; i < NumDirections; i++)
+        {
+            Const swing = max_currents_[i] - min_currents_[i];
+            sum += swing;
+            first_harmonic += swing * math::sincos(getDirectionAngle(i)).reverse();
+        }
+
+        Const average = sum / Scalar(NumDirections);
+        Const amplitude = first_harmonic.norm() * 2.0F / Scalar(NumDirections);
+
+        if (average > 0)
+        {
+            modulation_depth_ = amplitude / average;
+            angular_position_ = math::normalizeAngle(std::atan2(first_harmonic[1], first_harmonic[0]));
+        }
+
+        status_ = (modulation_depth_ > MinModulationDepth) ? Status::Succeeded : Status::Failed;
+    }
+
+public:
+    /**
+     * @param Lq                    Phase inductance, Henry.
+     * @param test_current          Approximate amplitude of the current pulses, Ampere.
+     * @param pwm_params            PWM configuration.
+     */
+    InitialPositionDetector(Const Lq,
+                            Const test_current,
+                            const board::motor::PWMParameters& pwm_params) :
+        pulse_voltage_(Lq * test_current / (pwm_params.period * Scalar(PulseLength))),
+        pwm_upper_limit_(pwm_params.upper_limit)
+    {
+        assert(pulse_voltage_ > 0);
+    }
+
+    /**
+     * Must be invoked every PWM period while the status is InProgress.
+     * @return PWM setpoint for the next period.
+     */
+    Vector<3> onNextPWMPeriod(const Vector<2>& phase_currents_ab,
+                              Const inverter_voltage)
+    {
+        if (status_ != Status::InProgress)
+        {
+            return Vector<3>::Zero();
+        }
+
+        const unsigned direction_index = step_ / PeriodsPerDirection;
+        const unsigned phase = step_ % PeriodsPerDirection;
+        const Vector<2> direction = math::sincos(getDirectionAngle(direction_index)).reverse();    // cos, sin
+
+        /*
+         * Tracking the swing of the current projected on the direction of the pulse.
+         * Considering the entire window of the direction makes the measurement independent of the loop delay;
+         * using the swing rather than the peak value removes the residual current left by the preceding pulses.
+         */
+        const Scalar projected_current = performClarkeTransform(phase_currents_ab).dot(direction);
+        if (phase == 0)
+        {
+            max_currents_[direction_index] = projected_current;
+            min_currents_[direction_index] = projected_current;
+        }
+        max_currents_[direction_index] = std::max(max_currents_[direction_index], projected_current);
+        min_currents_[direction_index] = std::min(min_currents_[direction_index], projected_current);
+
+        Scalar voltage = 0;
+        if (phase < PulseLength)
+        {
+            voltage = 1.0F;
+        }
+        else if (phase < PulseLength * 2)
+        {
+            voltage = -1.0F;
+        }
+        else
+        {
+            ;   // Zero vector, letting the remaining current settle
+        }
+        voltage *= std::min(pulse_voltage_, computeLineVoltageLimit(inverter_voltage, pwm_upper_limit_));
+
+        step_++;
+        if (step_ >= NumDirections * PeriodsPerDirection)
+        {
+            finalize();
+        }
+
+        return performSpaceVectorTransform(direction * voltage, inverter_voltage).first;
+    }
+
+    Status getStatus() const { return status_; }
+
+    /**
+     * Electrical angle of the rotor, valid only if the detection has succeeded.
+     */
+    Scalar getAngularPosition() const { return angular_position_; }
+
+    /**
+     * Relative amplitude of the saturation effect; larger values mean more reliable detection.
+     */
+    Scalar getModulationDepth() const { return modulation_depth_; }
+};
+
+}
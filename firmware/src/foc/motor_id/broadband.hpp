@@ -0,0 +1,416 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "common.hpp"
+#include <foc/transforms.hpp>
+
+
+namespace foc
+{
+namespace motor_id
+{
+/**
+ * Single pass estimation of Rs, Ld, Lq and the dead time voltage drop using broadband excitation.
+ * This task does not depend on any other task, and it replaces the resistance and inductance tasks
+ * when a short identification time is important, e.g. during end-of-line testing.
+ *
+ * First, a DC voltage in the alpha axis is ramped up until the current reaches the estimation current; this aligns
+ * the rotor, so that the alpha axis becomes the D axis and the beta axis becomes the Q axis. Then a multisine
+ * voltage is injected in both axes on top of the DC bias, whose level is periodically switched between two values.
+ * The frequencies of the multisine are spread logarithmically below the current injection frequency; the even
+ * components are injected in the D axis, the odd ones in the Q axis. The phases of the components follow the
+ * Schroeder formula, which keeps the crest factor low.
+ *
+ * Each axis is described by the model u = R*i + L*di/dt + c, where c is the voltage drop caused by the dead time.
+ * Since the phase current polarities are held constant by the DC bias, the dead time drop does not depend on
+ * the excitation, and its D axis projection can be separated from the resistive drop owing to the two bias levels.
+ * The parameters are fitted by linear least squares at the PWM rate.
+ *
+ * The inductance is measured at the bias current, therefore Ld reflects the saturation caused by it.
+ * Ld, the dead time drop, and the fit residuals are reported via the IRQ debug output.
+ */
+class BroadbandIdentificationTask : public ISubTask
+{
+    static constexpr Scalar AlignmentVoltageRampRate        = 1.0F;     ///< Volt per second
+    static constexpr Scalar MaxAlignmentDuration            = 10.0F;
+    static constexpr Scalar RotorStabilizationDuration      = 0.5F;
+    static constexpr Scalar ExcitationDuration              = 2.0F;
+    static constexpr Scalar BiasSwitchInterval              = 0.05F;
+    static constexpr Scalar LowBiasLevel                    = 0.6F;     ///< Fraction of the full bias voltage
+    static constexpr Scalar ExcitationCurrentFraction       = 0.05F;    ///< Per component, of the estimation current
+    static constexpr Scalar OneSizeFitsAllL                 = 50.0e-6F; ///< Used only to shape the excitation
+    static constexpr Scalar MinValidSampleRatio             = 0.99F;
+
+    static constexpr unsigned NumFrequencies                = 10;
+
+    /**
+     * The voltage computed at the PWM period N is applied during the period N+1, which affects the difference
+     * between the current samples N+1 and N+2.
+     */
+    static constexpr unsigned VoltageToCurrentDelay         = 2;
+
+    enum class State
+    {
+        Alignment,
+        Excitation,
+        Computation,
+        FinishedSuccessfully,
+        Failed
+    } state_ = State::Alignment;
+
+    /**
+     * Sine generator based on a rotating phasor; much cheaper than calling sin() at every PWM period.
+     */
+    struct Oscillator
+    {
+        Vector<2> phasor = Vector<2>(1, 0);     ///< cos, sin
+        Vector<2> rotation = Vector<2>(1, 0);   ///< cos, sin of the phase increment per period
+        Scalar amplitude = 0;
+
+        Scalar next()
+        {
+            Const output = amplitude * phasor[1];
+            phasor = Vector<2>(phasor[0] * rotation[0] - phasor[1] * rotation[1],
+                               phasor[0] * rotation[1] + phasor[1] * rotation[0]);
+            phasor *= 1.5F - 0.5F * phasor.squaredNorm();       // First order renormalization
+            return output;
+        }
+    };
+
+    SubTaskContextReference context_;
+    MotorParameters result_;
+
+    Const estimation_current_;
+
+    Scalar state_switched_at_ = 0;
+
+    Scalar bias_voltage_ = 0;
+    std::array<Oscillator, NumFrequencies> oscillators_;
+    Scalar excitation_scale_ = 1.0F;
+
+    math::SimpleMovingAverageFilter<500, Scalar> bias_current_filter_;
+
+    std::array<Vector<2>, VoltageToCurrentDelay> voltage_history_;     ///< Alpha, beta; the oldest is first
+    Vector<2> previous_current_ = Vector<2>::Zero();
+
+    std::array<LeastSquaresAccumulator<3>, 2> estimators_;              ///< D, Q
+
+    Vector<2> last_voltage_ = Vector<2>::Zero();
+    Vector<2> last_current_ = Vector<2>::Zero();
+
+
+    void switchState(State new_state)
+    {
+        state_ = new_state;
+        state_switched_at_ = context_.getTime();
+    }
+
+    Scalar getTimeSinceStateSwitch() const
+    {
+        return context_.getTime() - state_switched_at_;
+    }
+
+    void initializeOscillators()
+    {
+        Const max_frequency = context_.params.motor_id.current_injection_frequency;
+        Const bias_resistance = bias_voltage_ / estimation_current_;       // Includes the dead time drop
+
+        for (unsigned i = 0; i < NumFrequencies; i++)
+        {
+            auto& osc = oscillators_[i];
+
+            Const angular_frequency = math::Pi2 * max_frequency * std::pow(2.0F, -0.5F * Scalar(i));
+            Const reactance = angular_frequency * OneSizeFitsAllL;
+            Const impedance = std::sqrt(bias_resistance * bias_resistance + reactance * reactance);
+
+            // Schroeder phases, computed per axis
+            const unsigned index_within_axis = i / 2;
+            Const phase = -math::Pi * Scalar(index_within_axis * index_within_axis) / Scalar(NumFrequencies / 2);
+
+            osc.phasor = math::sincos(phase).reverse();
+            osc.rotation = math::sincos(angular_frequency * context_.board.pwm.period).reverse();
+            osc.amplitude = ExcitationCurrentFraction * estimation_current_ * impedance;
+        }
+    }
+
+    Vector<2> computeExcitationVoltage()
+    {
+        Vector<2> out = Vector<2>::Zero();
+        for (unsigned i = 0; i < NumFrequencies; i++)
+        {
+            out[i % 2] += oscillators_[i].next();
+        }
+        return out * excitation_scale_;
+    }
+
+    Scalar computeMaxExcitationVoltage() const
+    {
+        Scalar out = 0;
+        for (auto& osc : oscillators_)
+        {
+            out += osc.amplitude;
+        }
+        return out;
+    }
+
+    /**
+     * The model is rearranged so that the current increment is the regressand:
+     *  di = (T/L) * u - (T*R/L) * i - (T/L) * c
+     * Otherwise the noise of the differentiated current would make the inductance estimate severely biased.
+     */
+    void processSample(const Vector<2>& current)
+    {
+        const Vector<2> voltage = voltage_history_.front();
+        const Vector<2> mean_current = (current + previous_current_) * 0.5F;
+        const Vector<2> current_increment = current - previous_current_;
+
+        for (unsigned axis = 0; axis < 2; axis++)
+        {
+            estimators_[axis].addSample(Vector<3>(voltage[axis], mean_current[axis], 1.0F), current_increment[axis]);
+        }
+    }
+
+    /**
+     * Converts the fitted coefficients into R, L, c; see @ref processSample().
+     */
+    Vector<3> convertCoefficientsToModelParameters(const Vector<3>& coefficients) const
+    {
+        Const T_over_L = coefficients[0];
+        if (!(T_over_L > 0))
+        {
+            return Vector<3>::Zero();
+        }
+        return {
+            -coefficients[1] / T_over_L,
+            context_.board.pwm.period / T_over_L,
+            -coefficients[2] / T_over_L
+        };
+    }
+
+    void computeResult()
+    {
+        const auto min_samples_needed =
+            unsigned((ExcitationDuration / context_.board.pwm.period) * MinValidSampleRatio);
+
+        if (estimators_[0].getNumSamples() < min_samples_needed)
+        {
+            switchState(State::Failed);
+            return;
+        }
+
+        const auto d = estimators_[0].solve();
+        const auto q = estimators_[1].solve();
+
+        const Vector<3> d_model = convertCoefficientsToModelParameters(d.parameters);
+        const Vector<3> q_model = convertCoefficientsToModelParameters(q.parameters);
+
+        Const rs = d_model[0];
+        Const ld = d_model[1];
+        Const lq = q_model[1];
+        Const dead_time_drop = d_model[2];
+
+        // The residuals are in Ampere, they show how well the motor follows the linear model
+        IRQDebugOutputBuffer::setVariableFromIRQ<0>(ld);
+        IRQDebugOutputBuffer::setVariableFromIRQ<1>(lq);
+        IRQDebugOutputBuffer::setVariableFromIRQ<2>(dead_time_drop);
+        IRQDebugOutputBuffer::setVariableFromIRQ<3>(d.residual_rms);
+        IRQDebugOutputBuffer::setVariableFromIRQ<4>(q.residual_rms);
+
+        if (d.valid && q.valid &&
+            MotorParameters::getRsLimits().contains(rs) &&
+            MotorParameters::getLqLimits().contains(ld) &&
+            MotorParameters::getLqLimits().contains(lq))
+        {
+            result_.rs = rs;
+            result_.lq = lq;
+            switchState(State::FinishedSuccessfully);
+        }
+        else
+        {
+            switchState(State::Failed);
+        }
+    }
+
+public:
+    BroadbandIdentificationTask(SubTaskContextReference context,
+                                const MotorParameters& initial_parameters) :
+        context_(context),
+        result_(initial_parameters),
+        estimation_current_(initial_parameters.max_current *
+                            context.params.motor_id.fraction_of_max_current),
+        bias_current_filter_(0.0F)
+    {
+        result_.rs = 0;
+        result_.lq = 0;
+
+        voltage_history_.fill(Vector<2>::Zero());
+
+        if (!context_.params.motor_id.isValid() ||
+            !os::float_eq::positive(result_.max_current))
+        {
+            state_ = State::Failed;
+        }
+    }
+
+    void onMainIRQ(Const period) override
+    {
+        (void) period;
+        AbsoluteCriticalSectionLocker locker;
+        context_.reportDebugVariables({
+            last_voltage_[0],
+            last_voltage_[1],
+            last_current_[0],
+            last_current_[1]
+        });
+    }
+
+    void onNextPWMPeriod(const Vector<2>& phase_currents_ab,
+                         Const inverter_voltage) override
+    {
+        const Vector<2> current = performClarkeTransform(phase_currents_ab);
+        Const voltage_limit = computeLineVoltageLimit(inverter_voltage, context_.board.pwm.upper_limit);
+
+        Vector<2> voltage = Vector<2>::Zero();
+
+        switch (state_)
+        {
+        case State::Alignment:
+        {
+            // Slowly increasing the voltage until we've reached the required current; the rotor aligns meanwhile
+            bias_current_filter_.update(current[0]);
+            if (bias_current_filter_.getValue() >= estimation_current_)
+            {
+                initializeOscillators();
+
+                // Reducing the excitation if there's not enough voltage headroom
+                Const headroom = voltage_limit - bias_voltage_;
+                Const required = computeMaxExcitationVoltage();
+                excitation_scale_ = (required > headroom) ? (headroom / required) : 1.0F;
+
+                if (excitation_scale_ > 0.1F)
+                {
+                    switchState(State::Excitation);
+                }
+                else
+                {
+                    switchState(State::Failed);
+                }
+            }
+            else if ((bias_voltage_ > voltage_limit) ||
+                     (getTimeSinceStateSwitch() > MaxAlignmentDuration))
+            {
+                switchState(State::Failed);
+            }
+            else
+            {
+                bias_voltage_ += AlignmentVoltageRampRate * context_.board.pwm.period;
+            }
+
+            voltage[0] = bias_voltage_;
+            break;
+        }
+
+        case State::Excitation:
+        {
+            Const time = getTimeSinceStateSwitch();
+
+            voltage[0] = bias_voltage_;
+
+            // The rotor is given some time to settle after the ramp; the excitation begins afterwards
+            if (time > RotorStabilizationDuration)
+            {
+                processSample(current);
+
+                Const bias_phase = std::fmod(time - RotorStabilizationDuration, BiasSwitchInterval * 2.0F);
+                if (bias_phase >= BiasSwitchInterval)
+                {
+                    voltage[0] *= LowBiasLevel;
+                }
+
+                voltage += computeExcitationVoltage();
+            }
+
+            if (time > (RotorStabilizationDuration + ExcitationDuration))
+            {
+                voltage.setZero();
+                switchState(State::Computation);
+            }
+            break;
+        }
+
+        case State::Computation:
+        {
+            computeResult();
+            break;
+        }
+
+        case State::FinishedSuccessfully:
+        {
+            break;
+        }
+
+        case State::Failed:
+        {
+            result_.rs = 0;
+            result_.lq = 0;
+            break;
+        }
+        }
+
+        previous_current_ = current;
+        std::copy(voltage_history_.begin() + 1, voltage_history_.end(), voltage_history_.begin());
+        voltage_history_.back() = voltage;
+
+        last_voltage_ = voltage;
+        last_current_ = current;
+
+        context_.setPWM(voltage.isZero() ?
+                        Vector<3>::Zero() :
+                        performSpaceVectorTransform(voltage, inverter_voltage).first);
+    }
+
+    Status getStatus() const override
+    {
+        if (state_ == State::FinishedSuccessfully)
+        {
+            return Status::Succeeded;
+        }
+        else if (state_ == State::Failed)
+        {
+            return Status::Failed;
+        }
+        else
+        {
+            return Status::InProgress;
+        }
+    }
+
+    MotorParameters getEstimatedMotorParameters() const override { return result_; }
+};
+
+}
+}
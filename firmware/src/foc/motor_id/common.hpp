@@ -56,6 +56,100 @@ struct SubTaskContext : public TaskContext
 
 using SubTaskContextReference = SubTaskContext&;
 
+/**
+ * Accumulates the normal equations of the linear least squares problem y = x' * theta, and solves it at the end.
+ * The samples are summed up in single precision in short blocks, which are then folded into double precision
+ * accumulators; this keeps the cost of adding a sample from the PWM IRQ low without losing precision over
+ * a long run.
+ */
+template <int NumParameters, unsigned BlockLength = 64>
+class LeastSquaresAccumulator
+{
+    using DoubleMatrix = Eigen::Matrix<double, NumParameters, NumParameters>;
+    using DoubleVector = Eigen::Matrix<double, NumParameters, 1>;
+
+    DoubleMatrix xx_ = DoubleMatrix::Zero();
+    DoubleVector xy_ = DoubleVector::Zero();
+    double yy_ = 0;
+
+    math::Matrix<NumParameters, NumParameters> block_xx_ = math::Matrix<NumParameters, NumParameters>::Zero();
+    Vector<NumParameters> block_xy_ = Vector<NumParameters>::Zero();
+    Scalar block_yy_ = 0;
+    unsigned block_length_ = 0;
+
+    std::uint32_t num_samples_ = 0;
+
+    void flush()
+    {
+        xx_ += block_xx_.template cast<double>();
+        xy_ += block_xy_.template cast<double>();
+        yy_ += double(block_yy_);
+
+        block_xx_.setZero();
+        block_xy_.setZero();
+        block_yy_ = 0;
+        block_length_ = 0;
+    }
+
+public:
+    /// Solutions where the ratio of the smallest to the largest pivot is below this are rejected
+    static constexpr double MinPivotRatio = 1e-9;
+
+    struct Solution
+    {
+        Vector<NumParameters> parameters = Vector<NumParameters>::Zero();
+        Scalar residual_rms = 0;
+        bool valid = false;
+    };
+
+    void addSample(const Vector<NumParameters>& regressor, Const y)
+    {
+        block_xx_.noalias() += regressor * regressor.transpose();
+        block_xy_ += regressor * y;
+        block_yy_ += y * y;
+        num_samples_++;
+
+        if (++block_length_ >= BlockLength)
+        {
+            flush();
+        }
+    }
+
+    std::uint32_t getNumSamples() const { return num_samples_; }
+
+    /**
+     * This method is slow, it should not be invoked from the PWM IRQ more than once.
+     */
+    Solution solve()
+    {
+        flush();
+
+        Solution out;
+        if (num_samples_ <= NumParameters)
+        {
+            return out;
+        }
+
+        const Eigen::LDLT<DoubleMatrix> ldlt(xx_);
+        const auto pivots = ldlt.vectorD().cwiseAbs();
+        if ((ldlt.info() != Eigen::Success) ||
+            !(pivots.minCoeff() > pivots.maxCoeff() * MinPivotRatio))
+        {
+            return out;
+        }
+
+        const DoubleVector theta = ldlt.solve(xy_);
+
+        // Since (xx * theta = xy), the residual sum of squares reduces to (yy - theta' * xy)
+        const double residual_sum_of_squares = std::max(0.0, yy_ - theta.dot(xy_));
+
+        out.parameters = theta.template cast<Scalar>();
+        out.residual_rms = Scalar(std::sqrt(residual_sum_of_squares / double(num_samples_)));
+        out.valid = out.parameters.allFinite();
+        return out;
+    }
+};
+
 /**
  * Interface of a motor ID task, e.g. resistance measurement.
  */
@@ -47,45 +47,200 @@ namespace motor_id
  *
  * Therefore, keep in mind that this operation is dependent on the Rs measurement procedure, and they
  * should be viewed holistically rather than as independent operations.
+ *
+ * The current vector is rotated at several frequencies in turn, and the complex impedance at each frequency is
+ * obtained by synchronous (lock-in) demodulation of the applied voltage and of the unfiltered current. In the frame
+ * that rotates with the injected vector the demodulation reduces to averaging over an integer number of cycles,
+ * which rejects the sensor offsets, the harmonics, and the noise. The transport delay of the applied voltage is
+ * compensated by rotating the voltage phasor back. Each frequency is split into blocks; the spread of the per-block
+ * estimates yields the confidence interval. The result is the inverse variance weighted mean over the frequencies.
  */
 class InductanceTask : public ISubTask
 {
-    static constexpr Scalar MeasurementDuration         = 15.0F;
-    static constexpr Scalar MinValidSampleRatio         = 0.99F;
+    static constexpr unsigned NumFrequencies            = 3;    ///< Half, one, and two times the nominal frequency
+    static constexpr unsigned NumBlocksPerFrequency     = 10;
+    static constexpr Scalar BlockDuration               = 0.25F;
+    static constexpr Scalar SettlingDuration            = 0.2F;
+    static constexpr unsigned MinSamplesPerCycle        = 4;
+
+    /// Student's t for 95% with (NumBlocksPerFrequency - 1) degrees of freedom
+    static constexpr Scalar ConfidenceIntervalTFactor   = 2.26F;
+
+    /// The measurement fails if the 95% confidence interval of the final estimate is wider than this, relative
+    static constexpr Scalar MaxRelativeConfidenceInterval = 0.1F;
+
     static constexpr Scalar OneSizeFitsAllLq            = 50.0e-6F;
     static constexpr unsigned IdqMovingAverageLength    = 5;
 
     using Modulator = ThreePhaseVoltageModulator<IdqMovingAverageLength>;
 
+    struct FrequencyResult
+    {
+        Scalar l = 0;                   ///< Henry
+        Scalar r = 0;                   ///< Ohm, includes the iron losses at this frequency
+        Scalar l_confidence_interval = 0;
+    };
+
     SubTaskContextReference context_;
     MotorParameters result_;
 
     Const estimation_current_;
-    Const angular_velocity_;
 
-    Scalar started_at_ = -1.0F;
     Status status_ = Status::InProgress;
 
-    std::array<math::CumulativeAverageComputer<>, 3> averagers_;
+    unsigned frequency_index_ = 0;
+    Scalar angular_velocity_ = 0;
+    unsigned samples_per_block_ = 0;
+    unsigned settling_samples_left_ = 0;
+
+    // Demodulator state of the current block
+    Vector<2> block_voltage_sum_ = Vector<2>::Zero();
+    Vector<2> block_current_sum_ = Vector<2>::Zero();
+    unsigned block_sample_count_ = 0;
+
+    std::array<Scalar, NumBlocksPerFrequency> block_l_{};
+    std::array<Scalar, NumBlocksPerFrequency> block_r_{};
+    unsigned block_index_ = 0;
+
+    std::array<FrequencyResult, NumFrequencies> frequency_results_{};
 
     Modulator modulator_;
     Modulator::Output last_modulator_output_;
 
     Scalar angular_position_ = 0;
 
+
+    /**
+     * The frequency is adjusted so that one cycle contains an integer number of PWM periods,
+     * and a block contains an integer number of cycles.
+     */
+    void beginFrequency(const unsigned index)
+    {
+        Const period = context_.board.pwm.period;
+        Const nominal_frequency = context_.params.motor_id.current_injection_frequency *
+                                  std::ldexp(1.0F, int(index) - 1);
+
+        const unsigned samples_per_cycle =
+            std::max(unsigned(MinSamplesPerCycle), unsigned(std::round(1.0F / (nominal_frequency * period))));
+        const unsigned cycles_per_block =
+            std::max(1U, unsigned(std::round(BlockDuration / (Scalar(samples_per_cycle) * period))));
+
+        frequency_index_ = index;
+        angular_velocity_ = math::Pi2 / (Scalar(samples_per_cycle) * period);
+        samples_per_block_ = samples_per_cycle * cycles_per_block;
+        settling_samples_left_ = unsigned(SettlingDuration / period);
+        block_index_ = 0;
+        resetBlock();
+    }
+
+    void resetBlock()
+    {
+        block_voltage_sum_.setZero();
+        block_current_sum_.setZero();
+        block_sample_count_ = 0;
+    }
+
+    /**
+     * Z = (U / I) * exp(-j * w * delay), where U and I are the complex DQ phasors (D is the real part).
+     */
+    void finalizeBlock()
+    {
+        const Vector<2>& u = block_voltage_sum_;
+        const Vector<2>& i = block_current_sum_;
+
+        Const i_sq = i.squaredNorm();
+        Vector<2> z(( u[0] * i[0] + u[1] * i[1]) / i_sq,
+                    (-u[0] * i[1] + u[1] * i[0]) / i_sq);
+
+        const auto delay_sincos = math::sincos(angular_velocity_ * CurrentLoopTransportDelay *
+                                               context_.board.pwm.period);
+        z = Vector<2>(z[0] * delay_sincos[1] + z[1] * delay_sincos[0],
+                      z[1] * delay_sincos[1] - z[0] * delay_sincos[0]);
+
+        block_r_[block_index_] = z[0];
+        block_l_[block_index_] = z[1] / angular_velocity_;
+        block_index_++;
+        resetBlock();
+    }
+
+    void finalizeFrequency()
+    {
+        Scalar l_sum = 0;
+        Scalar r_sum = 0;
+        for (unsigned i = 0; i < NumBlocksPerFrequency; i++)
+        {
+            l_sum += block_l_[i];
+            r_sum += block_r_[i];
+        }
+
+        auto& res = frequency_results_[frequency_index_];
+        res.l = l_sum / Scalar(NumBlocksPerFrequency);
+        res.r = r_sum / Scalar(NumBlocksPerFrequency);
+
+        Scalar l_variance = 0;
+        for (auto x : block_l_)
+        {
+            l_variance += (x - res.l) * (x - res.l);
+        }
+        l_variance /= Scalar(NumBlocksPerFrequency - 1);
+
+        res.l_confidence_interval = ConfidenceIntervalTFactor * std::sqrt(l_variance / Scalar(NumBlocksPerFrequency));
+    }
+
+    void computeResult()
+    {
+        Scalar weight_sum = 0;
+        Scalar weighted_l_sum = 0;
+
+        for (unsigned i = 0; i < NumFrequencies; i++)
+        {
+            const auto& res = frequency_results_[i];
+            IRQDebugOutputBuffer::setVariableFromIRQ(i, res.l);
+
+            if (MotorParameters::getLqLimits().contains(res.l) &&
+                (res.l_confidence_interval > 0))
+            {
+                Const weight = 1.0F / (res.l_confidence_interval * res.l_confidence_interval);
+                weight_sum += weight;
+                weighted_l_sum += weight * res.l;
+            }
+        }
+
+        Const l = (weight_sum > 0) ? (weighted_l_sum / weight_sum) : 0.0F;
+        Const relative_confidence_interval = (weight_sum > 0) ? (1.0F / (std::sqrt(weight_sum) * l)) : 0.0F;
+
+        IRQDebugOutputBuffer::setVariableFromIRQ<3>(relative_confidence_interval);
+        IRQDebugOutputBuffer::setVariableFromIRQ<4>(frequency_results_[0].r);
+
+        if (MotorParameters::getLqLimits().contains(l) &&
+            (relative_confidence_interval < MaxRelativeConfidenceInterval))
+        {
+            result_.lq = l;
+            status_ = Status::Succeeded;
+        }
+        else
+        {
+            result_.lq = 0;
+            status_ = Status::Failed;
+        }
+    }
+
 public:
     InductanceTask(SubTaskContextReference context,
                    const MotorParameters& initial_parameters) :
        context_(context),
        result_(initial_parameters),
        estimation_current_(initial_parameters.max_current * context.params.motor_id.fraction_of_max_current),
-       angular_velocity_(context.params.motor_id.current_injection_frequency * math::Pi2),
        modulator_(OneSizeFitsAllLq,
                   result_.rs,
                   result_.max_current,
                   context.board.pwm,
+                  context.params.controller.current_loop_bandwidth,
+                  IdqFilterMode::MovingAverage,
+                  1.0F,
                   Modulator::DeadTimeCompensationPolicy::Disabled,
-                  Modulator::CrossCouplingCompensationPolicy::Disabled)
+                  Modulator::CrossCouplingCompensationPolicy::Disabled,
+                  Modulator::DelayCompensationPolicy::Disabled)
     {
        result_.lq = 0;
 
@@ -95,6 +250,8 @@ public:
        {
            status_ = Status::Failed;
        }
+
+       beginFrequency(0);
     }
 
     void onMainIRQ(Const period) override
@@ -118,90 +275,51 @@ public:
             return;
         }
 
-        if (started_at_ < 0)
+        Modulator::Setpoint modulator_setpoint;
+        modulator_setpoint.mode = Modulator::Setpoint::Mode::Iq;
+        modulator_setpoint.value = estimation_current_;
+
+        last_modulator_output_ =
+            modulator_.onNextPWMPeriod(phase_currents_ab,
+                                       inverter_voltage,
+                                       angular_velocity_,
+                                       0.0F,
+                                       angular_position_,
+                                       modulator_setpoint);
+        angular_position_ = last_modulator_output_.extrapolated_angular_position;
+        context_.setPWM(last_modulator_output_.pwm_setpoint);
+
+        if (settling_samples_left_ > 0)
         {
-            started_at_ = context_.getTime();
+            settling_samples_left_--;
+            return;
         }
 
-        Const duration = context_.getTime() - started_at_;
-        assert(duration >= 0);
+        /*
+         * The reference voltage is output after the limiting, so it is the voltage that is actually applied;
+         * hence there is no need to discard the samples where the voltage was limited.
+         */
+        block_voltage_sum_ += last_modulator_output_.reference_Udq;
+        block_current_sum_ += last_modulator_output_.raw_Idq;
+        block_sample_count_++;
 
-        if (duration < MeasurementDuration)
+        if (block_sample_count_ >= samples_per_block_)
         {
-            Modulator::Setpoint modulator_setpoint;
-            modulator_setpoint.mode = Modulator::Setpoint::Mode::Iq;
-            modulator_setpoint.value = estimation_current_;
-
-            last_modulator_output_ =
-                modulator_.onNextPWMPeriod(phase_currents_ab,
-                                           inverter_voltage,
-                                           angular_velocity_,
-                                           angular_position_,
-                                           modulator_setpoint);
-            angular_position_ = last_modulator_output_.extrapolated_angular_position;
-            context_.setPWM(last_modulator_output_.pwm_setpoint);
-
-            // TODO: Compensation disabled, since it yields lower values than expected
-            Const dead_time_compensation_mult = 1.0F;
-            //Const dead_time_compensation_mult = 1.0F - pwm_dead_time_ / pwm_period_;
-
-            if (!last_modulator_output_.Udq_was_limited)
-            {
-                averagers_[0].addSample(last_modulator_output_.reference_Udq[0] * dead_time_compensation_mult);
-                averagers_[1].addSample(last_modulator_output_.reference_Udq[1] * dead_time_compensation_mult);
-                averagers_[2].addSample(last_modulator_output_.estimated_Idq[1]);
-            }
+            finalizeBlock();
         }
-        else
-        {
-            const auto min_samples_needed =
-                unsigned((MeasurementDuration / context_.board.pwm.period) * MinValidSampleRatio);
-            const auto num_samples_acquired = averagers_[0].getNumSamples();
-
-            assert(std::all_of(averagers_.begin(), averagers_.begin() + 3, [=](math::CumulativeAverageComputer<>& x) {
-                return x.getNumSamples() == num_samples_acquired;
-            }));
 
-            IRQDebugOutputBuffer::setVariableFromIRQ<4>(num_samples_acquired);
+        if (block_index_ >= NumBlocksPerFrequency)
+        {
+            finalizeFrequency();
 
-            if (num_samples_acquired >= min_samples_needed)
+            if ((frequency_index_ + 1) < NumFrequencies)
             {
-                Const Ud = Scalar(averagers_[0].getAverage());
-                Const Uq = Scalar(averagers_[1].getAverage());
-                Const Iq = Scalar(averagers_[2].getAverage());
-
-                Const LqHF = std::abs(Ud / (angular_velocity_ * Iq));    // Normally we'd need to use only this formula
-
-                Const RoverL = std::abs((angular_velocity_ * Uq) / Ud);  // This is a backup solution
-                Const LqRoverL = result_.rs / RoverL;
-
-                IRQDebugOutputBuffer::setVariableFromIRQ<0>(LqHF);
-                IRQDebugOutputBuffer::setVariableFromIRQ<1>(LqRoverL);
-                IRQDebugOutputBuffer::setVariableFromIRQ<2>(RoverL);
-
-                if (MotorParameters::getLqLimits().contains(LqHF) &&
-                    MotorParameters::getLqLimits().contains(LqRoverL))
-                {
-                    /*
-                     * Measured values are valid.
-                     * The LqHF formula is robust and tends to provide reliable results,
-                     * whereas RoverL is highly dependent on frequency and current.
-                     */
-                    result_.lq = LqHF;
-                    status_ = Status::Succeeded;
-                }
-                else
-                {
-                    // Measured values are invalid
-                    result_.lq = 0;
-                    status_ = Status::Failed;
-                }
+                beginFrequency(frequency_index_ + 1);
             }
             else
             {
-                // Not enough valid samples collected
-                result_.lq = 0;
-                status_ = Status::Failed;
+                context_.setPWM(Vector<3>::Zero());
+                computeResult();
             }
         }
     }
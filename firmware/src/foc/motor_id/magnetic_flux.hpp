@@ -77,8 +77,12 @@ public:
                    result_.rs,
                    result_.max_current,
                    context.board.pwm,
+                   context.params.controller.current_loop_bandwidth,
+                   IdqFilterMode::MovingAverage,
+                   1.0F,
                    Modulator::DeadTimeCompensationPolicy::Disabled,
-                   Modulator::CrossCouplingCompensationPolicy::Disabled),
+                   Modulator::CrossCouplingCompensationPolicy::Disabled,
+                   Modulator::DelayCompensationPolicy::Disabled),
         currents_filter_(Vector<2>::Zero()),
         voltage_filter_(Vector<2>::Zero()),
         Uq_(initial_Uq_)
@@ -135,6 +139,7 @@ public:
             const auto out = modulator_.onNextPWMPeriod(phase_currents_ab,
                                                         inverter_voltage,
                                                         angular_velocity_,
+                                                        0.0F,
                                                         angular_position_,
                                                         setpoint);
             context_.setPWM(out.pwm_setpoint);
@@ -0,0 +1,413 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "common.hpp"
+#include <foc/observer/flux_observer.hpp>
+
+
+namespace foc
+{
+namespace motor_id
+{
+/**
+ * Estimates the moment of inertia of the rotor (with whatever is attached to it), the viscous friction coefficient,
+ * and the Coulomb friction torque. The electrical parameters (Rs, L, Phi) and the number of poles must be known.
+ *
+ * The rotor is accelerated in open loop by a rotating current vector (I/f control), then the control is handed over
+ * to the flux observer. After that, the task alternates between torque steps, where the rotor is accelerated by
+ * a constant Iq from the low velocity to the high velocity, and coast-downs, where Iq is zero and the rotor is
+ * decelerated by friction alone. The mechanical equation is
+ *
+ *      Kt * Iq = J * dw/dt + B * w + Tc
+ *
+ * where w is the mechanical angular velocity. In order to avoid differentiation of the noisy angular velocity
+ * estimate, the equation is integrated over short windows of time:
+ *
+ *      Kt * integral(Iq) = J * delta(w) + B * integral(w) + Tc * delta(t)
+ *
+ * Every window yields one sample for the linear least squares problem with the parameters (J, B, Tc).
+ * The coast-downs make the friction terms observable independently of the inertia.
+ *
+ * The velocity estimate lags behind during the torque steps, so the windows are closed only during the coast-downs,
+ * once the observer has settled; this way every torque step is contained in one window entirely, and the lag
+ * cancels out.
+ */
+class MechanicalParametersTask : public ISubTask
+{
+    static constexpr Scalar AlignmentDuration               = 0.5F;
+    static constexpr Scalar SpinupDuration                  = 4.0F;
+    static constexpr Scalar HandoverTimeout                 = 2.0F;
+    static constexpr Scalar HandoverSettlingTime            = 0.2F;
+    static constexpr Scalar MaxHandoverVelocityError        = 0.1F;     ///< Relative to the open loop velocity
+    static constexpr Scalar AccelerationTimeout             = 3.0F;
+    static constexpr Scalar CoastDownTimeout                = 5.0F;
+    static constexpr unsigned NumCycles                     = 4;
+    static constexpr Scalar WindowLength                    = 0.01F;
+    static constexpr Scalar WindowSettlingTime              = 0.05F;    ///< After the torque step is removed
+
+    /// The low velocity is a multiple of the velocity used for Phi estimation, where the observer is known to work
+    static constexpr Scalar LowVelocityMultiplier           = 2.0F;
+    static constexpr Scalar HighToLowVelocityRatio          = 3.0F;
+    static constexpr Scalar MinHighToLowVelocityRatio       = 1.5F;
+
+    /// The back EMF at the high velocity must leave enough voltage for the current controller
+    static constexpr Scalar MaxBackEMFToPhaseVoltageRatio   = 0.5F;
+
+    /// If the angular velocity falls this much below the low velocity in closed loop, the rotor is stalled
+    static constexpr Scalar StallVelocityRatio              = 0.5F;
+
+    static constexpr unsigned IdqMovingAverageLength        = 5;
+
+    using Modulator = ThreePhaseVoltageModulator<IdqMovingAverageLength>;
+
+    enum class State
+    {
+        Alignment,
+        Spinup,
+        Handover,
+        Acceleration,
+        CoastDown
+    };
+
+    SubTaskContextReference context_;
+    MotorParameters result_;
+
+    Modulator modulator_;
+    observer::FluxObserver observer_;
+
+    Const current_;
+    Const torque_constant_;                 ///< Newton meter per Ampere of Iq
+    Const electrical_to_mechanical_;        ///< Mechanical angular velocity per electrical angular velocity
+    Const low_velocity_;                    ///< Electrical, radian per second
+    Scalar high_velocity_ = 0;              ///< Ditto; depends on the supply voltage, so it is computed later
+
+    State state_ = State::Alignment;
+    Status status_ = Status::InProgress;
+    Scalar state_switched_at_ = -1.0F;
+    Scalar handover_velocity_match_since_ = -1.0F;
+    unsigned num_completed_cycles_ = 0;
+
+    // Open loop state
+    Scalar open_loop_angular_velocity_ = 0;
+    Scalar open_loop_angular_position_ = 0;
+
+    // Integration window
+    Scalar window_started_at_ = -1.0F;
+    Scalar window_initial_mechanical_velocity_ = 0;
+    Scalar window_current_integral_ = 0;
+    Scalar window_velocity_integral_ = 0;
+
+    LeastSquaresAccumulator<3> accumulator_;
+
+    Scalar residual_ = 0;
+
+    Scalar getMechanicalAngularVelocity() const
+    {
+        return observer_.getAngularVelocity() * electrical_to_mechanical_;
+    }
+
+    void switchState(const State new_state)
+    {
+        state_ = new_state;
+        state_switched_at_ = context_.getTime();
+    }
+
+    Scalar getTimeSinceStateSwitch() const { return context_.getTime() - state_switched_at_; }
+
+    void resetWindow()
+    {
+        window_started_at_ = context_.getTime();
+        window_initial_mechanical_velocity_ = getMechanicalAngularVelocity();
+        window_current_integral_ = 0;
+        window_velocity_integral_ = 0;
+    }
+
+    void updateWindow(Const Iq)
+    {
+        Const dt = context_.board.pwm.period;
+        window_current_integral_ += Iq * dt;
+        window_velocity_integral_ += getMechanicalAngularVelocity() * dt;
+
+        Const duration = context_.getTime() - window_started_at_;
+        if ((duration >= WindowLength) &&
+            (state_ == State::CoastDown) &&
+            (getTimeSinceStateSwitch() >= WindowSettlingTime))
+        {
+            const Vector<3> regressor(getMechanicalAngularVelocity() - window_initial_mechanical_velocity_,
+                                      window_velocity_integral_,
+                                      duration);
+            accumulator_.addSample(regressor, torque_constant_ * window_current_integral_);
+            resetWindow();
+        }
+    }
+
+    void finalize()
+    {
+        const auto solution = accumulator_.solve();
+
+        Const inertia = solution.parameters[0];
+        Const viscous_friction = solution.parameters[1];
+        Const coulomb_friction = solution.parameters[2];
+
+        residual_ = solution.residual_rms;
+
+        IRQDebugOutputBuffer::setVariableFromIRQ<0>(inertia * 1e6F);
+        IRQDebugOutputBuffer::setVariableFromIRQ<1>(viscous_friction * 1e6F);
+        IRQDebugOutputBuffer::setVariableFromIRQ<2>(coulomb_friction * 1e3F);
+        IRQDebugOutputBuffer::setVariableFromIRQ<3>(residual_);
+        IRQDebugOutputBuffer::setVariableFromIRQ<4>(accumulator_.getNumSamples());
+
+        // Friction estimates may come out slightly negative due to noise if the friction is negligible,
+        // so only the upper limits are checked; the values are clamped afterwards
+        if (solution.valid &&
+            MotorParameters::getRotorInertiaLimits().contains(inertia) &&
+            (viscous_friction <= MotorParameters::getViscousFrictionLimits().max) &&
+            (coulomb_friction <= MotorParameters::getCoulombFrictionLimits().max))
+        {
+            result_.rotor_inertia = inertia;
+            result_.viscous_friction = MotorParameters::getViscousFrictionLimits().constrain(viscous_friction);
+            result_.coulomb_friction = MotorParameters::getCoulombFrictionLimits().constrain(coulomb_friction);
+            status_ = Status::Succeeded;
+        }
+        else
+        {
+            status_ = Status::Failed;
+        }
+    }
+
+public:
+    MechanicalParametersTask(SubTaskContextReference context,
+                             const MotorParameters& initial_parameters) :
+        context_(context),
+        result_(initial_parameters),
+        modulator_(initial_parameters.lq,
+                   initial_parameters.rs,
+                   initial_parameters.max_current,
+                   context.board.pwm,
+                   context.params.controller.current_loop_bandwidth,
+                   IdqFilterMode::MovingAverage,
+                   1.0F,
+                   Modulator::DeadTimeCompensationPolicy::Disabled,
+                   Modulator::CrossCouplingCompensationPolicy::Disabled,
+                   Modulator::DelayCompensationPolicy::Enabled),
+        observer_(context.params.observer,
+                  MotorParameters::getPhiLimits().constrain(initial_parameters.phi),
+                  initial_parameters.lq,
+                  initial_parameters.rs),
+        current_(initial_parameters.max_current * context.params.motor_id.fraction_of_max_current),
+        torque_constant_(1.5F * initial_parameters.phi * Scalar(initial_parameters.num_poles / 2U)),
+        electrical_to_mechanical_(2.0F / Scalar(std::max(initial_parameters.num_poles, std::uint_fast8_t(2)))),
+        low_velocity_(context.params.motor_id.phi_estimation_electrical_angular_velocity * LowVelocityMultiplier)
+    {
+        result_.rotor_inertia = 0;
+        result_.viscous_friction = 0;
+        result_.coulomb_friction = 0;
+
+        if (!context_.params.motor_id.isValid() ||
+            !result_.getRsLimits().contains(result_.rs) ||
+            !result_.getLqLimits().contains(result_.lq) ||
+            !result_.getPhiLimits().contains(result_.phi) ||
+            (result_.num_poles < 2) ||
+            (result_.num_poles % 2 != 0) ||
+            !os::float_eq::positive(result_.max_current))
+        {
+            status_ = Status::Failed;
+        }
+
+        observer_.setDirectionConstraint(observer::DirectionConstraint::Forward);
+    }
+
+    void onMainIRQ(Const period) override
+    {
+        (void) period;
+        context_.reportDebugVariables({
+            open_loop_angular_velocity_,
+            observer_.getAngularVelocity(),
+            Scalar(state_),
+            Scalar(num_completed_cycles_),
+            Scalar(accumulator_.getNumSamples())
+        });
+    }
+
+    void onNextPWMPeriod(const Vector<2>& phase_currents_ab,
+                         Const inverter_voltage) override
+    {
+        if (status_ != Status::InProgress)
+        {
+            return;
+        }
+
+        Const dt = context_.board.pwm.period;
+
+        if (state_switched_at_ < 0)
+        {
+            switchState(State::Alignment);
+        }
+
+        /*
+         * Control
+         */
+        const bool closed_loop = (state_ == State::Acceleration) || (state_ == State::CoastDown);
+
+        Modulator::Setpoint setpoint;
+        setpoint.mode = Modulator::Setpoint::Mode::Iq;
+        setpoint.value = (state_ == State::CoastDown) ? 0.0F : current_;
+
+        const auto out = closed_loop ?
+            modulator_.onNextPWMPeriod(phase_currents_ab,
+                                       inverter_voltage,
+                                       observer_.getAngularVelocity(),
+                                       0.0F,
+                                       observer_.getAngularPosition(),
+                                       setpoint) :
+            modulator_.onNextPWMPeriod(phase_currents_ab,
+                                       inverter_voltage,
+                                       open_loop_angular_velocity_,
+                                       0.0F,
+                                       open_loop_angular_position_,
+                                       setpoint);
+
+        context_.setPWM(out.pwm_setpoint);
+
+        open_loop_angular_position_ = out.extrapolated_angular_position;
+
+        observer_.update(dt, out.raw_Idq, out.reference_Udq, out.extrapolated_angular_position);
+
+        /*
+         * State machine
+         */
+        switch (state_)
+        {
+        case State::Alignment:
+        {
+            // The current vector is stationary, the rotor is aligned with it
+            if (getTimeSinceStateSwitch() > AlignmentDuration)
+            {
+                switchState(State::Spinup);
+            }
+            break;
+        }
+        case State::Spinup:
+        {
+            open_loop_angular_velocity_ += (low_velocity_ / SpinupDuration) * dt;
+            if (open_loop_angular_velocity_ >= low_velocity_)
+            {
+                open_loop_angular_velocity_ = low_velocity_;
+                switchState(State::Handover);
+            }
+            break;
+        }
+        case State::Handover:
+        {
+            Const error = std::abs(observer_.getAngularVelocity() - open_loop_angular_velocity_);
+            if (error < (open_loop_angular_velocity_ * MaxHandoverVelocityError))
+            {
+                if (handover_velocity_match_since_ < 0)
+                {
+                    handover_velocity_match_since_ = context_.getTime();
+                }
+            }
+            else
+            {
+                handover_velocity_match_since_ = -1.0F;
+            }
+
+            if ((handover_velocity_match_since_ >= 0) &&
+                ((context_.getTime() - handover_velocity_match_since_) > HandoverSettlingTime))
+            {
+                // The highest velocity is limited by the supply voltage
+                Const max_phase_voltage = inverter_voltage / std::sqrt(3.0F);
+                high_velocity_ = std::min(low_velocity_ * HighToLowVelocityRatio,
+                                          max_phase_voltage * MaxBackEMFToPhaseVoltageRatio / result_.phi);
+                if (high_velocity_ < low_velocity_ * MinHighToLowVelocityRatio)
+                {
+                    status_ = Status::Failed;
+                    break;
+                }
+
+                switchState(State::Acceleration);
+                resetWindow();
+            }
+            else if (getTimeSinceStateSwitch() > HandoverTimeout)
+            {
+                status_ = Status::Failed;   // The observer could not converge
+            }
+            break;
+        }
+        case State::Acceleration:
+        case State::CoastDown:
+        {
+            updateWindow(out.raw_Idq[1]);
+
+            if (observer_.getAngularVelocity() < (low_velocity_ * StallVelocityRatio))
+            {
+                status_ = Status::Failed;
+                break;
+            }
+
+            if (state_ == State::Acceleration)
+            {
+                if ((observer_.getAngularVelocity() >= high_velocity_) ||
+                    (getTimeSinceStateSwitch() > AccelerationTimeout))
+                {
+                    switchState(State::CoastDown);
+                }
+            }
+            else
+            {
+                if ((observer_.getAngularVelocity() <= low_velocity_) ||
+                    (getTimeSinceStateSwitch() > CoastDownTimeout))
+                {
+                    num_completed_cycles_++;
+                    if (num_completed_cycles_ >= NumCycles)
+                    {
+                        finalize();
+                    }
+                    else
+                    {
+                        switchState(State::Acceleration);
+                    }
+                }
+            }
+            break;
+        }
+        default:
+        {
+            assert(false);
+            status_ = Status::Failed;
+            break;
+        }
+        }
+    }
+
+    Status getStatus() const override { return status_; }
+
+    MotorParameters getEstimatedMotorParameters() const override { return result_; }
+};
+
+}
+}
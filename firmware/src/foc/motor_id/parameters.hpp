@@ -48,12 +48,29 @@ enum class Mode
      */
     Static,
 
+    /**
+     * Same restrictions as in the static mode, but the parameters are estimated in a single pass with broadband
+     * excitation, which is many times faster. This mode is intended for end-of-line testing.
+     * Estimated parameters: Rs, L (Ld and the dead time voltage drop are reported for information only).
+     */
+    StaticBroadband,
+
     /**
      * In this mode, the motor WILL SPIN.
      * In order to achieve correct results, the motor MUST NOT BE CONNECTED TO ANY MECHANICAL LOAD.
      * Estimated parameters: Rs, L, Phi.
+     * The mechanical parameters are identified separately in the mode below, so that a failure of that
+     * identification can't discard the electrical parameters.
+     */
+    RotationWithoutMechanicalLoad,
+
+    /**
+     * In this mode, the motor WILL SPIN.
+     * The electrical parameters must be known already (e.g. identified in the mode above), and the load
+     * (e.g. propeller) may be connected, in which case its inertia will be included in the result.
+     * Estimated parameters: rotor inertia, viscous and Coulomb friction.
      */
-    RotationWithoutMechanicalLoad
+    Mechanical
 };
 
 /**
@@ -62,6 +79,8 @@ enum class Mode
  */
 struct Parameters
 {
+    static constexpr unsigned MaxRuns = 10;
+
     /// Fraction of the maximum motor current used for identification
     Scalar fraction_of_max_current = 0.3F;
 
@@ -71,6 +90,12 @@ struct Parameters
     /// Electrical angular velocity used for magnetic flux linkage identification, radian/second
     Scalar phi_estimation_electrical_angular_velocity = 150.0F;
 
+    /// Number of times the identification sequence is repeated; the result is the mean of the accepted runs
+    unsigned num_runs = 1;
+
+    /// If the relative standard deviation of any parameter over the runs exceeds this value, identification fails
+    Scalar max_relative_deviation = 0.05F;
+
 
     bool isValid() const
     {
@@ -83,10 +108,14 @@ struct Parameters
     {
         return os::heapless::format("FracI: %.0f %%\n"
                                     "Finj : %.1f Hz\n"
-                                    "Wphi : %.1f rad/s",
+                                    "Wphi : %.1f rad/s\n"
+                                    "Runs : %u\n"
+                                    "MaxSD: %.1f %%",
                                     double(fraction_of_max_current * 100.0F),
                                     double(current_injection_frequency),
-                                    double(phi_estimation_electrical_angular_velocity));
+                                    double(phi_estimation_electrical_angular_velocity),
+                                    num_runs,
+                                    double(max_relative_deviation * 100.0F));
     }
 };
 
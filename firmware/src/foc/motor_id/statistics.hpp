@@ -0,0 +1,281 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <foc/parameters.hpp>
+#include <zubax_chibios/util/heapless.hpp>
+#include <math/math.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <array>
+
+
+namespace foc
+{
+namespace motor_id
+{
+/**
+ * Spread of the identified parameters over repeated identification runs.
+ * Parameters that are not identified in the selected mode have zero samples.
+ */
+class Statistics
+{
+    friend class StatisticsAccumulator;
+
+public:
+    enum class Variable
+    {
+        Rs,
+        Lq,
+        Phi,
+        RotorInertia
+    };
+
+    static constexpr unsigned NumVariables = 4;
+
+    struct Entry
+    {
+        Scalar mean = 0;
+        Scalar standard_deviation = 0;
+        std::uint8_t num_samples = 0;       ///< Number of accepted samples
+        std::uint8_t num_outliers = 0;      ///< Number of rejected samples
+
+        Scalar getVariance() const { return standard_deviation * standard_deviation; }
+
+        Scalar getRelativeStandardDeviation() const
+        {
+            return (mean > 0) ? (standard_deviation / mean) : 0.0F;
+        }
+    };
+
+private:
+    std::array<Entry, NumVariables> entries_{};
+    std::uint8_t num_runs_ = 0;
+
+public:
+    const Entry& get(const Variable var) const { return entries_.at(unsigned(var)); }
+
+    unsigned getNumRuns() const { return num_runs_; }
+
+    /**
+     * Returns true if the relative standard deviation of every identified parameter does not exceed the limit.
+     * A single run is always considered repeatable, since there's nothing to compare it against.
+     * Only the variables listed in @ref Variable are checked. The friction parameters are not collected at all,
+     * because they are often too close to zero to be compared in relative terms.
+     */
+    bool isRepeatable(Const max_relative_standard_deviation) const
+    {
+        return std::all_of(entries_.begin(), entries_.end(), [&](const Entry& e) {
+            return e.getRelativeStandardDeviation() <= max_relative_standard_deviation;
+        });
+    }
+
+    auto toString() const
+    {
+        const auto& rs = get(Variable::Rs);
+        const auto& lq = get(Variable::Lq);
+        const auto& phi = get(Variable::Phi);
+        const auto& j = get(Variable::RotorInertia);
+
+        return os::heapless::format("Runs : %u\n"
+                                    "Rs   : %.6f Ohm +/- %.2f %%, %u/%u outliers\n"
+                                    "Lq   : %.3f uH +/- %.2f %%, %u/%u outliers\n"
+                                    "Phi  : %.6f mWb +/- %.2f %%, %u/%u outliers\n"
+                                    "J    : %.6f kg*mm^2 +/- %.2f %%, %u/%u outliers",
+                                    getNumRuns(),
+                                    double(rs.mean),
+                                    double(rs.getRelativeStandardDeviation() * 100.0F),
+                                    unsigned(rs.num_outliers), unsigned(rs.num_samples + rs.num_outliers),
+                                    double(lq.mean * 1e6F),
+                                    double(lq.getRelativeStandardDeviation() * 100.0F),
+                                    unsigned(lq.num_outliers), unsigned(lq.num_samples + lq.num_outliers),
+                                    double(phi.mean * 1e3F),
+                                    double(phi.getRelativeStandardDeviation() * 100.0F),
+                                    unsigned(phi.num_outliers), unsigned(phi.num_samples + phi.num_outliers),
+                                    double(j.mean * 1e6F),
+                                    double(j.getRelativeStandardDeviation() * 100.0F),
+                                    unsigned(j.num_outliers), unsigned(j.num_samples + j.num_outliers));
+    }
+};
+
+/**
+ * Collects the results of repeated identification runs and computes their statistics.
+ * Outliers are rejected using the modified Z-score, which is based on the median absolute deviation (MAD),
+ * because the mean and the standard deviation are themselves distorted by the outliers.
+ */
+class StatisticsAccumulator
+{
+public:
+    static constexpr unsigned MaxRuns = Parameters::MaxRuns;
+
+    /// Samples whose modified Z-score exceeds this value are rejected (Iglewicz and Hoaglin)
+    static constexpr Scalar MaxModifiedZScore = 3.5F;
+
+    /// The MAD is not allowed to go below this fraction of the median, otherwise nearly identical
+    /// samples would make any tiny deviation look like an outlier
+    static constexpr Scalar MinRelativeMAD = 1e-3F;
+
+private:
+    using SampleArray = std::array<Scalar, MaxRuns>;
+
+    std::array<SampleArray, Statistics::NumVariables> samples_{};
+    std::array<bool, Statistics::NumVariables> enabled_{};
+    std::uint8_t num_runs_ = 0;
+
+    static Scalar computeMedian(SampleArray values, const unsigned num_values)
+    {
+        assert((num_values > 0) && (num_values <= MaxRuns));
+        std::sort(values.begin(), values.begin() + num_values);
+        const unsigned mid = num_values / 2U;
+        return ((num_values % 2U) == 0) ? ((values[mid - 1] + values[mid]) * 0.5F) : values[mid];
+    }
+
+    Statistics::Entry computeEntry(const SampleArray& values) const
+    {
+        Statistics::Entry out;
+        if (num_runs_ == 0)
+        {
+            return out;
+        }
+
+        const Scalar median = computeMedian(values, num_runs_);
+
+        SampleArray abs_deviations{};
+        for (unsigned i = 0; i < num_runs_; i++)
+        {
+            abs_deviations[i] = std::abs(values[i] - median);
+        }
+
+        const Scalar mad = std::max(computeMedian(abs_deviations, num_runs_), std::abs(median) * MinRelativeMAD);
+
+        // The constant 0.6745 is the 0.75 quantile of the standard normal distribution
+        const auto is_outlier = [&](Const x) { return (0.6745F * std::abs(x - median) / mad) > MaxModifiedZScore; };
+
+        Scalar sum = 0;
+        for (unsigned i = 0; i < num_runs_; i++)
+        {
+            if (is_outlier(values[i]))
+            {
+                out.num_outliers++;
+            }
+            else
+            {
+                sum += values[i];
+                out.num_samples++;
+            }
+        }
+
+        assert(out.num_samples > 0);    // At least half of the samples can't be outliers by definition
+        out.mean = sum / Scalar(out.num_samples);
+
+        if (out.num_samples > 1)
+        {
+            Scalar sum_squares = 0;
+            for (unsigned i = 0; i < num_runs_; i++)
+            {
+                if (!is_outlier(values[i]))
+                {
+                    const Scalar deviation = values[i] - out.mean;
+                    sum_squares += deviation * deviation;
+                }
+            }
+            out.standard_deviation = std::sqrt(sum_squares / Scalar(out.num_samples - 1));
+        }
+
+        return out;
+    }
+
+public:
+    /**
+     * @param mode      Defines which parameters are identified
+     */
+    explicit StatisticsAccumulator(const Mode mode)
+    {
+        const bool mechanical = mode == Mode::Mechanical;
+
+        enabled_[unsigned(Statistics::Variable::Rs)]            = !mechanical;
+        enabled_[unsigned(Statistics::Variable::Lq)]            = !mechanical;
+        enabled_[unsigned(Statistics::Variable::Phi)]           = mode == Mode::RotationWithoutMechanicalLoad;
+        enabled_[unsigned(Statistics::Variable::RotorInertia)]  = mechanical;
+    }
+
+    void addRun(const MotorParameters& result)
+    {
+        if (num_runs_ < MaxRuns)
+        {
+            samples_[unsigned(Statistics::Variable::Rs)][num_runs_]  = result.rs;
+            samples_[unsigned(Statistics::Variable::Lq)][num_runs_]  = result.lq;
+            samples_[unsigned(Statistics::Variable::Phi)][num_runs_] = result.phi;
+            samples_[unsigned(Statistics::Variable::RotorInertia)][num_runs_] = result.rotor_inertia;
+            num_runs_++;
+        }
+        else
+        {
+            assert(false);
+        }
+    }
+
+    unsigned getNumRuns() const { return num_runs_; }
+
+    /**
+     * This method is slow, it should be invoked once at the end.
+     */
+    Statistics compute() const
+    {
+        Statistics out;
+        out.num_runs_ = num_runs_;
+        for (unsigned i = 0; i < Statistics::NumVariables; i++)
+        {
+            if (enabled_[i])
+            {
+                out.entries_[i] = computeEntry(samples_[i]);
+            }
+        }
+        return out;
+    }
+
+    /**
+     * Replaces the identified parameters with the means of the accepted samples.
+     */
+    static void applyMeans(const Statistics& stat, MotorParameters& inout_result)
+    {
+        const auto apply = [&](Statistics::Variable var, Scalar& out) {
+            if (stat.get(var).num_samples > 0)
+            {
+                out = stat.get(var).mean;
+            }
+        };
+        apply(Statistics::Variable::Rs,  inout_result.rs);
+        apply(Statistics::Variable::Lq,  inout_result.lq);
+        apply(Statistics::Variable::Phi, inout_result.phi);
+        apply(Statistics::Variable::RotorInertia, inout_result.rotor_inertia);
+    }
+};
+
+}
+}
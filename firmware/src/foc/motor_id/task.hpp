@@ -28,6 +28,9 @@
 #include "resistance.hpp"
 #include "inductance.hpp"
 #include "magnetic_flux.hpp"
+#include "broadband.hpp"
+#include "mechanical.hpp"
+#include "statistics.hpp"
 
 
 namespace foc
@@ -107,7 +110,18 @@ public:
         sequence_length_ = sizeof...(TaskTypes);
         current_task_index_ = 0;
 
-        current_task_ = Tasks::findTypeByID(*this, current_task_index_);
+        current_task_ = Tasks::findTypeByID(*this, sequence_[current_task_index_]);
+    }
+
+    /**
+     * Restarts the sequence from the first task, e.g. for repeated identification.
+     */
+    void rewind()
+    {
+        assert(sequence_length_ > 0);
+        destroyCurrentTask();
+        current_task_index_ = 0;
+        current_task_ = Tasks::findTypeByID(*this, sequence_[current_task_index_]);
     }
 
     bool selectNextTask()
@@ -116,7 +130,7 @@ public:
         {
             destroyCurrentTask();
             current_task_index_++;
-            current_task_ = Tasks::findTypeByID(*this, current_task_index_);
+            current_task_ = Tasks::findTypeByID(*this, sequence_[current_task_index_]);
             return true;
         }
         return false;
@@ -174,15 +188,21 @@ class MotorIdentificationTask : public ITask
     static constexpr Result::ExitCode ExitCodeBadHardwareStatus     = Result::MaxExitCode - 0;
     static constexpr Result::ExitCode ExitCodeInvalidParameters     = Result::MaxExitCode - 1;
     static constexpr Result::ExitCode ExitCodeInvalidSequence       = Result::MaxExitCode - 2;
+    static constexpr Result::ExitCode ExitCodeNotRepeatable         = Result::MaxExitCode - 3;
 
     const Mode mode_;
 
     MotorParameters result_;
 
+    StatisticsAccumulator statistics_accumulator_;
+    Statistics statistics_;
+
     SubTaskSequencer
     < ResistanceTask
     , InductanceTask
     , MagneticFluxTask
+    , BroadbandIdentificationTask
+    , MechanicalParametersTask
     > sequencer_;
 
     bool started_ = false;
@@ -194,6 +214,7 @@ public:
         context_(context),
         mode_(mode),
         result_(context.params.motor),
+        statistics_accumulator_(mode),
         sequencer_(context_, result_)
     { }
 
@@ -211,11 +232,21 @@ public:
                 sequencer_.setSequence<ResistanceTask, InductanceTask>();
                 break;
             }
+            case Mode::StaticBroadband:
+            {
+                sequencer_.setSequence<BroadbandIdentificationTask>();
+                break;
+            }
             case Mode::RotationWithoutMechanicalLoad:
             {
                 sequencer_.setSequence<ResistanceTask, InductanceTask, MagneticFluxTask>();
                 break;
             }
+            case Mode::Mechanical:
+            {
+                sequencer_.setSequence<MechanicalParametersTask>();
+                break;
+            }
             default:
             {
                 assert(false);
@@ -271,13 +302,41 @@ public:
              */
             if (!sequencer_.selectNextTask())
             {
-                return Result::success();
+                return onSequenceCompletion();
             }
         }
 
         return Result::inProgress();
     }
 
+    /**
+     * Either restarts the sequence for the next run, or aggregates the results if this was the last run.
+     * The PWM IRQ processing is paused at this point, so the result can be modified without locking.
+     */
+    Result onSequenceCompletion()
+    {
+        statistics_accumulator_.addRun(result_);
+
+        if (statistics_accumulator_.getNumRuns() < context_.params.motor_id.num_runs)
+        {
+            result_ = context_.params.motor;    // Every run starts from scratch so that the runs are independent
+            sequencer_.rewind();
+            return Result::inProgress();
+        }
+
+        statistics_ = statistics_accumulator_.compute();
+        StatisticsAccumulator::applyMeans(statistics_, result_);
+
+        if (!statistics_.isRepeatable(context_.params.motor_id.max_relative_deviation))
+        {
+            // The results can't be trusted, so the original parameters are retained
+            result_ = context_.params.motor;
+            return Result::failure(ExitCodeNotRepeatable);
+        }
+
+        return Result::success();
+    }
+
     std::pair<Vector<3>, bool> onNextPWMPeriod(const Vector<2>& phase_currents_ab,
                                                Const inverter_voltage) override
     {
@@ -305,9 +364,10 @@ public:
         return {context_.pwm_output_vector, true};
     }
 
-    void applyResultToGlobalContext(TaskContext& inout_context) const override
+    void applyResultToGlobalContext(GlobalContext& inout_context, Parameters& inout_params) const override
     {
-        inout_context.params.motor = result_;
+        inout_params.motor = result_;
+        inout_context.motor_id_statistics = statistics_;
     }
 
     bool isPreCalibrationRequired() const override { return true; }
@@ -323,7 +383,10 @@ public:
         }
         else
         {
-            return Scalar(sequencer_.getCurrentTaskIndex() + 1) / Scalar(sequencer_.getSequenceLength() + 1);
+            const unsigned num_runs = context_.params.motor_id.num_runs;
+            const unsigned length = sequencer_.getSequenceLength();
+            const unsigned index = statistics_accumulator_.getNumRuns() * length + sequencer_.getCurrentTaskIndex();
+            return Scalar(index + 1) / Scalar(num_runs * length + 1);
         }
     }
 };
@@ -25,7 +25,14 @@
 #pragma once
 
 #include "parameters.hpp"
+#include "spinup_profile.hpp"
 #include "voltage_modulator.hpp"
+#include "initial_position_detector.hpp"
+#include "observer/observer.hpp"
+#include "observer/flux_observer.hpp"
+#include "observer/hf_injection.hpp"
+#include "observer/online_parameter_estimator.hpp"
+#include "observer/desync_detector.hpp"
 #include <math/math.hpp>
 #include <board/motor.hpp>
 #include <cassert>
@@ -49,7 +56,22 @@ class MotorRunner final
     static constexpr unsigned IdqMovingAverageLength = 5;
 
     static constexpr Scalar MaximumSpinupDurationFraction          = 1.5F;
-    static constexpr Scalar SpinupAngularVelocityHysteresis        = 3.0F;
+
+    /// Seconds; angular acceleration is obtained by differentiating the observed velocity, hence heavy filtering
+    static constexpr Scalar AngularAccelerationFilterTimeConstant  = 0.01F;
+
+    /// Seconds
+    static constexpr Scalar EstimatorComparisonFilterTimeConstant  = 1.0F;
+
+    /// Seconds; the HF injection estimator locks before the torque is applied
+    static constexpr Scalar HFInjectionSettlingTime                = 0.05F;
+
+    /// The back-EMF estimator must agree with the HF injection estimator before the handover
+    static constexpr Scalar HFInjectionHandoverAngleTolerance      = math::Pi / 6.0F;
+    static constexpr Scalar HFInjectionHandoverVelocityTolerance   = 0.2F;  ///< Fraction of the angular velocity
+
+    /// Amplitude of the initial position detection pulses as a fraction of the maximum current
+    static constexpr Scalar InitialPositionDetectionCurrentFraction = 0.5F;
 
     using Modulator = ThreePhaseVoltageModulator<IdqMovingAverageLength>;
 
@@ -78,36 +100,108 @@ private:
 
     const Direction direction_;
 
+    Const spinup_ramp_duration_;
+    Const handover_angular_velocity_;
+
+    const Scalar pwm_period_;
+
     State state_ = State::Spinup;
 
     observer::Observer observer_;
+    observer::FluxObserver flux_observer_;
+
+    observer::IEstimator& estimator_;
+    observer::IEstimator* const shadow_estimator_;      ///< Nullptr if the shadow mode is disabled
+
+    observer::EstimatorComparisonStatistics estimator_comparison_;
+
+    observer::OnlineParameterEstimator parameter_estimator_;
+
+    observer::DesyncDetector desync_detector_;
 
     Setpoint regular_setpoint_;
     Setpoint spinup_setpoint_;
 
     Scalar angular_velocity_ = 0;
+    Scalar angular_acceleration_ = 0;
 
     Scalar remaining_time_before_stall_detection_enabled_ = 0;
     Scalar spinup_time_ = 0;
+    SpinupTelemetry spinup_telemetry_;
+
+    bool initial_position_detection_pending_;
 
     // Mutable entities can be modified from the PWM modulation method
     mutable Modulator modulator_;
     mutable Scalar angular_position_ = 0;
+    mutable Scalar extrapolated_angular_velocity_ = 0;
+    mutable std::uint32_t pwm_period_count_ = 0;
+    mutable observer::HFInjectionEstimator<IdqMovingAverageLength> hfi_;
+    mutable bool hfi_active_;
+    mutable InitialPositionDetector ipd_;
     mutable Vector<2> estimated_Idq_ = Vector<2>::Zero();
     mutable Vector<2> reference_Udq_ = Vector<2>::Zero();
+    mutable std::pair<Vector<2>, bool> predicted_phase_currents_ab_{ Vector<2>::Zero(), false };
 
 
     bool isReversed() const { return direction_ == Direction::Reverse; }
 
+    observer::IEstimator& selectEstimator(const bool shadow)
+    {
+        const bool ekf = (controller_params_.estimator == EstimatorType::EKF) != shadow;
+        return ekf ? static_cast<observer::IEstimator&>(observer_) : flux_observer_;
+    }
+
+    void setDirectionConstraint(const observer::DirectionConstraint dc)
+    {
+        estimator_.setDirectionConstraint(dc);
+        if (shadow_estimator_ != nullptr)
+        {
+            shadow_estimator_->setDirectionConstraint(dc);
+        }
+    }
+
+    void updateEstimatorComparison(Const period,
+                                   const std::uint32_t primary_cycles,
+                                   const std::uint32_t shadow_cycles)
+    {
+        assert(shadow_estimator_ != nullptr);
+        auto& st = estimator_comparison_;
+
+        Const angle_error = math::normalizeAngleDifference(shadow_estimator_->getAngularPosition() -
+                                                           estimator_.getAngularPosition());
+        Const angular_velocity_error = shadow_estimator_->getAngularVelocity() - estimator_.getAngularVelocity();
+
+        Const innov = (st.num_samples == 0) ? 1.0F : (period / (period + EstimatorComparisonFilterTimeConstant));
+
+        st.angle_error_mean += innov * (angle_error - st.angle_error_mean);
+        st.angle_error_rms = std::sqrt(st.angle_error_rms * st.angle_error_rms +
+                                       innov * (angle_error * angle_error - st.angle_error_rms * st.angle_error_rms));
+        st.angle_error_max = std::max(st.angle_error_max, std::abs(angle_error));
+
+        Const ave_sq = st.angular_velocity_error_rms * st.angular_velocity_error_rms;
+        st.angular_velocity_error_rms =
+            std::sqrt(ave_sq + innov * (angular_velocity_error * angular_velocity_error - ave_sq));
+
+        st.primary_cycles += innov * (Scalar(primary_cycles) - st.primary_cycles);
+        st.shadow_cycles  += innov * (Scalar(shadow_cycles)  - st.shadow_cycles);
+
+        st.num_samples++;
+    }
+
 public:
     MotorRunner(const ControllerParameters& controller_params,
                 const MotorParameters& motor_params,
                 const observer::Parameters& observer_params,
                 const board::motor::PWMParameters& pwm_params,
+                const SpinupProfile& spinup_profile,
                 const Direction dir) :
         controller_params_(controller_params),
         motor_params_(motor_params),
         direction_(dir),
+        spinup_ramp_duration_(spinup_profile.ramp_duration),
+        handover_angular_velocity_(motor_params.min_electrical_ang_vel * spinup_profile.handover_velocity_ratio),
+        pwm_period_(pwm_params.period),
 
         observer_(observer_params,
                   motor_params.phi,
@@ -115,13 +209,49 @@ public:
                   motor_params.lq,
                   motor_params.rs),
 
+        flux_observer_(observer_params,
+                       motor_params.phi,
+                       motor_params.lq,
+                       motor_params.rs),
+
+        estimator_(selectEstimator(false)),
+        shadow_estimator_(controller_params.shadow_estimator_enabled ? &selectEstimator(true) : nullptr),
+
+        parameter_estimator_(motor_params.rs,
+                             motor_params.phi,
+                             motor_params.lq,
+                             motor_params.min_current,
+                             motor_params.min_electrical_ang_vel),
+
+        desync_detector_(motor_params.phi,
+                         motor_params.rs,
+                         motor_params.lq,
+                         motor_params.min_electrical_ang_vel),
+
+        initial_position_detection_pending_(controller_params.initial_position_detection_enabled),
+
         modulator_(motor_params.lq,
                    motor_params.rs,
                    motor_params.max_current,
                    pwm_params,
+                   controller_params.current_loop_bandwidth,
+                   controller_params.idq_filter_mode,
+                   controller_params.idq_filter_iir_weight,
                    modulator_.DeadTimeCompensationPolicy::Disabled,
-                   modulator_.CrossCouplingCompensationPolicy::Disabled)
-    { }
+                   modulator_.CrossCouplingCompensationPolicy::Disabled,
+                   modulator_.DelayCompensationPolicy::Enabled),
+
+        hfi_(pwm_params.period,
+             (controller_params.hfi_voltage > 0) ? controller_params.hfi_voltage : 1.0F,
+             CurrentLoopTransportDelay),
+        hfi_active_(controller_params.hfi_voltage > 0),
+        ipd_(motor_params.lq,
+             motor_params.max_current * InitialPositionDetectionCurrentFraction,
+             pwm_params)
+    {
+        // Rejected by ControllerParameters::isValid(), the injection estimator relies on the moving average filter
+        assert(!hfi_active_ || (controller_params.idq_filter_mode == IdqFilterMode::MovingAverage));
+    }
 
     /**
      * This is the only method that can be preempted by a higher priority IRQ!
@@ -138,6 +268,8 @@ public:
          */
         const auto Idq = estimated_Idq_;
         const auto Udq = reference_Udq_;
+        const auto frame_angle = angular_position_;
+        const auto pwm_period_count_at_sampling = pwm_period_count_;
 
         if (state_ != State::Spinup &&
             state_ != State::Running)
@@ -145,25 +277,92 @@ public:
             return;     // Nothing to do really
         }
 
+        if (initial_position_detection_pending_)
+        {
+            handleInitialPositionDetection();
+            return;     // The data collected during the detection is meaningless for the estimators
+        }
+
         /*
-         * Running the observer, this takes forever.
-         * By the time the observer has finished, the rotor has moved some angle forward, which we compensate.
+         * Running the estimator, this may take forever.
+         * By the time the estimator has finished, the rotor has moved some angle forward, which we compensate.
+         * The alternative estimator, if enabled, runs on the same data; its output is only used for statistics.
          */
-        observer_.update(period, Idq, Udq);     // A very long call
+        std::uint32_t started_at = DWT->CYCCNT;
+        estimator_.update(period, Idq, Udq, frame_angle);
+        const std::uint32_t primary_cycles = DWT->CYCCNT - started_at;
+
+        std::uint32_t shadow_cycles = 0;
+        if (shadow_estimator_ != nullptr)
+        {
+            started_at = DWT->CYCCNT;
+            shadow_estimator_->update(period, Idq, Udq, frame_angle);
+            shadow_cycles = DWT->CYCCNT - started_at;
+        }
 
         /*
-         * Once the observer has finished, a state mutation intensive part begins, so we acquire the expensive lock.
+         * Once the estimator has finished, a state mutation intensive part begins, so we acquire the expensive lock.
          */
         AbsoluteCriticalSectionLocker locker;
 
-        angular_velocity_ = observer_.getAngularVelocity();
+        if ((shadow_estimator_ != nullptr) && (state_ == State::Running))
+        {
+            updateEstimatorComparison(period, primary_cycles, shadow_cycles);
+        }
+
+        Const new_angular_velocity = estimator_.getAngularVelocity();
 
-        // Correcting the angle estimation latency, assuming that the observer runs for about half period.
-        angular_position_ = math::normalizeAngle(observer_.getAngularPosition() + angular_velocity_ * (period * 0.5F));
+        // The acceleration estimate is unreliable during spinup, where the observer is not yet converged
+        if (state_ == State::Running)
+        {
+            Const raw_acceleration = (new_angular_velocity - angular_velocity_) / period;
+            angular_acceleration_ += (period / (period + AngularAccelerationFilterTimeConstant)) *
+                                     (raw_acceleration - angular_acceleration_);
+        }
+        else
+        {
+            angular_acceleration_ = 0;
+        }
+
+        if (hfi_active_)
+        {
+            // The angle is maintained by the HF injection estimator in the fast IRQ
+            angular_velocity_ = hfi_.getAngularVelocity();
+        }
+        else
+        {
+            angular_velocity_ = new_angular_velocity;
+
+            /*
+             * The observer's estimate refers to the sampling instant of the Idq/Udq copied above.
+             * The fast IRQ kept extrapolating the angle while the observer was running, so here we extrapolate the
+             * fresh estimate over the number of PWM periods that have actually elapsed since the sampling instant.
+             */
+            Const latency = Scalar(pwm_period_count_ - pwm_period_count_at_sampling) * pwm_period_;
+
+            angular_position_ = math::normalizeAngle(estimator_.getAngularPosition() +
+                                                     angular_velocity_ * latency +
+                                                     0.5F * angular_acceleration_ * latency * latency);
+            extrapolated_angular_velocity_ = angular_velocity_ + angular_acceleration_ * latency;
+        }
+
+        if ((state_ == State::Running) &&
+            (controller_params_.parameter_adaptation_mode != ParameterAdaptationMode::Disabled))
+        {
+            updateParameterAdaptation(period, Idq, Udq);
+        }
+
+        // Updated during spinup as well, so that the indicators are settled once the detection is enabled
+        desync_detector_.update(period,
+                                Idq,
+                                Udq,
+                                angular_velocity_,
+                                estimator_.getNormalizedInnovationSquared(),
+                                (state_ == State::Running) && (remaining_time_before_stall_detection_enabled_ <= 0));
 
         if (state_ != State::Spinup)
         {
-            observer_.setDirectionConstraint(observer::DirectionConstraint::None);
+            setDirectionConstraint(observer::DirectionConstraint::None);
 
             // Rotor stall detection
             if (remaining_time_before_stall_detection_enabled_ > 0)
@@ -173,8 +372,13 @@ public:
             }
             else
             {
+                // The estimate may be lost at any speed, in which case the motor must be restarted
+                if (desync_detector_.isDetected())
+                {
+                    state_ = State::Stalled;
+                }
                 // Stopping if the angular velocity is too low
-                if (std::abs(angular_velocity_) < motor_params_.min_electrical_ang_vel)
+                else if (std::abs(angular_velocity_) < motor_params_.min_electrical_ang_vel)
                 {
                     const bool reverse = isReversed();
                     const bool forward = !reverse;
@@ -193,29 +397,34 @@ public:
         }
         else
         {
-            observer_.setDirectionConstraint(isReversed() ?
-                                             observer::DirectionConstraint::Reverse :
-                                             observer::DirectionConstraint::Forward);
+            setDirectionConstraint(isReversed() ?
+                                   observer::DirectionConstraint::Reverse :
+                                   observer::DirectionConstraint::Forward);
+
+            if (hfi_active_)
+            {
+                updateHFInjectionSpinup(period);
+                return;
+            }
 
             spinup_time_ += period;
 
+            // The stall timeout is derived from the nominal duration regardless of the learned ramp
             Const spinup_fraction = spinup_time_ / controller_params_.nominal_spinup_duration;
 
             // TODO: Try voltage setpoint?
             spinup_setpoint_.mode = Setpoint::Mode::Iq;
             spinup_setpoint_.value = (isReversed() ? -1.0F : 1.0F) * motor_params_.spinup_current *
-                                     math::Range<>(0.0F, 1.0F).constrain(spinup_fraction);
+                                     math::Range<>(0.0F, 1.0F).constrain(spinup_time_ / spinup_ramp_duration_);
 
             regular_setpoint_ = spinup_setpoint_;
 
             if (std::abs(spinup_setpoint_.value) > motor_params_.min_current)
             {
-                Const ang_vel_threshold = motor_params_.min_electrical_ang_vel * SpinupAngularVelocityHysteresis;
-                if (std::abs(angular_velocity_) > ang_vel_threshold)
+                if (std::abs(angular_velocity_) > handover_angular_velocity_)
                 {
                     // Running fast enough, switching to normal mode
-                    state_ = State::Running;
-                    remaining_time_before_stall_detection_enabled_ = spinup_time_ * 2.0F;
+                    completeSpinup();
                 }
             }
 
@@ -226,6 +435,123 @@ public:
         }
     }
 
+    /**
+     * Switches to the running mode and records how the spinup went, see @ref getSpinupTelemetry().
+     * Must be invoked from the main IRQ with the critical section locked.
+     */
+    void completeSpinup()
+    {
+        AbsoluteCriticalSectionLocker::assertLocked();
+
+        state_ = State::Running;
+        remaining_time_before_stall_detection_enabled_ = spinup_time_ * 2.0F;
+
+        spinup_telemetry_.duration = spinup_time_;
+        spinup_telemetry_.handover_current = std::abs(spinup_setpoint_.value);
+        spinup_telemetry_.relative_backemf_error = desync_detector_.getRelativeBackEMFError();
+    }
+
+    /**
+     * Tracks the drift of Rs and phi; if enabled, the new estimates are applied to the model used for control.
+     * Must be invoked from the main IRQ with the critical section locked.
+     */
+    void updateParameterAdaptation(Const period,
+                                   const Vector<2>& Idq,
+                                   const Vector<2>& Udq)
+    {
+        AbsoluteCriticalSectionLocker::assertLocked();
+
+        const bool updated = parameter_estimator_.update(period, Idq, Udq, angular_velocity_, angular_acceleration_);
+
+        if (updated &&
+            (controller_params_.parameter_adaptation_mode == ParameterAdaptationMode::Enabled))
+        {
+            const auto est = parameter_estimator_.getEstimate();
+
+            observer_.setModelParameters(est.field_flux, est.phase_resistance);
+            flux_observer_.setModelParameters(est.field_flux, est.phase_resistance);
+            desync_detector_.setModelParameters(est.field_flux, est.phase_resistance);
+            modulator_.setPhaseResistance(est.phase_resistance);
+        }
+    }
+
+    /**
+     * Waits for the initial position detector, which is run from the fast IRQ, and seeds the estimators
+     * with its result. If the detection has failed, the spinup proceeds as if it was never attempted.
+     */
+    void handleInitialPositionDetection()
+    {
+        if (ipd_.getStatus() == InitialPositionDetector::Status::InProgress)
+        {
+            return;
+        }
+
+        AbsoluteCriticalSectionLocker locker;
+
+        initial_position_detection_pending_ = false;
+
+        if (ipd_.getStatus() == InitialPositionDetector::Status::Succeeded)
+        {
+            Const angle = ipd_.getAngularPosition();
+
+            observer_.seedAngularPosition(angle);
+            flux_observer_.seedAngularPosition(angle);
+
+            angular_position_ = angle;
+            extrapolated_angular_velocity_ = 0;
+        }
+    }
+
+    /**
+     * Spinup with the angle provided by the HF injection estimator: the full spinup current is applied as soon as
+     * the estimator has locked, and the control is handed over to the back-EMF estimator once both agree.
+     * Must be invoked from the main IRQ with the critical section locked.
+     */
+    void updateHFInjectionSpinup(Const period)
+    {
+        AbsoluteCriticalSectionLocker::assertLocked();
+
+        spinup_time_ += period;
+
+        Const direction = isReversed() ? -1.0F : 1.0F;
+        const bool settled = (spinup_time_ > HFInjectionSettlingTime) && hfi_.isReady();
+
+        spinup_setpoint_.mode = Setpoint::Mode::Iq;
+        spinup_setpoint_.value = settled ? (direction * motor_params_.spinup_current) : 0.0F;
+        regular_setpoint_ = spinup_setpoint_;
+
+        if (settled)
+        {
+            Const hfi_angular_velocity = hfi_.getAngularVelocity() * direction;
+
+            if (hfi_angular_velocity < -motor_params_.min_electrical_ang_vel)
+            {
+                // Rotating backwards means that the estimator has locked onto the wrong magnet pole
+                hfi_.flipPolarity();
+                angular_position_ = hfi_.getAngularPosition();
+                extrapolated_angular_velocity_ = 0;
+            }
+            else if (hfi_angular_velocity > handover_angular_velocity_)
+            {
+                Const angle_error = math::normalizeAngleDifference(estimator_.getAngularPosition() -
+                                                                   angular_position_);
+                Const velocity_error = estimator_.getAngularVelocity() * direction - hfi_angular_velocity;
+
+                if ((std::abs(angle_error) < HFInjectionHandoverAngleTolerance) &&
+                    (std::abs(velocity_error) < hfi_angular_velocity * HFInjectionHandoverVelocityTolerance))
+                {
+                    hfi_active_ = false;
+                    completeSpinup();
+                }
+            }
+        }
+
+        if (spinup_time_ / controller_params_.nominal_spinup_duration > MaximumSpinupDurationFraction)
+        {
+            state_ = State::Stalled;
+        }
+    }
+
     /**
      * This method may be invoked concurrently with the state estimation update method from an IRQ (possibly nested).
      * Critical section is not used here.
@@ -233,28 +559,78 @@ public:
     Vector<3> updatePWMOutputsFromIRQ(const Vector<2>& phase_currents_ab,
                                       Const inverter_voltage) const
     {
-        if (state_ == State::Spinup ||
-            state_ == State::Running)
+        if ((state_ == State::Spinup) &&
+            (ipd_.getStatus() == InitialPositionDetector::Status::InProgress) &&
+            controller_params_.initial_position_detection_enabled)
         {
-            const auto sp = (state_ == State::Spinup) ? spinup_setpoint_ : regular_setpoint_;
+            predicted_phase_currents_ab_.second = false;
+            return ipd_.onNextPWMPeriod(phase_currents_ab, inverter_voltage);
+        }
+        else if (state_ == State::Spinup ||
+                 state_ == State::Running)
+        {
+            auto sp = (state_ == State::Spinup) ? spinup_setpoint_ : regular_setpoint_;
+
+            if (hfi_active_)
+            {
+                sp.injected_Ud = hfi_.getInjectionVoltage();
+            }
 
             const auto output = modulator_.onNextPWMPeriod(phase_currents_ab,
                                                            inverter_voltage,
-                                                           angular_velocity_,
+                                                           extrapolated_angular_velocity_,
+                                                           angular_acceleration_,
                                                            angular_position_,
                                                            sp);
             estimated_Idq_ = output.estimated_Idq;
             reference_Udq_ = output.reference_Udq;
-            angular_position_ = output.extrapolated_angular_position;
+            predicted_phase_currents_ab_ = { output.predicted_phase_currents_ab, true };
+            if (hfi_active_)
+            {
+                hfi_.update(output.raw_Idq, output.extrapolated_angular_position);
+                angular_position_ = hfi_.getAngularPosition();
+                extrapolated_angular_velocity_ = hfi_.getAngularVelocity();
+            }
+            else
+            {
+                angular_position_ = output.extrapolated_angular_position;
+                extrapolated_angular_velocity_ = output.extrapolated_angular_velocity;
+            }
+            pwm_period_count_++;
 
             return output.pwm_setpoint;
         }
         else
         {
+            predicted_phase_currents_ab_.second = false;
             return Vector<3>::Zero();
         }
     }
 
+    /**
+     * Phase currents expected at the next sampling instant, as computed by the last invocation of
+     * @ref updatePWMOutputsFromIRQ(); the second element is false if no prediction is available.
+     * Must be invoked from the same context as @ref updatePWMOutputsFromIRQ().
+     */
+    std::pair<Vector<2>, bool> getPredictedPhaseCurrentsFromIRQ() const
+    {
+        return predicted_phase_currents_ab_;
+    }
+
+    /**
+     * Applies the hot-swappable parameters while the motor is running.
+     * Must be invoked from the same context as @ref updateStateEstimation(), never concurrently with it.
+     */
+    void updateTunableParameters(const ControllerParameters& controller_params,
+                                 const observer::Parameters& observer_params)
+    {
+        observer_.setTuning(observer_params);
+        flux_observer_.setTuning(observer_params);
+
+        AbsoluteCriticalSectionLocker locker;
+        modulator_.setCurrentLoopBandwidth(controller_params.current_loop_bandwidth);
+    }
+
     /**
      * Updating setpoint during spinup is meaningless, because the inner logic will overwrite it anyway.
      * Calling this method only makes sense if the state is Running.
@@ -298,6 +674,73 @@ public:
 
     Direction getDirection() const { return direction_; }
 
+    /**
+     * If the runner has stalled because the estimated angle has lost synchronization with the rotor, returns the
+     * indicator that has detected that; otherwise returns None.
+     */
+    observer::DesyncDetector::Indicator getDesyncIndicator() const
+    {
+        return desync_detector_.isDetected() ? desync_detector_.getIndicator() :
+                                               observer::DesyncDetector::Indicator::None;
+    }
+
+    /**
+     * Valid only once the spinup is completed, i.e. the runner has left the spinup state at least once.
+     */
+    SpinupTelemetry getSpinupTelemetry() const
+    {
+        AbsoluteCriticalSectionLocker locker;
+        return spinup_telemetry_;
+    }
+
+    /**
+     * Returns false if the shadow mode is disabled.
+     */
+    bool getEstimatorComparisonStatistics(observer::EstimatorComparisonStatistics& out_stat) const
+    {
+        if (shadow_estimator_ == nullptr)
+        {
+            return false;
+        }
+        AbsoluteCriticalSectionLocker locker;
+        out_stat = estimator_comparison_;
+        out_stat.primary_name = estimator_.getName();
+        out_stat.shadow_name = shadow_estimator_->getName();
+        return true;
+    }
+
+    /**
+     * Returns false if the parameter adaptation is disabled.
+     */
+    bool getOnlineParameterEstimate(observer::OnlineParameterEstimate& out_estimate) const
+    {
+        if (controller_params_.parameter_adaptation_mode == ParameterAdaptationMode::Disabled)
+        {
+            return false;
+        }
+        AbsoluteCriticalSectionLocker locker;
+        out_estimate = parameter_estimator_.getEstimate();
+        return true;
+    }
+
+    /**
+     * Effective current loop bandwidth in Hertz; it may be lower than configured due to the loop delay.
+     */
+    Scalar getCurrentLoopBandwidth() const
+    {
+        AbsoluteCriticalSectionLocker locker;
+        return modulator_.getCurrentLoopBandwidth() / pwm_period_;
+    }
+
+    /**
+     * Total delay of the current loop including the Idq filter, in seconds.
+     */
+    Scalar getCurrentLoopDelay() const
+    {
+        AbsoluteCriticalSectionLocker locker;
+        return modulator_.getCurrentLoopDelay() * pwm_period_;
+    }
+
     DebugVariables getDebugVariables() const
     {
         AbsoluteCriticalSectionLocker locker;
@@ -307,7 +750,7 @@ public:
             estimated_Idq_[0],
             estimated_Idq_[1],
             regular_setpoint_.value,
-            observer_.getAngularVelocity()
+            estimator_.getAngularVelocity()
         };
     }
 };
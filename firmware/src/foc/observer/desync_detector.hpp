@@ -0,0 +1,240 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <math/math.hpp>
+#include <algorithm>
+#include <cmath>
+
+
+namespace foc
+{
+namespace observer
+{
+
+using math::Scalar;
+using math::Const;
+using math::Vector;
+
+/**
+ * Detects loss of synchronization between the estimated and the real rotor angle while running, which the speed
+ * threshold alone cannot detect at high speed: a desynchronized estimator may keep reporting a high angular velocity
+ * while the rotor is stopped or lagging behind.
+ *
+ * Two indicators are monitored, both low-pass filtered with the time constant of one electrical revolution:
+ *  - Back-EMF consistency: the residual of the steady state voltage equation in the estimated frame
+ *        Ud + w*L*Iq - Rs*Id = 0
+ *        Uq - w*L*Id - Rs*Iq = w*phi
+ *    relative to the expected back-EMF magnitude w*phi. If the real angle leads or lags the estimated one by delta,
+ *    the relative residual is 2*sin(delta/2), and it approaches 1 if the rotor is stopped. This indicator works
+ *    with any estimator; it is disabled at low speed where the back-EMF is comparable to the resistive drop.
+ *    It is also useful as a measure of the estimation quality at the end of the spinup, see @ref SpinupProfileLearner.
+ *  - Normalized innovation squared of the estimator, if provided (see @ref IEstimator), relative to its long term
+ *    baseline. The absolute value is not used because the process noise of the EKF is deliberately overstated,
+ *    which makes the innovation much smaller than its predicted covariance even when the filter is consistent.
+ *
+ * The covariance of the EKF is not monitored: it doesn't depend on the measurements, and the angle variance grows
+ * without bound since the angle is not observable from the currents in the rotating frame.
+ *
+ * The indicators are updated continuously, so that they are settled by the time the detection is enabled.
+ * The desynchronization is reported once any indicator has stayed above its threshold for
+ * @ref DetectionElectricalRevolutions revolutions, which is bounded by @ref MinDetectionTime from below.
+ * Short transients, after which the estimator recovers by itself, are ignored.
+ */
+class DesyncDetector
+{
+public:
+    static constexpr Scalar MaxRelativeBackEMFError         = 0.8F;     ///< Corresponds to ~47 degrees
+    static constexpr Scalar MaxRelativeInnovation           = 30.0F;    ///< Normalized innovation over baseline
+
+    static constexpr Scalar DetectionElectricalRevolutions  = 3.0F;
+    static constexpr Scalar MinDetectionTime                = 0.005F;   ///< Second
+
+    static constexpr Scalar InnovationBaselineTimeConstant  = 1.0F;     ///< Second
+
+    /// The back-EMF indicator is ignored below this multiple of the min angular velocity
+    static constexpr Scalar MinBackEMFAngularVelocityRatio  = 2.0F;
+
+    enum class Indicator
+    {
+        None,
+        BackEMF,
+        Innovation
+    };
+
+private:
+    Scalar phi_;
+    Scalar rs_;
+    Const l_;
+    Const min_angular_velocity_;
+
+    Scalar backemf_error_ = -1.0F;           ///< Negative at low speed
+    Scalar innovation_ = 0;
+    Scalar innovation_baseline_ = -1.0F;     ///< Negative until initialized
+    Scalar time_above_threshold_ = 0;
+
+    Indicator indicator_ = Indicator::None;
+    bool detected_ = false;
+
+    static void filter(Scalar& state, Const value, Const weight)
+    {
+        state += weight * (value - state);
+    }
+
+    Scalar getRelativeInnovation() const
+    {
+        return (innovation_baseline_ > 0) ? (innovation_ / innovation_baseline_) : 0.0F;
+    }
+
+public:
+    DesyncDetector(Const field_flux,
+                   Const stator_phase_resistance,
+                   Const stator_phase_inductance,
+                   Const min_electrical_angular_velocity) :
+        phi_(field_flux),
+        rs_(stator_phase_resistance),
+        l_(stator_phase_inductance),
+        min_angular_velocity_(min_electrical_angular_velocity)
+    { }
+
+    /**
+     * Updates the parameters of the voltage equation that are known to drift, see @ref OnlineParameterEstimator.
+     */
+    void setModelParameters(Const field_flux,
+                            Const stator_phase_resistance)
+    {
+        phi_ = field_flux;
+        rs_ = stator_phase_resistance;
+    }
+
+    /**
+     * @param dt                        Time since the previous update, second.
+     * @param idq                       Measured current in the estimated frame.
+     * @param udq                       Applied voltage in the estimated frame.
+     * @param angular_velocity          Estimated electrical angular velocity, radian/second.
+     * @param normalized_innovation_sq  See @ref IEstimator::getNormalizedInnovationSquared(); negative if n/a.
+     * @param detection_enabled         If false, only the indicators are updated; e.g. during spinup.
+     * @return                          True if the desynchronization has been detected; the result is latched.
+     */
+    bool update(Const dt,
+                const Vector<2>& idq,
+                const Vector<2>& udq,
+                Const angular_velocity,
+                Const normalized_innovation_sq,
+                const bool detection_enabled)
+    {
+        if (detected_)
+        {
+            return true;
+        }
+
+        Const abs_angular_velocity = std::abs(angular_velocity);
+        Const revolution_period = math::Pi * 2.0F / std::max(abs_angular_velocity, min_angular_velocity_);
+        Const weight = dt / (dt + revolution_period);
+
+        indicator_ = Indicator::None;
+
+        if (abs_angular_velocity > min_angular_velocity_ * MinBackEMFAngularVelocityRatio)
+        {
+            Const ud_residual = udq[0] + angular_velocity * l_ * idq[1] - rs_ * idq[0];
+            Const uq_residual = udq[1] - angular_velocity * l_ * idq[0] - rs_ * idq[1] - angular_velocity * phi_;
+
+            Const error = std::sqrt(ud_residual * ud_residual + uq_residual * uq_residual) /
+                          (abs_angular_velocity * phi_);
+            if (backemf_error_ < 0)
+            {
+                backemf_error_ = error;
+            }
+
+            filter(backemf_error_, error, weight);
+
+            if (backemf_error_ > MaxRelativeBackEMFError)
+            {
+                indicator_ = Indicator::BackEMF;
+            }
+        }
+        else
+        {
+            backemf_error_ = -1.0F;
+        }
+
+        if (normalized_innovation_sq >= 0)
+        {
+            if (innovation_baseline_ < 0)
+            {
+                innovation_ = normalized_innovation_sq;
+                innovation_baseline_ = normalized_innovation_sq;
+            }
+
+            filter(innovation_, normalized_innovation_sq, weight);
+            filter(innovation_baseline_, innovation_, dt / (dt + InnovationBaselineTimeConstant));
+
+            if (getRelativeInnovation() > MaxRelativeInnovation)
+            {
+                indicator_ = Indicator::Innovation;
+            }
+        }
+
+        if ((indicator_ == Indicator::None) || !detection_enabled)
+        {
+            time_above_threshold_ = 0;
+        }
+        else
+        {
+            time_above_threshold_ += dt;
+            detected_ = time_above_threshold_ > std::max(revolution_period * DetectionElectricalRevolutions,
+                                                         Scalar(MinDetectionTime));
+        }
+
+        return detected_;
+    }
+
+    bool isDetected() const { return detected_; }
+
+    /**
+     * The indicator that has triggered the detection, or the one that is currently above its threshold.
+     */
+    Indicator getIndicator() const { return indicator_; }
+
+    static const char* getIndicatorName(const Indicator indicator)
+    {
+        switch (indicator)
+        {
+        case Indicator::None:       return "none";
+        case Indicator::BackEMF:    return "back-EMF";
+        case Indicator::Innovation: return "innovation";
+        }
+        return "?";
+    }
+
+    /**
+     * Filtered residual of the voltage equation relative to the expected back-EMF; negative at low speed.
+     */
+    Scalar getRelativeBackEMFError() const { return backemf_error_; }
+};
+
+}
+}
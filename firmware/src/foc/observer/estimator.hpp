@@ -0,0 +1,122 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <math/math.hpp>
+#include <cstdint>
+
+
+namespace foc
+{
+namespace observer
+{
+
+using math::Scalar;
+using math::Const;
+using math::Vector;
+
+/**
+ * Restriction on the direction of rotation applied to the model.
+ */
+enum class DirectionConstraint
+{
+    None,   //!< None
+    Forward,//!< Forward
+    Reverse //!< Reverse
+};
+
+/**
+ * Common interface of the sensorless rotor state estimators.
+ * All units are SI units (Weber, Henry, Ohm, Volt, Second, Radian).
+ */
+class IEstimator
+{
+public:
+    virtual ~IEstimator() { }
+
+    virtual const char* getName() const = 0;
+
+    /**
+     * @param dt                Time since the previous update, in seconds.
+     * @param idq               Measured current in the rotating frame of the modulator.
+     * @param udq               Applied voltage in the rotating frame of the modulator.
+     * @param frame_angle       Electrical angle of the rotating frame of the modulator at the sampling instant.
+     *                          Estimators that work in the stationary frame need it to transform Idq and Udq.
+     */
+    virtual void update(Const dt,
+                        const Vector<2>& idq,
+                        const Vector<2>& udq,
+                        Const frame_angle) = 0;
+
+    virtual void setDirectionConstraint(DirectionConstraint dc) = 0;
+
+    /**
+     * Forces the angle estimate to the specified value, e.g. detected at standstill before the spinup.
+     * The rotor is assumed to be stationary; the angular velocity estimate is reset.
+     */
+    virtual void seedAngularPosition(Const angle) = 0;
+
+    /**
+     * Updates the parameters of the motor model that are known to drift, e.g. with the temperature.
+     */
+    virtual void setModelParameters(Const field_flux,
+                                    Const stator_phase_resistance) = 0;
+
+    virtual Scalar getAngularVelocity() const = 0;
+
+    virtual Scalar getAngularPosition() const = 0;
+
+    /**
+     * Squared Mahalanobis norm of the last measurement innovation, i.e. e' * inv(S) * e, where e = y - C*x is the
+     * difference between the measured and the predicted current and S is its predicted covariance.
+     * For a consistent filter it follows the chi-squared distribution with 2 degrees of freedom (mean 2).
+     * Negative if the estimator does not provide it.
+     */
+    virtual Scalar getNormalizedInnovationSquared() const = 0;
+};
+
+/**
+ * Divergence of an alternative estimator running in the shadow mode from the primary one.
+ * Errors are defined as (shadow - primary); the statistics are low-pass filtered.
+ */
+struct EstimatorComparisonStatistics
+{
+    const char* primary_name = "";
+    const char* shadow_name = "";
+
+    std::uint32_t num_samples = 0;
+
+    Scalar angle_error_mean = 0;                ///< Radian, electrical
+    Scalar angle_error_rms = 0;                 ///< Ditto
+    Scalar angle_error_max = 0;                 ///< Absolute, since the motor was started
+    Scalar angular_velocity_error_rms = 0;      ///< Radian per second, electrical
+
+    Scalar primary_cycles = 0;                  ///< CPU cycles per update, including possible preemption
+    Scalar shadow_cycles = 0;                   ///< Ditto
+};
+
+}
+}
@@ -0,0 +1,141 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "flux_observer.hpp"
+
+
+namespace foc
+{
+namespace observer
+{
+namespace
+{
+/// PLL damping ratio
+constexpr Scalar PLLDampingRatio = 0.707F;
+
+/// Below this rotation angle per update, the integration factor is computed using the first order approximation
+constexpr Scalar MinRotationAngleForExactIntegration = 1e-3F;
+}
+
+FluxObserver::FluxObserver(const Parameters& parameters,
+                           Const field_flux,
+                           Const stator_phase_inductance_quadrature,
+                           Const stator_phase_resistance) :
+    phi_(field_flux),
+    l_(stator_phase_inductance_quadrature),
+    r_(stator_phase_resistance),
+    gain_(0),
+    pll_kp_(0),
+    pll_ki_(0),
+    flux_alpha_beta_(field_flux, 0)     // Zero flux is a singular point, so we start at an arbitrary angle
+{
+    assert(std::isfinite(phi_) && (phi_ > 0));
+    assert(std::isfinite(l_));
+    assert(std::isfinite(r_));
+    setTuning(parameters);
+}
+
+
+void FluxObserver::setTuning(const Parameters& parameters)
+{
+    assert(parameters.isValid());
+    gain_ = parameters.flux_observer_gain;
+    pll_kp_ = 2.0F * PLLDampingRatio * parameters.flux_observer_pll_bandwidth;
+    pll_ki_ = parameters.flux_observer_pll_bandwidth * parameters.flux_observer_pll_bandwidth;
+}
+
+
+void FluxObserver::seedAngularPosition(Const angle)
+{
+    // The current is assumed to be zero, so the stator flux is aligned with the rotor flux
+    flux_alpha_beta_ = phi_ * math::sincos(angle).reverse();
+    angular_position_ = math::normalizeAngle(angle);
+    angular_velocity_ = 0;
+}
+
+
+void FluxObserver::update(Const dt,
+                          const Vector<2>& idq,
+                          const Vector<2>& udq,
+                          Const frame_angle)
+{
+    /*
+     * Transforming into the stationary frame
+     */
+    const auto sc = math::sincos(frame_angle);
+    const Vector<2> i_ab(idq[0] * sc[1] - idq[1] * sc[0],
+                         idq[0] * sc[0] + idq[1] * sc[1]);
+    const Vector<2> u_ab(udq[0] * sc[1] - udq[1] * sc[0],
+                         udq[0] * sc[0] + udq[1] * sc[1]);
+
+    /*
+     * Stator flux integration, dPsi/dt = U - R*I.
+     * The EMF rotates together with the rotor, so the integral over the interval is (exp(j*w*dt) - 1) / (j*w)
+     * times the EMF at the beginning of the interval.
+     */
+    const Vector<2> emf = u_ab - r_ * i_ab;
+
+    Const rotation = angular_velocity_ * dt;
+    Vector<2> integration_factor(dt, rotation * dt * 0.5F);
+    if (std::abs(rotation) > MinRotationAngleForExactIntegration)
+    {
+        integration_factor[0] = std::sin(rotation) / angular_velocity_;
+        integration_factor[1] = (1.0F - std::cos(rotation)) / angular_velocity_;
+    }
+
+    flux_alpha_beta_[0] += integration_factor[0] * emf[0] - integration_factor[1] * emf[1];
+    flux_alpha_beta_[1] += integration_factor[0] * emf[1] + integration_factor[1] * emf[0];
+
+    /*
+     * Correcting the rotor flux magnitude towards the known value
+     */
+    Vector<2> rotor_flux = flux_alpha_beta_ - l_ * i_ab;
+    Const magnitude_error = 1.0F - rotor_flux.squaredNorm() / (phi_ * phi_);
+
+    flux_alpha_beta_ += std::min(gain_ * dt, 0.5F) * magnitude_error * rotor_flux;
+    rotor_flux = flux_alpha_beta_ - l_ * i_ab;
+
+    /*
+     * PLL
+     */
+    Const measured_angle = std::atan2(rotor_flux[1], rotor_flux[0]);
+    Const predicted_angle = angular_position_ + angular_velocity_ * dt;
+    Const angle_error = math::normalizeAngleDifference(measured_angle - predicted_angle);
+
+    angular_velocity_ += pll_ki_ * angle_error * dt;
+    angular_position_ = math::normalizeAngle(predicted_angle + pll_kp_ * angle_error * dt);
+
+    /*
+     * Constraint check
+     */
+    if (((direction_constraint_ == DirectionConstraint::Forward) && (angular_velocity_ < 0)) ||
+        ((direction_constraint_ == DirectionConstraint::Reverse) && (angular_velocity_ > 0)))
+    {
+        angular_velocity_ = 0.0F;
+    }
+}
+
+}
+}
@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "estimator.hpp"
+#include "observer.hpp"
+
+
+namespace foc
+{
+namespace observer
+{
+/**
+ * Nonlinear flux observer with a PLL; much cheaper than the EKF.
+ *
+ * The stator flux linkage is integrated in the stationary frame, and its rotor component is driven towards
+ * the known magnitude (Ortega et al., "Estimation of rotor position and speed of permanent magnet synchronous
+ * motors with guaranteed stability", 2011). The angle of the rotor flux vector is then tracked by a type-2 PLL,
+ * which also provides the angular velocity.
+ *
+ * The integration assumes that the voltage is constant in the rotating frame within the update interval, which
+ * keeps it accurate at high speed where the rotor turns by a large angle between the updates.
+ *
+ * Saliency is not modeled; Lq is used as the phase inductance.
+ */
+class FluxObserver final : public IEstimator
+{
+    Scalar phi_;
+    Const l_;
+    Scalar r_;
+
+    Scalar gain_;
+    Scalar pll_kp_;
+    Scalar pll_ki_;
+
+    DirectionConstraint direction_constraint_ = DirectionConstraint::None;
+
+    // Filter states
+    Vector<2> flux_alpha_beta_;
+    Scalar angular_position_ = 0;
+    Scalar angular_velocity_ = 0;
+
+public:
+    FluxObserver(const Parameters& parameters,
+                 Const field_flux,
+                 Const stator_phase_inductance_quadrature,
+                 Const stator_phase_resistance);
+
+    const char* getName() const override { return "FluxPLL"; }
+
+    void update(Const dt,
+                const Vector<2>& idq,
+                const Vector<2>& udq,
+                Const frame_angle) override;
+
+    /**
+     * Updates the gains on the fly; the state is retained.
+     */
+    void setTuning(const Parameters& parameters);
+
+    void setDirectionConstraint(DirectionConstraint dc) override { direction_constraint_ = dc; }
+
+    void seedAngularPosition(Const angle) override;
+
+    void setModelParameters(Const field_flux,
+                            Const stator_phase_resistance) override
+    {
+        phi_ = field_flux;
+        r_ = stator_phase_resistance;
+    }
+
+    Scalar getAngularVelocity() const override { return angular_velocity_; }
+
+    Scalar getAngularPosition() const override { return angular_position_; }
+
+    Scalar getNormalizedInnovationSquared() const override { return -1.0F; }
+};
+
+}
+}
@@ -0,0 +1,193 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <math/math.hpp>
+#include <array>
+#include <cassert>
+
+
+namespace foc
+{
+namespace observer
+{
+
+using math::Scalar;
+using math::Const;
+using math::Vector;
+
+/**
+ * Rotor angle estimator for zero and low speed, based on pulsating high frequency voltage injection.
+ * Unlike the back-EMF estimators, it relies on the saliency of the motor (Ld < Lq), either structural or
+ * caused by the magnetic saturation of the D axis, so it works at standstill.
+ *
+ * The carrier is injected into the estimated D axis. If the estimated frame is displaced by an angle E from the
+ * real one, the carrier current appears in the estimated Q axis with the amplitude proportional to sin(2*E),
+ * which is demodulated synchronously and fed into a PLL. The Q axis carrier amplitude is normalized by the D axis
+ * carrier amplitude, so that the loop gain does not depend on the injection voltage and the inductance.
+ *
+ * The carrier period is an integer number of PWM periods, equal to the length of the Idq moving average filter,
+ * so that the current controllers don't see the carrier (the moving average has zero gain at this frequency), and
+ * the demodulator, which sums over exactly one carrier period, rejects the fundamental currents completely.
+ *
+ * The estimate is ambiguous by Pi, because sin(2*E) has two stable points; see @ref flipPolarity().
+ *
+ * All methods except the constructor must be invoked from the fast IRQ (once per PWM period), except that
+ * the getters can be invoked from the main IRQ as well.
+ */
+template <unsigned CarrierPeriodInPWMPeriods>
+class HFInjectionEstimator
+{
+    static_assert(CarrierPeriodInPWMPeriods >= 3, "Carrier period is too short");
+
+    static constexpr unsigned N = CarrierPeriodInPWMPeriods;
+
+    /// The demodulated error is proportional to the saliency ratio (Lq-Ld)/(Lq+Ld); the PLL is tuned for this value
+    static constexpr Scalar AssumedSaliencyRatio = 0.1F;
+
+    /// Radian per second; the demodulator delays the error by a half of the carrier period, hence low bandwidth
+    static constexpr Scalar PLLBandwidth = 150.0F;
+    static constexpr Scalar PLLDampingRatio = 0.707F;
+
+    Const pwm_period_;
+    Const injection_voltage_;
+
+    std::array<Scalar, N> injection_carrier_;       ///< cos(phase)
+    std::array<Scalar, N> demodulation_carrier_;    ///< sin(phase - transport delay), see the integral of cos()
+
+    std::array<Vector<2>, N> products_;
+
+    unsigned carrier_index_ = 0;
+    unsigned num_samples_ = 0;
+
+    Scalar angular_position_ = 0;
+    Scalar angular_velocity_ = 0;
+    Scalar saliency_ = 0;
+
+public:
+    /**
+     * @param pwm_period            Seconds.
+     * @param injection_voltage     Amplitude of the carrier, Volt.
+     * @param transport_delay       Delay from the computation of the voltage to the sampling of the
+     *                              resulting current, in PWM periods.
+     */
+    HFInjectionEstimator(Const pwm_period,
+                         Const injection_voltage,
+                         Const transport_delay) :
+        pwm_period_(pwm_period),
+        injection_voltage_(injection_voltage)
+    {
+        assert(pwm_period_ > 0);
+        assert(injection_voltage_ > 0);
+
+        Const phase_step = math::Pi2 / Scalar(N);
+        for (unsigned i = 0; i < N; i++)
+        {
+            injection_carrier_[i] = std::cos(phase_step * Scalar(i));
+            demodulation_carrier_[i] = std::sin(phase_step * (Scalar(i) - transport_delay));
+        }
+
+        products_.fill(Vector<2>::Zero());
+    }
+
+    /**
+     * Returns the voltage to be added to the D axis in the current PWM period.
+     */
+    Scalar getInjectionVoltage() const
+    {
+        return injection_voltage_ * injection_carrier_[carrier_index_];
+    }
+
+    /**
+     * Processes the current sampled in the current PWM period and advances the carrier.
+     * @param raw_Idq           Unfiltered current in the frame that was used by the modulator.
+     * @param frame_angle       Angle of that frame; this is the previous output of this estimator extrapolated.
+     */
+    void update(const Vector<2>& raw_Idq,
+                Const frame_angle)
+    {
+        products_[carrier_index_] = raw_Idq * demodulation_carrier_[carrier_index_];
+        carrier_index_ = (carrier_index_ + 1) % N;
+
+        angular_position_ = frame_angle;
+
+        if (num_samples_ < N)
+        {
+            num_samples_++;     // Waiting for the demodulator to fill up
+            return;
+        }
+
+        Vector<2> demodulated = Vector<2>::Zero();
+        for (auto& x : products_)
+        {
+            demodulated += x;
+        }
+
+        if (demodulated[0] <= 0)
+        {
+            return;             // Carrier is not observable, the motor may be disconnected
+        }
+
+        /*
+         * With Ld < Lq, Iq_hf / Id_hf = -sin(2*E) * (Lq - Ld) / (Lq + Ld), where E is the estimation error (the
+         * estimated angle minus the real one). For small errors, the error in radians is Iq_hf / Id_hf / 2 / ratio.
+         */
+        saliency_ = demodulated[1] / demodulated[0];
+        Const angle_error = 0.5F * saliency_ / AssumedSaliencyRatio;       // Real minus estimated
+
+        static constexpr Scalar Kp = 2.0F * PLLDampingRatio * PLLBandwidth;
+        static constexpr Scalar Ki = PLLBandwidth * PLLBandwidth;
+
+        angular_velocity_ += Ki * angle_error * pwm_period_;
+        angular_position_ = math::normalizeAngle(frame_angle + Kp * angle_error * pwm_period_);
+    }
+
+    /**
+     * Turns the estimated angle by Pi.
+     * This is needed if the estimator has converged to the wrong magnet pole, which can be detected by applying
+     * torque and checking the direction of rotation.
+     */
+    void flipPolarity()
+    {
+        angular_position_ = math::normalizeAngle(angular_position_ + math::Pi);
+        angular_velocity_ = 0;
+    }
+
+    bool isReady() const { return num_samples_ >= N; }
+
+    Scalar getAngularPosition() const { return angular_position_; }
+
+    Scalar getAngularVelocity() const { return angular_velocity_; }
+
+    /**
+     * Last demodulated ratio of the Q axis carrier amplitude to the D axis carrier amplitude.
+     * Near zero when the estimator is locked; its magnitude right after start indicates the saliency.
+     */
+    Scalar getDemodulatedRatio() const { return saliency_; }
+};
+
+}
+}
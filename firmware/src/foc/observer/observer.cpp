@@ -34,6 +34,12 @@ using math::makeMatrix;
 using math::makeDiagonalMatrix;
 using math::makeRow;
 
+namespace
+{
+/// Uncertainty of an externally seeded angle, radian^2; roughly 30 electrical degrees standard deviation
+constexpr Scalar SeededAngularPositionVariance = 0.25F;
+}
+
 
 Observer::Observer(const Parameters& parameters,
                    Const field_flux,
@@ -50,6 +56,7 @@ Observer::Observer(const Parameters& parameters,
     cross_coupling_comp_(parameters.cross_coupling_compensation),
     Q_(parameters.Q),
     R_(parameters.R),
+    gain_schedule_(parameters.gain_schedule),
     C_(makeMatrix(makeRow(1, 0, 0, 0),
                   makeRow(0, 1, 0, 0))),
 
@@ -64,6 +71,54 @@ Observer::Observer(const Parameters& parameters,
 }
 
 
+void Observer::setTuning(const Parameters& parameters)
+{
+    assert(parameters.isValid());
+    cross_coupling_comp_ = parameters.cross_coupling_compensation;
+    Q_ = parameters.Q;
+    R_ = parameters.R;
+    gain_schedule_ = parameters.gain_schedule;
+}
+
+
+void Observer::seedAngularPosition(Const angle)
+{
+    x_[StateIndexAngularVelocity] = 0;
+    x_[StateIndexAngularPosition] = math::normalizeAngle(angle);
+
+    // The seeded angle is decorrelated from the rest of the state, retaining some uncertainty
+    P_.row(StateIndexAngularPosition).setZero();
+    P_.col(StateIndexAngularPosition).setZero();
+    P_(StateIndexAngularPosition, StateIndexAngularPosition) = SeededAngularPositionVariance;
+}
+
+
+std::pair<Scalar, Scalar> Observer::interpolateGainSchedule(Const angular_velocity) const
+{
+    const auto& gs = gain_schedule_;
+
+    if (angular_velocity <= gs.front().angular_velocity)
+    {
+        return { gs.front().Q_multiplier, gs.front().R_multiplier };
+    }
+
+    for (unsigned i = 1; i < gs.size(); i++)
+    {
+        if (angular_velocity < gs[i].angular_velocity)
+        {
+            Const frac = (angular_velocity - gs[i - 1].angular_velocity) /
+                         (gs[i].angular_velocity - gs[i - 1].angular_velocity);
+            return {
+                gs[i - 1].Q_multiplier + frac * (gs[i].Q_multiplier - gs[i - 1].Q_multiplier),
+                gs[i - 1].R_multiplier + frac * (gs[i].R_multiplier - gs[i - 1].R_multiplier)
+            };
+        }
+    }
+
+    return { gs.back().Q_multiplier, gs.back().R_multiplier };
+}
+
+
 void Observer::update(Const dt,
                       const Vector<2>& idq,
                       const Vector<2>& udq)
@@ -111,11 +166,21 @@ void Observer::update(Const dt,
     Xout[2] = w;
     Xout[3] = Theta + w * Ts;
 
-    const Matrix<4, 4> Pout = F * Pin * F.transpose() + Q_;
+    /*
+     * Gain scheduling: the noise covariances are scaled depending on the angular velocity.
+     */
+    const auto gs_mult = interpolateGainSchedule(std::abs(w));
+
+    const Matrix<4, 4> Pout = F * Pin * F.transpose() + Q_ * gs_mult.first;
+
+    const Matrix<2, 2> S_inv = (C_ * Pout * C_.transpose() + R_ * gs_mult.second).inverse();
+
+    const Matrix<4, 2> K = Pout * C_.transpose() * S_inv;
 
-    const Matrix<4, 2> K = Pout * C_.transpose() * (C_ * Pout * C_.transpose() + R_).inverse();
+    const Vector<2> innovation = y - C_ * Xout;
+    normalized_innovation_squared_ = innovation.dot(S_inv * innovation);
 
-    x_ = Xout + K * (y - C_ * Xout);
+    x_ = Xout + K * innovation;
     x_[StateIndexAngularPosition] = math::normalizeAngle(x_[StateIndexAngularPosition]);
 
     P_ = (Matrix<4, 4>::Identity() - K * C_) * Pout;
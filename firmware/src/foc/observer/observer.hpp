@@ -24,9 +24,12 @@
 
 #pragma once
 
+#include "estimator.hpp"
 #include <math/math.hpp>
 #include <zubax_chibios/util/heapless.hpp>
 #include <zubax_chibios/util/float_eq.hpp>
+#include <array>
+#include <utility>
 #include <cassert>
 
 
@@ -41,6 +44,21 @@ using math::Vector;
 using math::Matrix;
 using math::DiagonalMatrix;
 
+/**
+ * One point of the observer gain schedule.
+ * The noise covariances Q and R are multiplied by the factors interpolated by the absolute angular velocity.
+ */
+struct GainSchedulePoint
+{
+    Scalar angular_velocity = 0;    ///< Electrical, radian per second
+    Scalar Q_multiplier = 1;
+    Scalar R_multiplier = 1;
+};
+
+static constexpr unsigned NumGainSchedulePoints = 4;
+
+using GainSchedule = std::array<GainSchedulePoint, NumGainSchedulePoints>;
+
 /**
  * Observer constants that are invariant to the motor model.
  * Model of the motor is defined separately.
@@ -63,6 +81,21 @@ struct Parameters
 
     Scalar cross_coupling_compensation = 0.8F;
 
+    /// Flux observer, see @ref FluxObserver; normalized gain of the flux magnitude correction, 1/second
+    Scalar flux_observer_gain = 1000.0F;
+
+    /// Flux observer PLL natural frequency, radian per second
+    Scalar flux_observer_pll_bandwidth = 600.0F;
+
+    /// Points must be sorted by angular velocity. All multipliers are 1 by default, i.e. no scheduling.
+    GainSchedule gain_schedule
+    {{
+        { 0.0F,    1.0F, 1.0F },
+        { 500.0F,  1.0F, 1.0F },
+        { 1500.0F, 1.0F, 1.0F },
+        { 3000.0F, 1.0F, 1.0F }
+    }};
+
 
     bool isValid() const
     {
@@ -79,62 +112,97 @@ struct Parameters
             return true;
         };
 
+        static const auto check_gain_schedule = [](const GainSchedule& gs)
+        {
+            for (unsigned i = 0; i < gs.size(); i++)
+            {
+                if ((gs[i].angular_velocity < 0) ||
+                    ((i > 0) && (gs[i].angular_velocity <= gs[i - 1].angular_velocity)) ||
+                    !os::float_eq::positive(gs[i].Q_multiplier) ||
+                    !os::float_eq::positive(gs[i].R_multiplier))
+                {
+                    return false;
+                }
+            }
+            return true;
+        };
+
         return check_positive(Q)        &&
                check_positive(R)        &&
                check_positive(P0)       &&
-               math::Range<>(0.0F, 1.0F).contains(cross_coupling_compensation);
+               math::Range<>(0.0F, 1.0F).contains(cross_coupling_compensation) &&
+               math::Range<>(1.0F, 1e+5F).contains(flux_observer_gain) &&
+               math::Range<>(1.0F, 1e+4F).contains(flux_observer_pll_bandwidth) &&
+               check_gain_schedule(gain_schedule);
     }
 
     auto toString() const
     {
-        return os::heapless::format("Q diag : %s\n"
-                                    "R diag : %s\n"
-                                    "P0 diag: %s\n"
-                                    "CC Comp: %.3f",
-                                    math::toString(Q.diagonal()).c_str(),
-                                    math::toString(R.diagonal()).c_str(),
-                                    math::toString(P0.diagonal()).c_str(),
-                                    double(cross_coupling_compensation));
+        return os::heapless::String<320>(
+            "Q diag : %s\n"
+            "R diag : %s\n"
+            "P0 diag: %s\n"
+            "CC Comp: %.3f\n"
+            "FO Gain: %.0f, PLL %.0f\n"
+            "GS W   : %.0f %.0f %.0f %.0f\n"
+            "GS Q   : %.3f %.3f %.3f %.3f\n"
+            "GS R   : %.3f %.3f %.3f %.3f").format(
+            math::toString(Q.diagonal()).c_str(),
+            math::toString(R.diagonal()).c_str(),
+            math::toString(P0.diagonal()).c_str(),
+            double(cross_coupling_compensation),
+            double(flux_observer_gain),
+            double(flux_observer_pll_bandwidth),
+            double(gain_schedule[0].angular_velocity),
+            double(gain_schedule[1].angular_velocity),
+            double(gain_schedule[2].angular_velocity),
+            double(gain_schedule[3].angular_velocity),
+            double(gain_schedule[0].Q_multiplier),
+            double(gain_schedule[1].Q_multiplier),
+            double(gain_schedule[2].Q_multiplier),
+            double(gain_schedule[3].Q_multiplier),
+            double(gain_schedule[0].R_multiplier),
+            double(gain_schedule[1].R_multiplier),
+            double(gain_schedule[2].R_multiplier),
+            double(gain_schedule[3].R_multiplier));
     }
 };
 
-/**
- * Restriction on the direction of rotation applied to the model.
- */
-enum class DirectionConstraint
-{
-    None,   //!< None
-    Forward,//!< Forward
-    Reverse //!< Reverse
-};
-
 /**
  * Dmitry's ingenious observer.
  * Refer to the Simulink model for derivations.
  * All units are SI units (Weber, Henry, Ohm, Volt, Second, Radian).
  */
-class Observer
+class Observer final : public IEstimator
 {
-    Const phi_;
+    Scalar phi_;
     Const ld_;
     Const lq_;
-    Const r_;
+    Scalar r_;
 
     static constexpr unsigned StateIndexAngularVelocity = 2;
     static constexpr unsigned StateIndexAngularPosition = 3;
 
-    Const cross_coupling_comp_;
+    Scalar cross_coupling_comp_;
 
-    const Matrix<4, 4> Q_;
-    const Matrix<2, 2> R_;
+    Matrix<4, 4> Q_;
+    Matrix<2, 2> R_;
+    GainSchedule gain_schedule_;
 
     const Matrix<2, 4> C_;
 
     DirectionConstraint direction_constraint_ = DirectionConstraint::None;
 
+    /**
+     * Returns the Q and R multipliers for the specified angular velocity.
+     * Linear interpolation between the points; the multipliers are held constant beyond the ends of the table.
+     */
+    std::pair<Scalar, Scalar> interpolateGainSchedule(Const angular_velocity) const;
+
     // Filter states
     Vector<4> x_ = Vector<4>::Zero();
     Matrix<4, 4> P_;
+    Scalar normalized_innovation_squared_ = 0;
 
 public:
     Observer(const Parameters& parameters,
@@ -143,17 +211,48 @@ public:
              Const stator_phase_inductance_quadrature,
              Const stator_phase_resistance);
 
+    const char* getName() const override { return "EKF"; }
+
     void update(Const dt,
                 const Vector<2>& idq,
                 const Vector<2>& udq);
 
-    void setDirectionConstraint(DirectionConstraint dc) { direction_constraint_ = dc; }
+    /**
+     * The EKF works in its own rotating frame, so the frame angle is not needed.
+     */
+    void update(Const dt,
+                const Vector<2>& idq,
+                const Vector<2>& udq,
+                Const frame_angle) override
+    {
+        (void) frame_angle;
+        update(dt, idq, udq);
+    }
+
+    /**
+     * Updates the noise covariances, the gain schedule, and the cross coupling compensation on the fly.
+     * The filter state and its covariance are retained; the initial covariance P0 is not used here.
+     */
+    void setTuning(const Parameters& parameters);
+
+    void setDirectionConstraint(DirectionConstraint dc) override { direction_constraint_ = dc; }
+
+    void seedAngularPosition(Const angle) override;
+
+    void setModelParameters(Const field_flux,
+                            Const stator_phase_resistance) override
+    {
+        phi_ = field_flux;
+        r_ = stator_phase_resistance;
+    }
 
     Vector<2> getIdq() const { return x_.block<2, 1>(0, 0); }
 
-    Scalar getAngularVelocity() const { return x_[StateIndexAngularVelocity]; }
+    Scalar getAngularVelocity() const override { return x_[StateIndexAngularVelocity]; }
+
+    Scalar getAngularPosition() const override { return x_[StateIndexAngularPosition]; }
 
-    Scalar getAngularPosition() const { return x_[StateIndexAngularPosition]; }
+    Scalar getNormalizedInnovationSquared() const override { return normalized_innovation_squared_; }
 };
 
 }
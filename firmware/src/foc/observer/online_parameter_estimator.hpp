@@ -0,0 +1,215 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <math/math.hpp>
+#include <cassert>
+
+
+namespace foc
+{
+namespace observer
+{
+
+using math::Scalar;
+using math::Const;
+using math::Vector;
+using math::Matrix;
+
+/**
+ * Output of @ref OnlineParameterEstimator.
+ */
+struct OnlineParameterEstimate
+{
+    Scalar phase_resistance = 0;        ///< Ohm
+    Scalar field_flux = 0;              ///< Weber
+    Scalar winding_temperature = 0;     ///< Degree Celsius, derived from the resistance drift
+    bool frozen = true;                 ///< True if the excitation is insufficient and the estimate is held
+};
+
+/**
+ * Tracks the drift of the phase resistance and the field flux linkage while running, using recursive least squares
+ * with exponential forgetting on the steady state Q axis voltage equation:
+ *      Uq - w*L*Id = Rs*Iq + w*phi
+ * The regressors and the parameters are normalized by the nominal values, so that both components of the regressor
+ * are in Volts and the problem stays well conditioned.
+ *
+ * The samples are averaged over @ref UpdateInterval, which suppresses the noise and keeps the CPU load low.
+ * The estimator freezes when the excitation is insufficient (low speed or current) or when the speed changes
+ * quickly, since the inductive voltage drop is not modeled. The covariance is bounded to prevent windup while
+ * the operating point doesn't change, and the estimates are bounded by the physically plausible range.
+ *
+ * The winding temperature is derived from the resistance assuming copper windings and that the nominal resistance
+ * was identified at @ref ReferenceTemperature.
+ */
+class OnlineParameterEstimator
+{
+public:
+    static constexpr Scalar UpdateInterval                  = 0.01F;    ///< Second
+    static constexpr Scalar ForgettingTimeConstant          = 10.0F;    ///< Second
+    static constexpr Scalar InitialRelativeVariance         = 0.01F;    ///< Of the normalized parameters
+    static constexpr Scalar MaxRelativeVariance             = 0.25F;    ///< Ditto
+
+    static constexpr Scalar MinResistanceRatio              = 0.7F;
+    static constexpr Scalar MaxResistanceRatio              = 1.8F;
+    static constexpr Scalar MinFieldFluxRatio               = 0.8F;
+    static constexpr Scalar MaxFieldFluxRatio               = 1.1F;
+
+    /// The estimator freezes if the relative rate of change of the angular velocity exceeds this, 1/second
+    static constexpr Scalar MaxRelativeAngularAcceleration  = 2.0F;
+
+    static constexpr Scalar CopperTemperatureCoefficient    = 0.00393F;     ///< 1/Kelvin
+    static constexpr Scalar ReferenceTemperature            = 25.0F;        ///< Degree Celsius
+
+private:
+    Const nominal_rs_;
+    Const nominal_phi_;
+    Const inductance_;
+    Const min_current_;
+    Const min_angular_velocity_;
+
+    Vector<2> theta_ = Vector<2>::Ones();                   ///< Normalized Rs, phi
+    Matrix<2, 2> P_;
+
+    // Averaging window
+    Vector<2> regressor_sum_ = Vector<2>::Zero();
+    Scalar output_sum_ = 0;
+    Scalar window_time_ = 0;
+    bool window_valid_ = true;
+
+    bool frozen_ = true;
+
+    static Scalar constrain(Const x, Const min, Const max)
+    {
+        return std::min(std::max(x, min), max);
+    }
+
+    void updateRLS(const Vector<2>& x, Const y)
+    {
+        Const lambda = 1.0F - UpdateInterval / ForgettingTimeConstant;
+
+        const Vector<2> Px = P_ * x;
+        const Vector<2> K = Px / (lambda + x.dot(Px));
+
+        theta_ += K * (y - x.dot(theta_));
+        P_ = (P_ - K * Px.transpose()) / lambda;
+
+        /*
+         * Bounding the variance of each parameter, otherwise it grows without limit along the directions that
+         * are not excited. Scaling the row and the column together keeps the matrix positive definite.
+         */
+        for (unsigned i = 0; i < 2; i++)
+        {
+            if (P_(i, i) > MaxRelativeVariance)
+            {
+                Const scale = std::sqrt(MaxRelativeVariance / P_(i, i));
+                P_.row(i) *= scale;
+                P_.col(i) *= scale;
+            }
+        }
+
+        theta_[0] = constrain(theta_[0], MinResistanceRatio, MaxResistanceRatio);
+        theta_[1] = constrain(theta_[1], MinFieldFluxRatio, MaxFieldFluxRatio);
+    }
+
+public:
+    /**
+     * @param nominal_rs            Identified or configured phase resistance, Ohm.
+     * @param nominal_phi           Identified or configured field flux linkage, Weber.
+     * @param inductance            Phase inductance, Henry.
+     * @param min_current           Below this Q axis current the estimator freezes, Ampere.
+     * @param min_angular_velocity  Below this electrical angular velocity the estimator freezes, radian/second.
+     */
+    OnlineParameterEstimator(Const nominal_rs,
+                             Const nominal_phi,
+                             Const inductance,
+                             Const min_current,
+                             Const min_angular_velocity) :
+        nominal_rs_(nominal_rs),
+        nominal_phi_(nominal_phi),
+        inductance_(inductance),
+        min_current_(min_current),
+        min_angular_velocity_(min_angular_velocity),
+        P_(Matrix<2, 2>::Identity() * InitialRelativeVariance)
+    {
+        assert(nominal_rs_ > 0);
+        assert(nominal_phi_ > 0);
+    }
+
+    /**
+     * Must be invoked from the main IRQ while the motor is running.
+     * @return True if the estimate has been updated.
+     */
+    bool update(Const dt,
+                const Vector<2>& Idq,
+                const Vector<2>& Udq,
+                Const angular_velocity,
+                Const angular_acceleration)
+    {
+        const bool excited = (std::abs(angular_velocity) > min_angular_velocity_) &&
+                             (std::abs(Idq[1]) > min_current_) &&
+                             (std::abs(angular_acceleration) <
+                              std::abs(angular_velocity) * MaxRelativeAngularAcceleration);
+
+        window_valid_ = window_valid_ && excited;
+
+        regressor_sum_ += Vector<2>(nominal_rs_ * Idq[1], nominal_phi_ * angular_velocity) * dt;
+        output_sum_ += (Udq[1] - angular_velocity * inductance_ * Idq[0]) * dt;
+        window_time_ += dt;
+
+        if (window_time_ < UpdateInterval)
+        {
+            return false;
+        }
+
+        const bool valid = window_valid_;
+        if (valid)
+        {
+            updateRLS(regressor_sum_ / window_time_, output_sum_ / window_time_);
+        }
+        frozen_ = !valid;
+
+        regressor_sum_.setZero();
+        output_sum_ = 0;
+        window_time_ = 0;
+        window_valid_ = true;
+
+        return valid;
+    }
+
+    OnlineParameterEstimate getEstimate() const
+    {
+        OnlineParameterEstimate out;
+        out.phase_resistance = theta_[0] * nominal_rs_;
+        out.field_flux = theta_[1] * nominal_phi_;
+        out.winding_temperature = ReferenceTemperature + (theta_[0] - 1.0F) / CopperTemperatureCoefficient;
+        out.frozen = frozen_;
+        return out;
+    }
+};
+
+}
+}
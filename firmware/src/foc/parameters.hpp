@@ -110,6 +110,40 @@ struct MotorParameters
      */
     Scalar voltage_ramp_volt_per_s = 10;
 
+    /**
+     * Moment of inertia of the rotor, including the attached load. [kilogram*meter^2]
+     * This is an optional parameter, zero means unknown; it can be estimated using the motor identification procedure.
+     */
+    Scalar rotor_inertia = 0;
+
+    /**
+     * Viscous friction coefficient, related to the mechanical angular velocity. [newton*meter*second/radian]
+     * This is an optional parameter; it can be estimated using the motor identification procedure.
+     */
+    Scalar viscous_friction = 0;
+
+    /**
+     * Coulomb friction torque. [newton*meter]
+     * This is an optional parameter; it can be estimated using the motor identification procedure.
+     */
+    Scalar coulomb_friction = 0;
+
+    /**
+     * Thermal resistance from the winding to the ambient. [kelvin/watt]
+     * This is an optional parameter; zero disables the thermal model of the winding, see @ref ThermalModel.
+     */
+    Scalar winding_thermal_resistance = 0;
+
+    /**
+     * Thermal time constant of the winding. [second]
+     */
+    Scalar winding_thermal_time_constant = 60;
+
+    /**
+     * The current is derated to keep the winding temperature below this value. [kelvin]
+     */
+    Scalar max_winding_temperature = math::convertCelsiusToKelvin(120.0F);
+
 
     static math::Range<> getPhiLimits()
     {
@@ -129,6 +163,42 @@ struct MotorParameters
                  1000e-6F };
     }
 
+    static math::Range<> getRotorInertiaLimits()
+    {
+        return { 1e-9F,
+                 1e-1F };
+    }
+
+    static math::Range<> getViscousFrictionLimits()
+    {
+        return { 0.0F,
+                 1e-1F };
+    }
+
+    static math::Range<> getCoulombFrictionLimits()
+    {
+        return { 0.0F,
+                 1.0F };
+    }
+
+    static math::Range<> getWindingThermalResistanceLimits()
+    {
+        return { 0.0F,
+                 100.0F };
+    }
+
+    static math::Range<> getWindingThermalTimeConstantLimits()
+    {
+        return {    1.0F,
+                 3600.0F };
+    }
+
+    static math::Range<> getMaxWindingTemperatureLimits()
+    {
+        return { math::convertCelsiusToKelvin(40.0F),
+                 math::convertCelsiusToKelvin(200.0F) };
+    }
+
 
     void deduceMissingParameters()
     {
@@ -180,7 +250,13 @@ struct MotorParameters
             getLqLimits().contains(lq)               &&
             is_positive(min_electrical_ang_vel)      &&
             is_positive(current_ramp_amp_per_s)      &&
-            is_positive(voltage_ramp_volt_per_s);
+            is_positive(voltage_ramp_volt_per_s)     &&
+            (os::float_eq::closeToZero(rotor_inertia) || getRotorInertiaLimits().contains(rotor_inertia)) &&
+            getViscousFrictionLimits().contains(viscous_friction) &&
+            getCoulombFrictionLimits().contains(coulomb_friction) &&
+            getWindingThermalResistanceLimits().contains(winding_thermal_resistance) &&
+            getWindingThermalTimeConstantLimits().contains(winding_thermal_time_constant) &&
+            getMaxWindingTemperatureLimits().contains(max_winding_temperature);
     }
 
     auto toString() const
@@ -200,7 +276,7 @@ struct MotorParameters
                                                                  num_poles);
         }
 
-        return os::heapless::String<240>(
+        return os::heapless::String<400>(
             "Npols: %u\n"
             "Imax : %-7.1f A\n"
             "Imin : %-7.1f A\n"
@@ -211,6 +287,11 @@ struct MotorParameters
             "Wmin : %-7.1f rad/s, %.1f MRPM\n"
             "Iramp: %-7.1f A/s\n"
             "Vramp: %-7.1f V/s\n"
+            "J    : %-7.3f kg*mm^2\n"
+            "Bvisc: %-7.3f uNm*s/rad\n"
+            "Tcoul: %-7.3f mNm\n"
+            "Rthw : %-7.2f K/W, %.0f s\n"
+            "Twmax: %-7.0f C\n"
             "Valid: %s").format(
             unsigned(num_poles),
             double(max_current),
@@ -222,10 +303,45 @@ struct MotorParameters
             double(min_electrical_ang_vel), double(min_mrpm),
             double(current_ramp_amp_per_s),
             double(voltage_ramp_volt_per_s),
+            double(rotor_inertia) * 1e6,
+            double(viscous_friction) * 1e6,
+            double(coulomb_friction) * 1e3,
+            double(winding_thermal_resistance), double(winding_thermal_time_constant),
+            double(math::convertKelvinToCelsius(max_winding_temperature)),
             isValid() ? "YES" : "NO");
     }
 };
 
+/**
+ * Filtering of the measured Idq that is fed to the current controllers and to the observer.
+ * Note that the current samples are always oversampled by the ADC within each PWM period.
+ */
+enum class IdqFilterMode
+{
+    Bypass,             ///< No additional filtering, the lowest latency
+    IIR,                ///< First order low pass filter
+    MovingAverage       ///< Moving average over a few PWM periods, the highest latency
+};
+
+/**
+ * Sensorless rotor state estimator used for control.
+ */
+enum class EstimatorType
+{
+    EKF,                ///< @ref observer::Observer
+    FluxObserver        ///< @ref observer::FluxObserver
+};
+
+/**
+ * Online tracking of the phase resistance and the field flux linkage, see @ref observer::OnlineParameterEstimator.
+ */
+enum class ParameterAdaptationMode
+{
+    Disabled,
+    EstimateOnly,       ///< The estimates are reported, but the model used for control is not altered
+    Enabled             ///< The estimates are fed into the estimators and the current controllers
+};
+
 struct ControllerParameters
 {
     /// Preferred duration of spinup, real duration may slightly differ, seconds
@@ -234,26 +350,82 @@ struct ControllerParameters
     /// If the rotor stalled this many times in a row, latch into FAULT state
     std::uint32_t num_stalls_to_latch = 100;
 
+    /// Bandwidth of the current control loop as a fraction of the PWM frequency; can be changed while running
+    Scalar current_loop_bandwidth = 0.05F;
+
+    /// The added group delay is taken into account when the current controllers are tuned
+    IdqFilterMode idq_filter_mode = IdqFilterMode::MovingAverage;
+
+    /// Innovation weight of the IIR Idq filter; used only in the IIR mode
+    Scalar idq_filter_iir_weight = 0.5F;
+
+    EstimatorType estimator = EstimatorType::EKF;
+
+    /// If set, the other estimator runs in parallel for comparison; its output is not used for control
+    bool shadow_estimator_enabled = false;
+
+    /// Amplitude of the high frequency injection used during spinup, Volt; zero disables injection.
+    /// Requires the moving average Idq filter, see @ref observer::HFInjectionEstimator; other modes are rejected.
+    Scalar hfi_voltage = 0.0F;
+
+    /// If set, the rotor angle is detected at standstill before the spinup, see @ref InitialPositionDetector
+    bool initial_position_detection_enabled = true;
+
+    ParameterAdaptationMode parameter_adaptation_mode = ParameterAdaptationMode::EstimateOnly;
+
+    /// If set, the spinup ramp and handover velocity are adjusted after every start, see @ref SpinupProfileLearner
+    bool adaptive_spinup_enabled = true;
+
+    /// If set, the max current is reduced as the inverter or the winding approach their temperature limits,
+    /// see @ref ThermalModel; otherwise the temperatures are only reported
+    bool thermal_derating_enabled = true;
+
 
     bool isValid() const
     {
         return math::Range<>(0.1F, 60.0F).contains(nominal_spinup_duration) &&
-               num_stalls_to_latch > 0;
+               num_stalls_to_latch > 0 &&
+               math::Range<>(0.005F, 0.2F).contains(current_loop_bandwidth) &&
+               unsigned(idq_filter_mode) <= unsigned(IdqFilterMode::MovingAverage) &&
+               math::Range<>(0.01F, 1.0F).contains(idq_filter_iir_weight) &&
+               unsigned(estimator) <= unsigned(EstimatorType::FluxObserver) &&
+               math::Range<>(0.0F, 10.0F).contains(hfi_voltage) &&
+               ((hfi_voltage <= 0) || (idq_filter_mode == IdqFilterMode::MovingAverage)) &&
+               unsigned(parameter_adaptation_mode) <= unsigned(ParameterAdaptationMode::Enabled);
     }
 
     auto toString() const
     {
         return os::heapless::format("Tspinup: %.1f sec\n"
-                                    "Nslatch: %u",
+                                    "Nslatch: %u\n"
+                                    "CL BW  : %.3f\n"
+                                    "IdqFilt: %u, IIR %.2f\n"
+                                    "Estim  : %u, shadow %u\n"
+                                    "HFI    : %.2f V\n"
+                                    "IPD    : %u\n"
+                                    "Adapt  : %u\n"
+                                    "SpLearn: %u\n"
+                                    "Derate : %u",
                                     double(nominal_spinup_duration),
-                                    unsigned(num_stalls_to_latch));
+                                    unsigned(num_stalls_to_latch),
+                                    double(current_loop_bandwidth),
+                                    unsigned(idq_filter_mode),
+                                    double(idq_filter_iir_weight),
+                                    unsigned(estimator),
+                                    unsigned(shadow_estimator_enabled),
+                                    double(hfi_voltage),
+                                    unsigned(initial_position_detection_enabled),
+                                    unsigned(parameter_adaptation_mode),
+                                    unsigned(adaptive_spinup_enabled),
+                                    unsigned(thermal_derating_enabled));
     }
 };
 
 /**
  * Constant parameters shared between tasks.
- * This data is guaranteed to stay constant as long as a task is running,
- * but it may be changed when tasks are switched (e.g. configuration parameters may be updated at run time).
+ * This data is guaranteed to stay constant as long as a task is running, except for the few hot-swappable fields
+ * that can be applied to a running task (see ITask::applyTunableParameters()); everything else may be changed
+ * only when tasks are switched (e.g. configuration parameters may be updated at run time).
  */
 struct Parameters
 {
@@ -278,7 +450,7 @@ struct Parameters
             s.concatenate(name, ":\n", src.toString(), "\n--\n");
         };
 
-        os::heapless::String<400> s;
+        os::heapless::String<1024> s;
 
         append(s, "Controller", controller);
         append(s, "Motor",      motor);
@@ -27,6 +27,7 @@
 #include "task.hpp"
 #include "motor_runner.hpp"
 #include <zubax_chibios/util/helpers.hpp>
+#include <utility>
 
 
 namespace foc
@@ -65,8 +66,9 @@ class SetpointController
     Const max_current_;
     Const min_current_;
     Const min_voltage_;
-    Const current_ramp_amp_s_;
-    Const voltage_ramp_volt_s_;
+    Scalar current_ramp_amp_s_;
+    Scalar voltage_ramp_volt_s_;
+    Scalar current_limit_;
 
 public:
     SetpointController(Const max_current,
@@ -78,9 +80,31 @@ public:
         min_current_(min_current),
         min_voltage_(min_voltage),
         current_ramp_amp_s_(current_ramp_amp_s),
-        voltage_ramp_volt_s_(voltage_ramp_volt_s)
+        voltage_ramp_volt_s_(voltage_ramp_volt_s),
+        current_limit_(max_current)
     { }
 
+    void setRamps(Const current_ramp_amp_s,
+                  Const voltage_ramp_volt_s)
+    {
+        current_ramp_amp_s_ = current_ramp_amp_s;
+        voltage_ramp_volt_s_ = voltage_ramp_volt_s;
+    }
+
+    /**
+     * Limits the magnitude of the current below the max current, e.g. due to thermal derating.
+     * The ratiometric setpoints are still scaled by the max current. The limit can't be lower than the min current.
+     * In the current modes the setpoint is constrained; in the voltage modes the voltage is ramped in the direction
+     * that reduces the measured current while it exceeds the limit. The limit changes slowly, so the voltage ramp
+     * rate is sufficient for that.
+     */
+    void setCurrentLimit(Const current_limit)
+    {
+        current_limit_ = math::Range<>(min_current_, max_current_).constrain(current_limit);
+    }
+
+    Scalar getCurrentLimit() const { return current_limit_; }
+
     /**
      * Discrete transfer function from input setpoint to current/voltage setpoint.
      *
@@ -88,6 +112,7 @@ public:
      * @param target_setpoint                   Target setpoint, units defined by @ref control_mode
      * @param control_mode                      The actual transfer function to use, this defines the units
      * @param reference                         Iq reference current or Uq reference voltage, depending on the mode
+     * @param measured_current                  Measured Iq, used to enforce the current limit in the voltage modes
      * @param max_voltage                       Maximum achievable axis voltage
      * @param electrical_angular_velocity       Electrical angular velocity of the rotor in radian/second
      * @return                                  New Iq/Uq reference, depending on the mode
@@ -96,6 +121,7 @@ public:
                   Const target_setpoint,
                   const ControlMode control_mode,
                   Const reference,
+                  Const measured_current,
                   Const max_voltage,
                   Const electrical_angular_velocity) const
     {
@@ -112,7 +138,7 @@ public:
             {
                 new_current *= max_current_;
             }
-            new_current = math::Range<>(-max_current_, max_current_).constrain(new_current);
+            new_current = math::Range<>(-current_limit_, current_limit_).constrain(new_current);
 
             // Applying the ramp
             if (new_current > reference)
@@ -154,8 +180,14 @@ public:
             }
             new_voltage = math::Range<>(-max_voltage, max_voltage).constrain(new_voltage);
 
-            // Applying the ramp
-            if (new_voltage > reference)
+            const bool current_limited = std::abs(measured_current) > current_limit_;
+
+            // Applying the ramp; while the current is over the limit, Uq is moved so that |Iq| decreases
+            if (current_limited)
+            {
+                new_voltage = reference - std::copysign(voltage_ramp_volt_s_ * period, measured_current);
+            }
+            else if (new_voltage > reference)
             {
                 new_voltage = reference + voltage_ramp_volt_s_ * period;
             }
@@ -165,7 +197,7 @@ public:
             }
 
             // Constraining the minimums, only if the sign is the same and the setpoint is non-zero
-            if (((new_voltage > 0) == (target_setpoint > 0)) && !zero_setpoint)
+            if (((new_voltage > 0) == (target_setpoint > 0)) && !zero_setpoint && !current_limited)
             {
                 new_voltage = std::copysign(std::max(min_voltage_, std::abs(new_voltage)),
                                             new_voltage);
@@ -187,16 +219,30 @@ public:
 /**
  * Main motor control logic.
  */
-class RunningTask : public ITask
+class RunningTask final : public ITask
 {
     static constexpr Result::ExitCode ExitCodeTooManyStalls = 1;
 
-    const TaskContext context_;
+    /// The start is considered successful once the motor has been running this long after the stall detection
+    /// has been enabled, seconds
+    static constexpr Scalar SpinupConfirmationDelay = 1.0F;
+
+    const TaskContext& context_;     ///< Owned by the task handler, stays valid and immutable while the task exists
 
-    const SetpointController setpoint_controller_;
+    // Hot-swappable parameters; see applyTunableParameters()
+    ControllerParameters controller_params_;
+    observer::Parameters observer_params_;
+
+    SetpointController setpoint_controller_;
     os::helpers::LazyConstructor<MotorRunner, os::helpers::MemoryInitializationPolicy::NoInit> runner_;
 
     std::uint32_t num_successive_stalls_ = 0;
+    std::uint32_t num_desyncs_ = 0;
+    observer::DesyncDetector::Indicator last_desync_indicator_ = observer::DesyncDetector::Indicator::None;
+
+    SpinupProfileLearner spinup_profile_learner_;
+    Scalar running_time_ = 0;
+    bool spinup_confirmed_ = false;
 
     ControlMode requested_control_mode_ = ControlMode(0);
     Scalar raw_setpoint_ = 0;
@@ -251,6 +297,7 @@ class RunningTask : public ITask
                                                    raw_setpoint_,
                                                    requested_control_mode_,
                                                    old_sp.value,
+                                                   runner_->getIdq()[1],
                                                    max_voltage,
                                                    runner_->getElectricalAngularVelocity());
         return new_sp;
@@ -262,11 +309,16 @@ public:
                 Const initial_setpoint,
                 Const initial_setpoint_ttl) :
         context_(context),
+        controller_params_(context.params.controller),
+        observer_params_(context.params.observer),
         setpoint_controller_(context_.params.motor.max_current,
                              context_.params.motor.min_current,
                              context_.params.motor.computeMinVoltage(),
                              context_.params.motor.current_ramp_amp_per_s,
-                             context_.params.motor.voltage_ramp_volt_per_s)
+                             context_.params.motor.voltage_ramp_volt_per_s),
+        spinup_profile_learner_(context_.spinup_profile,
+                                context_.params.motor,
+                                context_.params.controller)
     {
         assert(context_.params.isValid());
 
@@ -285,16 +337,48 @@ public:
         remaining_setpoint_timeout_ = request_ttl;
     }
 
+    /**
+     * Hot-swappable parameters: current loop bandwidth, observer tuning, setpoint ramps.
+     * Everything else will be applied when the motor is restarted.
+     */
+    void applyTunableParameters(const Parameters& params) override
+    {
+        assert(params.isValid());
+
+        controller_params_.current_loop_bandwidth = params.controller.current_loop_bandwidth;
+
+        observer_params_.Q = params.observer.Q;
+        observer_params_.R = params.observer.R;
+        observer_params_.cross_coupling_compensation = params.observer.cross_coupling_compensation;
+        observer_params_.gain_schedule = params.observer.gain_schedule;
+        observer_params_.flux_observer_gain = params.observer.flux_observer_gain;
+        observer_params_.flux_observer_pll_bandwidth = params.observer.flux_observer_pll_bandwidth;
+
+        {
+            AbsoluteCriticalSectionLocker locker;
+            setpoint_controller_.setRamps(params.motor.current_ramp_amp_per_s,
+                                          params.motor.voltage_ramp_volt_per_s);
+        }
+
+        if (runner_.isConstructed())
+        {
+            runner_->updateTunableParameters(controller_params_, observer_params_);
+        }
+    }
+
     Result onMainIRQ(Const period, const board::motor::Status& hw_status) override
     {
         if (!runner_.isConstructed())
         {
             AbsoluteCriticalSectionLocker locker;
-            runner_.construct(context_.params.controller,
+            runner_.construct(controller_params_,
                               context_.params.motor,
-                              context_.params.observer,
+                              observer_params_,
                               context_.board.pwm,
+                              spinup_profile_learner_.getProfile(),
                               (raw_setpoint_ > 0) ? MotorRunner::Direction::Forward : MotorRunner::Direction::Reverse);
+            running_time_ = 0;
+            spinup_confirmed_ = false;
         }
 
         AbsoluteCriticalSectionLocker::assertNotLocked();
@@ -318,6 +402,17 @@ public:
             case MotorRunner::State::Running:
             {
                 runner_->setSetpoint(computeSetpoint(period, hw_status));
+
+                running_time_ += period;
+                if (!spinup_confirmed_)
+                {
+                    const auto telemetry = runner_->getSpinupTelemetry();
+                    if (running_time_ > (telemetry.duration * 2.0F + SpinupConfirmationDelay))
+                    {
+                        spinup_confirmed_ = true;
+                        spinup_profile_learner_.onSuccessfulStart(telemetry, context_.params.motor.spinup_current);
+                    }
+                }
                 break;
             }
 
@@ -335,9 +430,16 @@ public:
             case MotorRunner::State::Stalled:
             {
                 const auto direction = runner_->getDirection();
+                const auto desync_indicator = runner_->getDesyncIndicator();
 
                 runner_.destroy();
 
+                if (desync_indicator != observer::DesyncDetector::Indicator::None)
+                {
+                    num_desyncs_++;
+                    last_desync_indicator_ = desync_indicator;
+                }
+
                 if (((direction == MotorRunner::Direction::Forward) && (raw_setpoint_ < 0)) ||
                     ((direction == MotorRunner::Direction::Reverse) && (raw_setpoint_ > 0)))
                 {
@@ -346,6 +448,11 @@ public:
                 else
                 {
                     num_successive_stalls_++;
+
+                    if (!spinup_confirmed_)
+                    {
+                        spinup_profile_learner_.onFailedStart();
+                    }
                 }
 
                 if (num_successive_stalls_ > context_.params.controller.num_stalls_to_latch)
@@ -390,6 +497,18 @@ public:
         return Result::inProgress();
     }
 
+    void applyResultToGlobalContext(GlobalContext& inout_context, Parameters&) const override
+    {
+        if (context_.params.controller.adaptive_spinup_enabled)
+        {
+            inout_context.spinup_profile = spinup_profile_learner_.getProfile();
+        }
+    }
+
+    /**
+     * Invoked from the fast IRQ directly rather than via the dispatch table, see foc.cpp, hence forced inline.
+     */
+    __attribute__((always_inline))
     std::pair<Vector<3>, bool> onNextPWMPeriod(const Vector<2>& phase_currents_ab,
                                                Const inverter_voltage) override
     {
@@ -406,6 +525,21 @@ public:
         }
     }
 
+    /**
+     * Invoked from the fast IRQ right after @ref onNextPWMPeriod(); see board::motor::setPredictedPhaseCurrents().
+     */
+    std::pair<Vector<2>, bool> getPredictedPhaseCurrentsFromIRQ() const
+    {
+        if (runner_.isConstructed())
+        {
+            return runner_->getPredictedPhaseCurrentsFromIRQ();
+        }
+        else
+        {
+            return { Vector<2>::Zero(), false };
+        }
+    }
+
     std::array<Scalar, NumDebugVariables> getDebugVariables() const override
     {
         std::array<Scalar, NumDebugVariables> out{};
@@ -423,6 +557,21 @@ public:
         return out;
     }
 
+    /**
+     * Invoked from the main IRQ; see @ref ThermalModel.
+     */
+    void setCurrentLimit(Const current_limit)
+    {
+        AbsoluteCriticalSectionLocker locker;
+        setpoint_controller_.setCurrentLimit(current_limit);
+    }
+
+    Scalar getCurrentLimit() const
+    {
+        AbsoluteCriticalSectionLocker locker;
+        return setpoint_controller_.getCurrentLimit();
+    }
+
     bool isSpinupInProgress() const
     {
         AbsoluteCriticalSectionLocker locker;
@@ -434,6 +583,13 @@ public:
         return num_successive_stalls_;  // Atomic read, no locking
     }
 
+    /**
+     * Stalls caused by the loss of synchronization since the task was started; see @ref observer::DesyncDetector.
+     */
+    std::uint32_t getNumDesyncs() const { return num_desyncs_; }
+
+    observer::DesyncDetector::Indicator getLastDesyncIndicator() const { return last_desync_indicator_; }
+
     Vector<2> getUdq() const
     {
         AbsoluteCriticalSectionLocker locker;
@@ -452,6 +608,31 @@ public:
         return runner_.isConstructed() ? runner_->getElectricalAngularVelocity() : 0.0F;
     }
 
+    bool getEstimatorComparisonStatistics(observer::EstimatorComparisonStatistics& out_stat) const
+    {
+        AbsoluteCriticalSectionLocker locker;
+        return runner_.isConstructed() && runner_->getEstimatorComparisonStatistics(out_stat);
+    }
+
+    bool getOnlineParameterEstimate(observer::OnlineParameterEstimate& out_estimate) const
+    {
+        AbsoluteCriticalSectionLocker locker;
+        return runner_.isConstructed() && runner_->getOnlineParameterEstimate(out_estimate);
+    }
+
+    /**
+     * Effective bandwidth [Hz] and total delay [s] of the current loop, zero if the runner is not constructed.
+     */
+    std::pair<Scalar, Scalar> getCurrentLoopBandwidthAndDelay() const
+    {
+        AbsoluteCriticalSectionLocker locker;
+        if (runner_.isConstructed())
+        {
+            return { runner_->getCurrentLoopBandwidth(), runner_->getCurrentLoopDelay() };
+        }
+        return { 0.0F, 0.0F };
+    }
+
     LowPassFilteredValues getLowPassFilteredValues() const
     {
         AbsoluteCriticalSectionLocker locker;
@@ -0,0 +1,225 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "parameters.hpp"
+#include <zubax_chibios/util/heapless.hpp>
+#include <math/math.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+
+namespace foc
+{
+/**
+ * Spinup parameters learned from the previous starts of the same motor.
+ * The profile is bound to the motor parameters it was learned with; once they change, the learning starts over.
+ */
+struct SpinupProfile
+{
+    /// Default handover angular velocity, relative to @ref MotorParameters::min_electrical_ang_vel
+    static constexpr Scalar DefaultHandoverVelocityRatio = 3.0F;
+
+    /// Duration of the current ramp from zero to the spinup current, seconds; zero if not learned
+    Scalar ramp_duration = 0;
+
+    /// Angular velocity of the handover to the running mode, relative to the min angular velocity
+    Scalar handover_velocity_ratio = 0;
+
+    /// Number of successful starts since the profile was loaded
+    std::uint32_t num_starts = 0;
+
+    /// See @ref computeMotorSignature()
+    std::uint16_t motor_signature = 0;
+
+
+    /**
+     * A hash of the motor parameters that affect the spinup.
+     */
+    static std::uint16_t computeMotorSignature(const MotorParameters& mp)
+    {
+        const float values[] = {
+            float(mp.num_poles),
+            mp.spinup_current,
+            mp.min_current,
+            mp.phi,
+            mp.rs,
+            mp.lq,
+            mp.min_electrical_ang_vel
+        };
+
+        // FNV-1a, folded to 16 bits
+        std::uint32_t hash = 2166136261U;
+        for (const float x : values)
+        {
+            std::uint32_t bits = 0;
+            std::memcpy(&bits, &x, sizeof(bits));
+            for (unsigned i = 0; i < 4; i++)
+            {
+                hash = (hash ^ ((bits >> (i * 8U)) & 0xFFU)) * 16777619U;
+            }
+        }
+        return std::uint16_t((hash >> 16) ^ (hash & 0xFFFFU));
+    }
+
+    bool isLearned() const { return (ramp_duration > 0) && (handover_velocity_ratio > 0); }
+
+    auto toString() const
+    {
+        return os::heapless::format("Ramp %.3f s, handover x%.2f, %u starts, motor 0x%04x",
+                                    double(ramp_duration),
+                                    double(handover_velocity_ratio),
+                                    unsigned(num_starts),
+                                    unsigned(motor_signature));
+    }
+};
+
+/**
+ * Collected by the motor runner during a spinup.
+ */
+struct SpinupTelemetry
+{
+    Scalar duration = 0;                        ///< From the start to the handover, seconds
+    Scalar handover_current = 0;                ///< Absolute Iq setpoint at the handover, Ampere
+    Scalar relative_backemf_error = -1.0F;      ///< At the handover, negative if unknown; see DesyncDetector
+};
+
+/**
+ * Adapts the spinup profile across the starts.
+ *
+ * The current ramp is shortened after every start that did not need the full spinup current, and it is restored
+ * towards the nominal duration after a failed start. The handover velocity is raised if the angle estimate was
+ * inaccurate at the handover, and lowered if it was accurate. The accuracy is judged by the back-EMF consistency
+ * rather than by the covariance of the EKF, because the latter is not informative about the angle.
+ * Both are kept within fixed bounds around the nominal values.
+ * The stall timeout is not affected, it is always derived from the nominal spinup duration.
+ */
+class SpinupProfileLearner
+{
+public:
+    static constexpr Scalar MinRampDurationFraction     = 0.1F;     ///< Of the nominal spinup duration
+    static constexpr Scalar RampShrinkFactor            = 0.8F;
+    static constexpr Scalar RampGrowthFactor            = 2.0F;
+
+    /// The lower bound matches the speed where the back-EMF consistency becomes available
+    static constexpr Scalar MinHandoverVelocityRatio    = 2.0F;
+    static constexpr Scalar MaxHandoverVelocityRatio    = 5.0F;
+    static constexpr Scalar HandoverVelocityRatioStep   = 0.25F;
+
+    /// Relative back-EMF error at the handover; 0.1 and 0.3 correspond to the angle error of ~6 and ~17 degrees
+    static constexpr Scalar MaxAccurateBackEMFError     = 0.1F;
+    static constexpr Scalar MinInaccurateBackEMFError   = 0.3F;
+
+    /// The start did not need the full spinup current if the handover occurred below this fraction of it
+    static constexpr Scalar PartialCurrentThreshold     = 0.95F;
+
+private:
+    const math::Range<> ramp_duration_range_;
+    const bool enabled_;
+    SpinupProfile profile_;
+
+public:
+    SpinupProfileLearner(const SpinupProfile& stored_profile,
+                         const MotorParameters& motor_params,
+                         const ControllerParameters& controller_params) :
+        ramp_duration_range_(controller_params.nominal_spinup_duration * MinRampDurationFraction,
+                             controller_params.nominal_spinup_duration),
+        enabled_(controller_params.adaptive_spinup_enabled)
+    {
+        const auto signature = SpinupProfile::computeMotorSignature(motor_params);
+
+        if (enabled_ &&
+            stored_profile.isLearned() &&
+            (stored_profile.motor_signature == signature))
+        {
+            profile_ = stored_profile;
+            profile_.ramp_duration = ramp_duration_range_.constrain(profile_.ramp_duration);
+            profile_.handover_velocity_ratio = math::Range<>(MinHandoverVelocityRatio, MaxHandoverVelocityRatio)
+                                                   .constrain(profile_.handover_velocity_ratio);
+        }
+        else
+        {
+            profile_.ramp_duration = controller_params.nominal_spinup_duration;
+            profile_.handover_velocity_ratio = SpinupProfile::DefaultHandoverVelocityRatio;
+            profile_.motor_signature = signature;
+        }
+    }
+
+    /**
+     * If learning is disabled, the nominal profile is returned.
+     */
+    const SpinupProfile& getProfile() const { return profile_; }
+
+    void onSuccessfulStart(const SpinupTelemetry& telemetry,
+                           Const spinup_current)
+    {
+        if (!enabled_)
+        {
+            return;
+        }
+
+        profile_.num_starts++;
+
+        if (telemetry.handover_current < spinup_current * PartialCurrentThreshold)
+        {
+            profile_.ramp_duration = ramp_duration_range_.constrain(profile_.ramp_duration * RampShrinkFactor);
+        }
+
+        if (telemetry.relative_backemf_error >= 0)
+        {
+            if (telemetry.relative_backemf_error > MinInaccurateBackEMFError)
+            {
+                profile_.handover_velocity_ratio += HandoverVelocityRatioStep;
+            }
+            else if (telemetry.relative_backemf_error < MaxAccurateBackEMFError)
+            {
+                profile_.handover_velocity_ratio -= HandoverVelocityRatioStep;
+            }
+            else
+            {
+                ;   // Dead zone
+            }
+            profile_.handover_velocity_ratio = math::Range<>(MinHandoverVelocityRatio, MaxHandoverVelocityRatio)
+                                                   .constrain(profile_.handover_velocity_ratio);
+        }
+    }
+
+    void onFailedStart()
+    {
+        if (!enabled_)
+        {
+            return;
+        }
+
+        profile_.ramp_duration = ramp_duration_range_.constrain(profile_.ramp_duration * RampGrowthFactor);
+        profile_.handover_velocity_ratio = std::min(profile_.handover_velocity_ratio + HandoverVelocityRatioStep,
+                                                    Scalar(MaxHandoverVelocityRatio));
+    }
+};
+
+}
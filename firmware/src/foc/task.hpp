@@ -25,7 +25,9 @@
 #pragma once
 
 #include "parameters.hpp"
+#include "spinup_profile.hpp"
 #include "hw_test/report.hpp"
+#include "motor_id/statistics.hpp"
 #include <math/math.hpp>
 #include <board/motor.hpp>
 #include <cassert>
@@ -43,14 +45,17 @@ using math::Vector;
 using board::motor::AbsoluteCriticalSectionLocker;
 
 /**
- * Entity that holds all immutable data tasks may need to read (but never write).
+ * Entity that holds all immutable data tasks may need to read (but never write), except the parameters.
+ * The parameters are kept separately in a double buffer, so that a new set can be adopted without copying.
  */
-struct TaskContext
+struct GlobalContext
 {
-    Parameters params;
-
     hw_test::Report hw_test_report;
 
+    motor_id::Statistics motor_id_statistics;
+
+    SpinupProfile spinup_profile;
+
     struct Board
     {
         board::motor::PWMParameters pwm;
@@ -58,6 +63,14 @@ struct TaskContext
     } board;
 };
 
+/**
+ * The global context plus the copy of the parameters that were active when the task was constructed.
+ */
+struct TaskContext : public GlobalContext
+{
+    Parameters params;
+};
+
 /**
  * State specific task generalization.
  */
@@ -137,12 +150,23 @@ public:
     virtual bool isPreCalibrationRequired() const { return false; }
 
     /**
-     * This method gives the task a chance to modify the global context with the result of its work.
-     * It is invoked once after the task reported that it has finished (even if failed).
+     * This method gives the task a chance to modify the global context and the active parameters with the result
+     * of its work. It is invoked once after the task reported that it has finished (even if failed).
      */
-    virtual void applyResultToGlobalContext(TaskContext& inout_context) const
+    virtual void applyResultToGlobalContext(GlobalContext& inout_context, Parameters& inout_params) const
     {
         (void) inout_context;
+        (void) inout_params;
+    }
+
+    /**
+     * Invoked from the main IRQ when a new parameter set has been adopted while the task is active.
+     * The task may apply the hot-swappable subset of the parameters on the fly; the rest will take effect
+     * when the next task is started. The parameters are guaranteed to be valid.
+     */
+    virtual void applyTunableParameters(const Parameters& params)
+    {
+        (void) params;
     }
 
     /**
@@ -270,16 +294,27 @@ struct TypeEnumeration
 /**
  * Helper class used for switching ITasks.
  * It is guaranteed that some task is always selected.
+ *
+ * Tasks are switched in two phases. First, the new task is constructed in the spare pool slot together with its own
+ * copy of the context, while the current task keeps running. Then the task pointer is flipped with all IRQ masked;
+ * this takes a few cycles regardless of how long the task constructor takes. The old task is destroyed afterwards.
+ * The context copy stays immutable while the task exists, so the tasks can refer to it instead of copying it.
+ *
+ * Since a task constructor may run in a thread concurrently with the IRQs and the current task, it must only
+ * initialize the task's own state from the context and the arguments; it must not touch the hardware or any shared
+ * state, nor acquire resources. If the switch is cancelled because the IRQ has switched the task in the meantime,
+ * the new task is abandoned without being destroyed, so the destructors may assume that the task has been active.
  */
 template <typename... TaskList>
 class TaskHandler
 {
     class NullPlaceholderTask : public ITask
     {
-        const char* getName() const override { return ""; }
-        Result onMainIRQ(Const, const board::motor::Status&) override { return {}; }
     public:
         NullPlaceholderTask(const TaskContext&) { }
+
+        const char* getName() const override { return ""; }
+        Result onMainIRQ(Const, const board::motor::Status&) override { return {}; }
     };
 
     typedef TypeEnumeration<NullPlaceholderTask, TaskList...> Tasks;
@@ -291,20 +326,60 @@ public:
     using SwitchCounter = std::uint64_t;
 
 private:
-    alignas(Tasks::LargestAlignment) std::uint8_t vinnie_the_pool_[Tasks::LargestSize]{};
+    struct Slot
+    {
+        TaskContext context;
+        alignas(Tasks::LargestAlignment) std::uint8_t vinnie_the_pool[Tasks::LargestSize]{};
+    };
+
+    std::array<Slot, 2> slots_;
     ITask* ptr_ = nullptr;
     std::uint8_t task_id_ = 0;
+    std::uint8_t active_slot_index_ = 0;
+    volatile bool spare_slot_reserved_ = false;     ///< The spare slot is being used by a thread
     ContextCloner context_cloner_;
     SwitchCounter switch_counter_ = 0;
+    chibios_rt::Mutex thread_switch_mutex_;
 
-    void destroy()
+    template <typename T, typename... Args>
+    ITask* construct(Slot& slot, Args... args)
     {
-        if (ptr_ != nullptr)
-        {
-            ptr_->~ITask();
-            ptr_ = nullptr;
-        }
-        task_id_ = 0;
+        static_assert(sizeof(T) <= sizeof(slot.vinnie_the_pool),
+                      "Pool is not large enough, probably this type is not registered");
+        slot.context = context_cloner_();
+        // And now you are my handler
+        return new (slot.vinnie_the_pool) T(slot.context, std::forward<Args>(args)...);
+    }
+
+    void activate(ITask* const task, const std::uint8_t task_id, const std::uint8_t slot_index)
+    {
+        AbsoluteCriticalSectionLocker::assertLocked();
+        // And I, I will execute your demands
+        ptr_ = task;
+        task_id_ = task_id;
+        active_slot_index_ = slot_index;
+        switch_counter_++;
+    }
+
+    /*
+     * Non-virtual thunks for the IRQ hooks. The type of the task is known in each thunk, so the qualified call
+     * resolves statically and the body of the task's method can be inlined into the thunk.
+     */
+    using FastIRQHook = std::pair<Vector<3>, bool> (*)(ITask*, const Vector<2>&, Const);
+    using MainIRQHook = ITask::Result (*)(ITask*, Const, const board::motor::Status&);
+
+    template <typename T>
+    static std::pair<Vector<3>, bool> invokeOnNextPWMPeriod(ITask* const task,
+                                                            const Vector<2>& phase_currents_ab,
+                                                            Const inverter_voltage)
+    {
+        return static_cast<T*>(task)->T::onNextPWMPeriod(phase_currents_ab, inverter_voltage);
+    }
+
+    template <typename T>
+    static ITask::Result invokeOnMainIRQ(ITask* const task, Const period, const board::motor::Status& hw_status)
+    {
+        return static_cast<T*>(task)->T::onMainIRQ(period, hw_status);
     }
 
     template <typename... SwitchFrom>
@@ -317,11 +392,39 @@ private:
         template <typename SwitchTo, typename... Args>
         void to(Args... args)
         {
-            AbsoluteCriticalSectionLocker locker;
-            if (owner_->either<SwitchFrom...>())
+            AbsoluteCriticalSectionLocker::assertNotLocked();
+            os::MutexLocker mutex_locker(owner_->thread_switch_mutex_);
+
+            std::uint8_t slot_index = 0;
             {
-                owner_->select<SwitchTo>(std::forward<Args>(args)...);
+                AbsoluteCriticalSectionLocker locker;
+                if (!owner_->either<SwitchFrom...>())
+                {
+                    return;
+                }
+                slot_index = std::uint8_t(owner_->active_slot_index_ ^ 1U);
+                owner_->spare_slot_reserved_ = true;
             }
+
+            ITask* const new_task = owner_->construct<SwitchTo>(owner_->slots_[slot_index], args...);
+
+            ITask* old_task = nullptr;
+            {
+                AbsoluteCriticalSectionLocker locker;
+                // The IRQ may have switched the task in the meantime, so the condition needs to be checked again
+                if (owner_->either<SwitchFrom...>())
+                {
+                    old_task = owner_->ptr_;
+                    owner_->activate(new_task, Tasks::template getID<SwitchTo>(), slot_index);
+                }
+            }
+
+            // If the switch has been cancelled, the new task is abandoned in the spare slot, see the class docs
+            if (old_task != nullptr)
+            {
+                old_task->~ITask();
+            }
+            owner_->spare_slot_reserved_ = false;
         }
     };
 
@@ -333,23 +436,54 @@ public:
         select<NullPlaceholderTask>();
     }
 
-    ~TaskHandler() { destroy(); }
+    ~TaskHandler()
+    {
+        if (ptr_ != nullptr)
+        {
+            ptr_->~ITask();
+        }
+    }
 
+    /**
+     * Unconditional switch.
+     * This method can't be preempted by a thread, so it can be invoked only from the main IRQ or during
+     * initialization. If a thread is switching the task concurrently, the new task is constructed in place of the
+     * current one with IRQ masked, which is slower but safe; the thread will re-check its switching condition.
+     */
     template <typename T, typename... Args>
     void select(Args... args)
     {
-        AbsoluteCriticalSectionLocker::assertLocked();
-        static_assert(sizeof(T) <= sizeof(vinnie_the_pool_),
-                      "Pool is not large enough, probably this type is not registered");
-        destroy();
-        assert(ptr_ == nullptr);
-        // And now you are my handler
-        ptr_ = new (vinnie_the_pool_) T(context_cloner_(), std::forward<Args>(args)...);
-        // And I, I will execute your demands
-        task_id_ = Tasks::template getID<T>();
-        switch_counter_++;
+        if (spare_slot_reserved_)
+        {
+            AbsoluteCriticalSectionLocker locker;
+            ptr_->~ITask();
+            activate(construct<T>(slots_[active_slot_index_], args...), Tasks::template getID<T>(),
+                     active_slot_index_);
+        }
+        else
+        {
+            const auto slot_index = std::uint8_t(active_slot_index_ ^ 1U);
+            ITask* const new_task = construct<T>(slots_[slot_index], std::forward<Args>(args)...);
+
+            ITask* old_task = nullptr;
+            {
+                AbsoluteCriticalSectionLocker locker;
+                old_task = ptr_;
+                activate(new_task, Tasks::template getID<T>(), slot_index);
+            }
+
+            if (old_task != nullptr)
+            {
+                old_task->~ITask();
+            }
+        }
     }
 
+    /**
+     * Conditional switch, to be used from threads.
+     * The current task will keep running while the new one is being constructed.
+     * Must not be invoked from a critical section.
+     */
     template <typename... SwitchFrom>
     ConditionalSwitchHelper<SwitchFrom...> from()
     {
@@ -381,6 +515,41 @@ public:
         return *ptr_;
     }
 
+    /**
+     * Invokes ITask::onNextPWMPeriod() on the current task via a jump table indexed by the task ID.
+     * This is equivalent to get().onNextPWMPeriod(), but avoids the virtual call, which matters in the fast IRQ.
+     */
+    std::pair<Vector<3>, bool> dispatchOnNextPWMPeriod(const Vector<2>& phase_currents_ab,
+                                                       Const inverter_voltage)
+    {
+        // Order of the entries must match the order of the type enumeration
+        static constexpr FastIRQHook Table[] =
+        {
+            &invokeOnNextPWMPeriod<NullPlaceholderTask>,
+            &invokeOnNextPWMPeriod<TaskList>...
+        };
+        static_assert(sizeof(Table) / sizeof(Table[0]) == Tasks::Length, "Dispatch table is broken");
+
+        assert(task_id_ < Tasks::Length);
+        return Table[task_id_](ptr_, phase_currents_ab, inverter_voltage);
+    }
+
+    /**
+     * Ditto, for ITask::onMainIRQ().
+     */
+    ITask::Result dispatchOnMainIRQ(Const period, const board::motor::Status& hw_status)
+    {
+        static constexpr MainIRQHook Table[] =
+        {
+            &invokeOnMainIRQ<NullPlaceholderTask>,
+            &invokeOnMainIRQ<TaskList>...
+        };
+        static_assert(sizeof(Table) / sizeof(Table[0]) == Tasks::Length, "Dispatch table is broken");
+
+        assert(task_id_ < Tasks::Length);
+        return Table[task_id_](ptr_, period, hw_status);
+    }
+
     std::uint8_t getTaskID() const { return task_id_; }
 
     SwitchCounter getTaskSwitchCounter() const
@@ -0,0 +1,288 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "parameters.hpp"
+#include "observer/online_parameter_estimator.hpp"
+#include <board/motor.hpp>
+#include <math/math.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+
+namespace foc
+{
+/**
+ * Phase current statistics collected by the fast IRQ, which are needed to compute the power losses.
+ */
+struct PhaseCurrentAccumulator
+{
+    Scalar sum_of_squares = 0;              ///< Sum of squared currents of all phases
+    Scalar sum_of_switched_absolutes = 0;   ///< Sum of absolute currents of all phases, only while switching
+    std::uint32_t num_samples = 0;
+
+    void add(const Vector<2>& phase_currents_ab,
+             const bool switching)
+    {
+        Const ic = -phase_currents_ab[0] - phase_currents_ab[1];
+
+        sum_of_squares += phase_currents_ab.squaredNorm() + ic * ic;
+        if (switching)
+        {
+            sum_of_switched_absolutes += phase_currents_ab.lpNorm<1>() + std::abs(ic);
+        }
+        num_samples++;
+    }
+
+    void add(const PhaseCurrentAccumulator& other)
+    {
+        sum_of_squares += other.sum_of_squares;
+        sum_of_switched_absolutes += other.sum_of_switched_absolutes;
+        num_samples += other.num_samples;
+    }
+};
+
+/**
+ * Lumped first order thermal model: a heat capacity connected to the reference node through a thermal resistance.
+ * The state is the temperature rise above the reference node.
+ */
+class FirstOrderThermalModel
+{
+    Scalar thermal_resistance_ = 0;
+    Scalar time_constant_ = 1.0F;
+    Scalar rise_ = 0;
+
+public:
+    void setParameters(Const thermal_resistance,
+                       Const time_constant)
+    {
+        thermal_resistance_ = thermal_resistance;
+        time_constant_ = time_constant;
+    }
+
+    void update(Const dt, Const power)
+    {
+        rise_ += (power * thermal_resistance_ - rise_) * std::min(dt / time_constant_, 1.0F);
+    }
+
+    /**
+     * Temperature rise after the specified time, assuming that the power stays constant.
+     */
+    Scalar predict(Const horizon, Const power) const
+    {
+        Const steady_state = power * thermal_resistance_;
+        return steady_state + (rise_ - steady_state) * std::exp(-horizon / time_constant_);
+    }
+
+    /**
+     * Moves the state towards the externally measured rise with the specified weight.
+     */
+    void correct(Const rise, Const weight)
+    {
+        rise_ += (rise - rise_) * weight;
+    }
+
+    Scalar getRise() const { return rise_; }
+};
+
+/**
+ * Thermal models of the inverter MOSFETs and of the motor winding, which allow to derate the max current ahead of
+ * the slow temperature sensor.
+ *
+ * The inverter temperature sensor is located on the PCB, and it lags behind the MOSFET junctions by seconds.
+ * The junction temperature is estimated as the sensor temperature plus the rise driven by the MOSFET losses:
+ *      Pcond = Rds(on) * sum(i^2)
+ *      Psw   = Vbus * sum(|i|) * Tsw * Fpwm / 2
+ * The winding temperature is estimated as the inverter sensor temperature, which is used as a conservative proxy
+ * for the ambient temperature, plus the rise driven by the copper losses sum(i^2) * Rs(T). While the online
+ * parameter estimator is tracking the phase resistance, the modeled winding temperature is pulled towards the
+ * temperature derived from the resistance, which compensates for the uncertainty of the thermal parameters.
+ *
+ * The current limit is reduced linearly while the temperature predicted @ref PredictionHorizon ahead at the present
+ * losses is within @ref DeratingMargin of the limit of either component. The limit is low-pass filtered, which also
+ * keeps the loop stable, since reducing the current reduces the predicted temperature as well.
+ */
+class ThermalModel
+{
+public:
+    static constexpr Scalar UpdateInterval                  = 0.01F;    ///< Second
+    static constexpr Scalar PredictionHorizon               = 2.0F;     ///< Second
+    static constexpr Scalar DeratingMargin                  = 15.0F;    ///< Kelvin
+    static constexpr Scalar CurrentLimitTimeConstant        = 0.2F;     ///< Second
+    static constexpr Scalar WindingCorrectionTimeConstant   = 5.0F;     ///< Second
+
+private:
+    board::motor::PowerStageCharacteristics power_stage_;
+    math::Range<> sensor_range_;
+    Scalar pwm_frequency_ = 0;
+    Scalar rs_ = 0;
+    Scalar max_winding_temperature_ = 0;
+    bool winding_model_enabled_ = false;
+    bool derating_enabled_ = false;
+
+    FirstOrderThermalModel junction_;
+    FirstOrderThermalModel winding_;
+
+    Scalar sensor_temperature_ = math::convertCelsiusToKelvin(observer::OnlineParameterEstimator::ReferenceTemperature);
+    Scalar inverter_power_ = 0;
+    Scalar winding_power_ = 0;
+    Scalar current_limit_factor_ = 1.0F;
+
+    PhaseCurrentAccumulator window_;
+    Scalar window_time_ = 0;
+
+    static Scalar computeDeratingFactor(Const predicted_temperature, Const max_temperature)
+    {
+        return math::Range<>(0.0F, 1.0F).constrain((max_temperature - predicted_temperature) / DeratingMargin);
+    }
+
+    Scalar computePhaseResistance(Const winding_temperature) const
+    {
+        using observer::OnlineParameterEstimator;
+        Const celsius = math::convertKelvinToCelsius(winding_temperature);
+        return rs_ * std::max(0.0F, 1.0F + OnlineParameterEstimator::CopperTemperatureCoefficient *
+                                           (celsius - OnlineParameterEstimator::ReferenceTemperature));
+    }
+
+public:
+    /**
+     * The parameters can be changed at any time; the thermal state is retained.
+     */
+    void configure(const board::motor::PowerStageCharacteristics& power_stage,
+                   const board::motor::Limits& board_limits,
+                   Const pwm_period,
+                   const MotorParameters& motor_params,
+                   const ControllerParameters& controller_params)
+    {
+        power_stage_ = power_stage;
+        sensor_range_ = board_limits.measurement_range.inverter_temperature;
+        pwm_frequency_ = (pwm_period > 0) ? (1.0F / pwm_period) : 0.0F;
+        rs_ = motor_params.rs;
+        max_winding_temperature_ = motor_params.max_winding_temperature;
+        winding_model_enabled_ = motor_params.winding_thermal_resistance > 0;
+        derating_enabled_ = controller_params.thermal_derating_enabled;
+
+        junction_.setParameters(power_stage.junction_to_sensor_thermal_resistance,
+                                power_stage.junction_thermal_time_constant);
+        winding_.setParameters(motor_params.winding_thermal_resistance,
+                               motor_params.winding_thermal_time_constant);
+    }
+
+    /**
+     * Must be invoked from the main IRQ continuously, regardless of the state of the controller.
+     * @param dt                    Time since the previous invocation, second.
+     * @param phase_currents        Collected by the fast IRQ since the previous invocation.
+     * @param inverter_voltage      Volt.
+     * @param sensor_temperature    Inverter temperature sensor reading, Kelvin.
+     */
+    void update(Const dt,
+                const PhaseCurrentAccumulator& phase_currents,
+                Const inverter_voltage,
+                Const sensor_temperature)
+    {
+        window_.add(phase_currents);
+        window_time_ += dt;
+
+        if (window_time_ < UpdateInterval)
+        {
+            return;
+        }
+
+        // Invalid readings, e.g. shortly after boot, are ignored
+        if (sensor_range_.contains(sensor_temperature))
+        {
+            sensor_temperature_ = sensor_temperature;
+        }
+
+        Const num_samples = Scalar(std::max(window_.num_samples, std::uint32_t(1)));
+        Const mean_sum_of_squares = window_.sum_of_squares / num_samples;
+        Const mean_sum_of_switched_absolutes = window_.sum_of_switched_absolutes / num_samples;
+
+        inverter_power_ = power_stage_.mosfet_on_resistance * mean_sum_of_squares +
+                          0.5F * inverter_voltage * mean_sum_of_switched_absolutes *
+                          power_stage_.mosfet_switching_time * pwm_frequency_;
+
+        winding_power_ = winding_model_enabled_ ?
+                         (computePhaseResistance(getWindingTemperature()) * mean_sum_of_squares) : 0.0F;
+
+        junction_.update(window_time_, inverter_power_);
+        winding_.update(window_time_, winding_power_);
+
+        Scalar factor = 1.0F;
+        if (derating_enabled_)
+        {
+            factor = computeDeratingFactor(sensor_temperature_ + junction_.predict(PredictionHorizon, inverter_power_),
+                                           power_stage_.max_junction_temperature);
+            if (winding_model_enabled_)
+            {
+                factor = std::min(factor,
+                                  computeDeratingFactor(sensor_temperature_ +
+                                                        winding_.predict(PredictionHorizon, winding_power_),
+                                                        max_winding_temperature_));
+            }
+        }
+
+        current_limit_factor_ += (factor - current_limit_factor_) *
+                                 std::min(window_time_ / CurrentLimitTimeConstant, 1.0F);
+
+        window_ = PhaseCurrentAccumulator();
+        window_time_ = 0;
+    }
+
+    /**
+     * Pulls the modeled winding temperature towards the one derived from the online resistance estimate.
+     * Should be invoked from the main IRQ while the estimate is being updated, i.e. not frozen.
+     * @param dt                    Time since the previous invocation, second.
+     * @param winding_temperature   Kelvin.
+     */
+    void correctWindingTemperature(Const dt, Const winding_temperature)
+    {
+        if (winding_model_enabled_)
+        {
+            winding_.correct(winding_temperature - sensor_temperature_,
+                             std::min(dt / WindingCorrectionTimeConstant, 1.0F));
+        }
+    }
+
+    /**
+     * The max current should be multiplied by this factor; 1 means no derating, 0 means that a limit is reached.
+     */
+    Scalar getCurrentLimitFactor() const { return current_limit_factor_; }
+
+    Scalar getSensorTemperature() const { return sensor_temperature_; }
+
+    Scalar getJunctionTemperature() const { return sensor_temperature_ + junction_.getRise(); }
+
+    Scalar getWindingTemperature() const { return sensor_temperature_ + winding_.getRise(); }
+
+    bool isWindingModelEnabled() const { return winding_model_enabled_; }
+
+    Scalar getInverterPowerLoss() const { return inverter_power_; }
+
+    Scalar getWindingPowerLoss() const { return winding_power_; }
+};
+
+}
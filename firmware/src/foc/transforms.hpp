@@ -206,6 +206,20 @@ inline Vector<2> performClarkeTransform(const Vector<2>& ab)
     return { alpha, beta };
 }
 
+/**
+ * Inverse to the above defined; returns the currents of the phases A and B.
+ * Model:
+ *
+ *      performInverseClarkeTransform[alpha_, beta_] := {alpha, (\[Sqrt]3 beta - alpha)/2};
+ */
+inline Vector<2> performInverseClarkeTransform(const Vector<2>& alpha_beta)
+{
+    Const a = alpha_beta[0];
+    Const b = (alpha_beta[1] * SquareRootOf3 - alpha_beta[0]) * 0.5F;
+
+    return { a, b };
+}
+
 /**
  * Park transform, assming increasing Theta during direct rotation.
  */
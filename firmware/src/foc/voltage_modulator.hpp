@@ -25,9 +25,12 @@
 #pragma once
 
 #include "transforms.hpp"
+#include "parameters.hpp"
 #include <math/math.hpp>
 #include <board/motor.hpp>
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 
 
 namespace foc
@@ -38,46 +41,102 @@ using math::Const;
 using math::Vector;
 
 /**
- * Serial PI controller, Idq Current --> Udq Voltage.
+ * Serial PI controller, Idq Current --> Udq Voltage, one axis.
+ * Output limiting is performed by the caller, which reports the limited output back for anti-windup.
+ * See @ref CurrentDQPIController.
  */
 class CurrentPIController
 {
     Const full_scale_current_;
-    Const kp_;
-    Const ki_;
-    Const voltage_limit_mult_;
+    Const Lq_;
+    Const dt_;
+    Scalar ki_;
+    Scalar kp_;
 
     Scalar ui_ = 0;
 
+    /**
+     * Bandwidth is specified as a fraction of the PWM frequency.
+     */
+    void setBandwidthImpl(Const bandwidth)
+    {
+        assert(bandwidth > 0);
+        kp_ = (math::Pi2 * Lq_ * bandwidth) / dt_;
+    }
+
 public:
     CurrentPIController(Const Lq,
                         Const Rs,
                         Const max_current,
-                        Const dt) :
+                        Const dt,
+                        Const bandwidth) :
         full_scale_current_(max_current * 3.0F),
-        kp_((math::Pi2 * Lq) / (20.0F * dt)),
+        Lq_(Lq),
+        dt_(dt),
         ki_(dt * Rs / Lq),
-        voltage_limit_mult_((SquareRootOf3 / 2.0F) / kp_)
+        kp_(0)
     {
         assert(Lq > 0);
         assert(Rs > 0);
         assert(max_current > 0);
         assert(dt > 0);
+        setBandwidthImpl(bandwidth);
     }
 
-    Scalar computeVoltage(Const target_current,
-                          Const real_current,
-                          Const inverter_voltage)
+    /**
+     * Changes the proportional gain on the fly.
+     * The integrator is rescaled so that its contribution to the output stays the same (bumpless transfer).
+     */
+    void setBandwidth(Const bandwidth)
     {
-        Const voltage_limit = inverter_voltage * voltage_limit_mult_;
-        const math::Range<> voltage_limits(-voltage_limit, voltage_limit);
+        Const old_kp = kp_;
+        setBandwidthImpl(bandwidth);
+        ui_ *= old_kp / kp_;
+    }
 
+    /**
+     * Moves the zero of the controller according to the new resistance estimate; the output is not affected
+     * immediately, because the integral gain only scales the future increments of the integrator.
+     */
+    void setResistance(Const Rs)
+    {
+        assert(Rs > 0);
+        ki_ = dt_ * Rs / Lq_;
+    }
+
+    /**
+     * Updates the integrator and returns the output voltage before limiting.
+     * @ref applyOutputLimit() must be invoked afterwards.
+     */
+    Scalar computeUnlimitedVoltage(Const target_current,
+                                   Const real_current)
+    {
         static constexpr math::Range<> UnityLimits(-1.0F, 1.0F);
         Const error = UnityLimits.constrain((target_current - real_current) / full_scale_current_);
 
-        ui_ = voltage_limits.constrain(ui_ + ki_ * error);      // Sdelat' hotel grozu,
+        ui_ += ki_ * error;
+
+        return kp_ * (error + ui_);
+    }
+
+    /**
+     * Back-calculation anti-windup: the integrator is pulled towards the value that would have produced
+     * the limited output, so that it does not keep integrating while the output is saturated.
+     * @param unlimited_voltage     The value returned by @ref computeUnlimitedVoltage().
+     * @param limited_voltage       The value that was actually applied.
+     * @param voltage_limit         Absolute output limit; the integrator will never exceed it on its own.
+     * @param gain                  Back-calculation gain, (0, 1]; 1 means full correction on every step.
+     */
+    void applyOutputLimit(Const unlimited_voltage,
+                          Const limited_voltage,
+                          Const voltage_limit,
+                          Const gain)
+    {
+        assert((gain > 0) && (gain <= 1));
+        ui_ += gain * (limited_voltage - unlimited_voltage) / kp_;
 
-        return kp_ * (error + ui_);                             // a poluchil kozu
+        Const ui_limit = voltage_limit / kp_;
+        ui_ = math::Range<>(-ui_limit, ui_limit).constrain(ui_);
     }
 
     void resetIntegrator()
@@ -86,6 +145,179 @@ public:
     }
 };
 
+/**
+ * Coupled Idq --> Udq controller.
+ * The output voltage vector is limited by a circle; the D axis has priority, and the Q axis gets the rest.
+ * Both integrators are corrected by back-calculation from the limited vector, so they don't wind up while the
+ * voltage is saturated (e.g. at full throttle), which would otherwise cause an overshoot on exit from saturation.
+ */
+class CurrentDQPIController
+{
+    static constexpr Scalar BackCalculationGain = 0.5F;
+
+    CurrentPIController d_;
+    CurrentPIController q_;
+
+public:
+    struct Output
+    {
+        Vector<2> Udq = Vector<2>::Zero();
+        bool limited = false;
+    };
+
+    CurrentDQPIController(Const Lq,
+                          Const Rs,
+                          Const max_current,
+                          Const dt,
+                          Const bandwidth) :
+        d_(Lq, Rs, max_current, dt, bandwidth),
+        q_(Lq, Rs, max_current, dt, bandwidth)
+    { }
+
+    void setBandwidth(Const bandwidth)
+    {
+        d_.setBandwidth(bandwidth);
+        q_.setBandwidth(bandwidth);
+    }
+
+    void setResistance(Const Rs)
+    {
+        d_.setResistance(Rs);
+        q_.setResistance(Rs);
+    }
+
+    /**
+     * @param target_Id             D axis current setpoint.
+     * @param q_setpoint            Q axis current setpoint, or Q axis voltage if Q axis control is bypassed.
+     * @param q_setpoint_is_voltage If true, the Q axis PI is bypassed and its integrator is reset.
+     * @param real_Idq              Measured current.
+     * @param feedforward_Udq       Added to the PI output before limiting, e.g. cross-coupling compensation.
+     * @param voltage_limit         Magnitude limit of the output voltage vector.
+     */
+    Output compute(Const target_Id,
+                   Const q_setpoint,
+                   const bool q_setpoint_is_voltage,
+                   const Vector<2>& real_Idq,
+                   const Vector<2>& feedforward_Udq,
+                   Const voltage_limit)
+    {
+        assert(voltage_limit > 0);
+
+        Vector<2> unlimited;
+        unlimited[0] = d_.computeUnlimitedVoltage(target_Id, real_Idq[0]) + feedforward_Udq[0];
+
+        if (q_setpoint_is_voltage)
+        {
+            unlimited[1] = q_setpoint + feedforward_Udq[1];
+            q_.resetIntegrator();
+        }
+        else
+        {
+            unlimited[1] = q_.computeUnlimitedVoltage(q_setpoint, real_Idq[1]) + feedforward_Udq[1];
+        }
+
+        Output out;
+        out.Udq = unlimited;
+
+        // D axis first
+        if (std::abs(unlimited[0]) > voltage_limit)
+        {
+            out.Udq[0] = std::copysign(voltage_limit, unlimited[0]);
+            out.limited = true;
+        }
+
+        // Q axis gets whatever is left, which may be nothing
+        Const q_limit = std::sqrt(std::max(0.0F, voltage_limit * voltage_limit - out.Udq[0] * out.Udq[0]));
+        if (std::abs(unlimited[1]) > q_limit)
+        {
+            out.Udq[1] = std::copysign(q_limit, unlimited[1]);
+            out.limited = true;
+        }
+
+        d_.applyOutputLimit(unlimited[0], out.Udq[0], voltage_limit, BackCalculationGain);
+        if (!q_setpoint_is_voltage)
+        {
+            q_.applyOutputLimit(unlimited[1], out.Udq[1], voltage_limit, BackCalculationGain);
+        }
+
+        return out;
+    }
+};
+
+/**
+ * Delay of the current loop from the ADC sampling instant to the moment when the new PWM setpoint takes effect,
+ * in PWM periods: the computation is completed within the period, and the new setpoint is loaded at the end of it.
+ */
+constexpr Scalar CurrentLoopTransportDelay = 1.5F;
+
+/**
+ * The current loop bandwidth is limited so that the phase lag introduced by the total loop delay at the crossover
+ * frequency does not exceed this value, which keeps an adequate phase margin.
+ */
+constexpr Scalar CurrentLoopMaxPhaseLagAtCrossover = math::Pi * 65.0F / 180.0F;
+
+/**
+ * Filtering stage for the measured Idq.
+ * The group delay (at low frequencies) is reported so that it can be accounted for in the current loop design.
+ */
+template <unsigned MovingAverageLength>
+class IdqFilter
+{
+    const IdqFilterMode mode_;
+    Const iir_weight_;
+    math::SimpleMovingAverageFilter<MovingAverageLength, Vector<2>> moving_average_;
+    Vector<2> value_ = Vector<2>::Zero();
+
+public:
+    IdqFilter(const IdqFilterMode mode,
+              Const iir_weight) :
+        mode_(mode),
+        iir_weight_(iir_weight),
+        moving_average_(Vector<2>::Zero())
+    {
+        assert((iir_weight_ > 0) && (iir_weight_ <= 1));
+    }
+
+    void update(const Vector<2>& x)
+    {
+        switch (mode_)
+        {
+        case IdqFilterMode::Bypass:
+        {
+            value_ = x;
+            break;
+        }
+        case IdqFilterMode::IIR:
+        {
+            value_ += iir_weight_ * (x - value_);
+            break;
+        }
+        case IdqFilterMode::MovingAverage:
+        {
+            moving_average_.update(x);
+            value_ = moving_average_.getValue();
+            break;
+        }
+        }
+    }
+
+    const Vector<2>& getValue() const { return value_; }
+
+    /**
+     * Group delay in PWM periods.
+     */
+    Scalar getGroupDelay() const
+    {
+        switch (mode_)
+        {
+        case IdqFilterMode::IIR:            return (1.0F - iir_weight_) / iir_weight_;
+        case IdqFilterMode::MovingAverage:  return Scalar(MovingAverageLength - 1) / 2.0F;
+        case IdqFilterMode::Bypass:
+        default:                            return 0;
+        }
+    }
+};
+
 /**
  * Generates rotating three phase voltage vector using measured and estimated parameters of the motor and Iq reference.
  */
@@ -105,28 +337,44 @@ public:
         Enabled
     };
 
+    /**
+     * If enabled, the inverse Park transform uses the angle that the rotor will have in the middle of the PWM period
+     * where the computed voltage will be applied, see @ref CurrentLoopTransportDelay.
+     * Otherwise, the angle at the current sampling instant is used for both transforms.
+     */
+    enum class DelayCompensationPolicy
+    {
+        Disabled,
+        Enabled
+    };
+
 private:
     const DeadTimeCompensationPolicy dead_time_compensation_policy_;
     const CrossCouplingCompensationPolicy cross_coupling_compensation_policy_;
+    const DelayCompensationPolicy delay_compensation_policy_;
 
     board::motor::PWMParameters pwm_params_;
 
     Const Lq_;
 
-    CurrentPIController pid_Id_;
-    CurrentPIController pid_Iq_;
+    CurrentDQPIController pid_;
 
-    math::SimpleMovingAverageFilter<IdqMovingAverageLength, Vector<2>> estimated_Idq_filter_;
+    IdqFilter<IdqMovingAverageLength> estimated_Idq_filter_;
+
+    Scalar current_loop_bandwidth_;
 
     std::uint64_t Udq_normalization_count_ = 0;
 
 public:
     struct Output
     {
-        Scalar extrapolated_angular_position = 0;
+        Scalar extrapolated_angular_position = 0;       ///< At the current sampling instant
+        Scalar extrapolated_angular_velocity = 0;       ///< Ditto
+        math::Vector<2> raw_Idq{};                      ///< Not filtered, see @ref IdqFilter
         math::Vector<2> estimated_Idq{};
         math::Vector<2> reference_Udq{};
         math::Vector<3> pwm_setpoint{};
+        math::Vector<2> predicted_phase_currents_ab{};  ///< At the next sampling instant
         bool Udq_was_limited = false;
     };
 
@@ -139,79 +387,138 @@ public:
             Iq,
             Uq
         } mode = Mode::Iq;
+
+        /// Added to the D axis voltage on top of the controller output, e.g. for high frequency signal injection
+        Scalar injected_Ud = 0;
     };
 
     ThreePhaseVoltageModulator(Const Lq,
                                Const Rs,
                                Const max_current,
                                const board::motor::PWMParameters& pwm_params,
+                               Const current_loop_bandwidth,
+                               const IdqFilterMode idq_filter_mode,
+                               Const idq_filter_iir_weight,
                                const DeadTimeCompensationPolicy dtcomp_policy,
-                               const CrossCouplingCompensationPolicy cccomp_policy) :
+                               const CrossCouplingCompensationPolicy cccomp_policy,
+                               const DelayCompensationPolicy dlcomp_policy) :
         dead_time_compensation_policy_(dtcomp_policy),
         cross_coupling_compensation_policy_(cccomp_policy),
+        delay_compensation_policy_(dlcomp_policy),
         pwm_params_(pwm_params),
         Lq_(Lq),
-        pid_Id_(Lq, Rs, max_current, pwm_params_.period),
-        pid_Iq_(Lq, Rs, max_current, pwm_params_.period),
-        estimated_Idq_filter_(Vector<2>::Zero())
-    { }
+        pid_(Lq, Rs, max_current, pwm_params_.period, current_loop_bandwidth),
+        estimated_Idq_filter_(idq_filter_mode, idq_filter_iir_weight),
+        current_loop_bandwidth_(limitCurrentLoopBandwidth(current_loop_bandwidth))
+    {
+        pid_.setBandwidth(current_loop_bandwidth_);
+    }
+
+    /**
+     * Retunes the current controllers while the modulator is running.
+     * The bandwidth will be limited according to the total loop delay, see @ref getCurrentLoopBandwidth().
+     * Must not be invoked concurrently with @ref onNextPWMPeriod().
+     */
+    void setCurrentLoopBandwidth(Const bandwidth)
+    {
+        current_loop_bandwidth_ = limitCurrentLoopBandwidth(bandwidth);
+        pid_.setBandwidth(current_loop_bandwidth_);
+    }
 
+    /**
+     * Updates the current controllers with a new estimate of the phase resistance, e.g. when it drifts with
+     * the temperature. Must not be invoked concurrently with @ref onNextPWMPeriod().
+     */
+    void setPhaseResistance(Const Rs)
+    {
+        pid_.setResistance(Rs);
+    }
+
+    /**
+     * Bandwidth of the current loop that is actually used, as a fraction of the PWM frequency.
+     */
+    Scalar getCurrentLoopBandwidth() const { return current_loop_bandwidth_; }
+
+    /**
+     * Total delay of the current loop including the Idq filter, in PWM periods.
+     */
+    Scalar getCurrentLoopDelay() const
+    {
+        return CurrentLoopTransportDelay + estimated_Idq_filter_.getGroupDelay();
+    }
+
+    /**
+     * Limits the current loop bandwidth so that the phase lag caused by the loop delay stays acceptable.
+     * The phase lag of a pure delay of D periods at the frequency of B*Fpwm is 2*pi*B*D.
+     */
+    Scalar limitCurrentLoopBandwidth(Const bandwidth) const
+    {
+        const Scalar max_bandwidth = CurrentLoopMaxPhaseLagAtCrossover / (2.0F * math::Pi * getCurrentLoopDelay());
+        return std::min(bandwidth, max_bandwidth);
+    }
+
+    /**
+     * @param angular_velocity          At the previous sampling instant.
+     * @param angular_acceleration      Assumed constant; pass zero if unknown.
+     * @param angular_position          At the previous sampling instant.
+     */
     Output onNextPWMPeriod(const Vector<2>& phase_currents_ab,
                            Const inverter_voltage,
                            Const angular_velocity,
+                           Const angular_acceleration,
                            Const angular_position,
                            const Setpoint setpoint)
     {
         Output out;
 
         /*
-         * Computing Idq, Udq
+         * Extrapolating the angle to the current sampling instant, second order.
+         * At high speed, one PWM period can be tens of electrical degrees, so the acceleration term matters.
          */
+        Const T = pwm_params_.period;
+
         out.extrapolated_angular_position =
-            math::normalizeAngle(angular_position + angular_velocity * pwm_params_.period);
+            math::normalizeAngle(angular_position + angular_velocity * T + 0.5F * angular_acceleration * T * T);
+
+        out.extrapolated_angular_velocity = angular_velocity + angular_acceleration * T;
 
+        /*
+         * Computing Idq, Udq
+         */
         const auto angle_sincos = math::sincos(out.extrapolated_angular_position);
 
         const auto estimated_I_alpha_beta = performClarkeTransform(phase_currents_ab);
 
         const Vector<2> new_Idq = performParkTransform(estimated_I_alpha_beta, angle_sincos);
+        out.raw_Idq = new_Idq;
         estimated_Idq_filter_.update(new_Idq);
         out.estimated_Idq = estimated_Idq_filter_.getValue();
 
         /*
          * Running PIDs, estimating reference voltage in the rotating reference frame
          */
-        out.reference_Udq[0] = pid_Id_.computeVoltage(0.0F,
-                                                      out.estimated_Idq[0],
-                                                      inverter_voltage);
-
-        if (setpoint.mode == Setpoint::Mode::Iq)
-        {
-            out.reference_Udq[1] = pid_Iq_.computeVoltage(setpoint.value,
-                                                          out.estimated_Idq[1],
-                                                          inverter_voltage);
-        }
-        else if (setpoint.mode == Setpoint::Mode::Uq)
-        {
-            out.reference_Udq[1] = setpoint.value;
-            pid_Iq_.resetIntegrator();
-        }
-        else
-        {
-            assert(false);
-        }
+        assert((setpoint.mode == Setpoint::Mode::Iq) || (setpoint.mode == Setpoint::Mode::Uq));
 
+        Vector<2> feedforward_Udq = Vector<2>::Zero();
         if (cross_coupling_compensation_policy_ == CrossCouplingCompensationPolicy::Enabled)
         {
-            out.reference_Udq[0] -= angular_velocity * Lq_ * out.estimated_Idq[1];
-            out.reference_Udq[1] += angular_velocity * Lq_ * out.estimated_Idq[0];
+            feedforward_Udq[0] = -angular_velocity * Lq_ * out.estimated_Idq[1];
+            feedforward_Udq[1] =  angular_velocity * Lq_ * out.estimated_Idq[0];
         }
 
-        Const Udq_magnitude_limit = computeLineVoltageLimit(inverter_voltage, pwm_params_.upper_limit);
+        feedforward_Udq[0] += setpoint.injected_Ud;
+
+        const auto pid_output = pid_.compute(0.0F,
+                                             setpoint.value,
+                                             setpoint.mode == Setpoint::Mode::Uq,
+                                             out.estimated_Idq,
+                                             feedforward_Udq,
+                                             computeLineVoltageLimit(inverter_voltage, pwm_params_.upper_limit));
+
+        out.reference_Udq = pid_output.Udq;
 
-        if (out.reference_Udq.norm() > Udq_magnitude_limit)
+        if (pid_output.limited)
         {
-            out.reference_Udq = out.reference_Udq.normalized() * Udq_magnitude_limit;
             out.Udq_was_limited = true;
             Udq_normalization_count_++;
         }
@@ -219,7 +526,37 @@ public:
         /*
          * Transforming back to the stationary reference frame, updating the PWM outputs
          */
-        auto reference_U_alpha_beta = performInverseParkTransform(out.reference_Udq, angle_sincos);
+        Vector<2> output_angle_sincos = angle_sincos;
+        if (delay_compensation_policy_ == DelayCompensationPolicy::Enabled)
+        {
+            Const delay = CurrentLoopTransportDelay * T;
+            output_angle_sincos = math::sincos(out.extrapolated_angular_position +
+                                               out.extrapolated_angular_velocity * delay +
+                                               0.5F * angular_acceleration * delay * delay);
+        }
+
+        auto reference_U_alpha_beta = performInverseParkTransform(out.reference_Udq, output_angle_sincos);
+
+        /*
+         * Predicting the phase currents at the next sampling instant, e.g. for the current sensor gain control.
+         * The prediction should not underestimate the peak, so the Q axis current is assumed to be the setpoint
+         * or the measured value, whichever is larger; the D axis setpoint is zero, so the measurement is used.
+         */
+        {
+            Vector<2> predicted_Idq = out.raw_Idq;
+            if ((setpoint.mode == Setpoint::Mode::Iq) &&
+                (std::abs(setpoint.value) > std::abs(predicted_Idq[1])))
+            {
+                predicted_Idq[1] = setpoint.value;
+            }
+
+            const auto next_angle_sincos = math::sincos(out.extrapolated_angular_position +
+                                                        out.extrapolated_angular_velocity * T +
+                                                        0.5F * angular_acceleration * T * T);
+
+            out.predicted_phase_currents_ab =
+                performInverseClarkeTransform(performInverseParkTransform(predicted_Idq, next_angle_sincos));
+        }
 
         const auto pwm_setpoint_and_sector_number = performSpaceVectorTransform(reference_U_alpha_beta,
                                                                                 inverter_voltage);
@@ -26,12 +26,13 @@
 #include <hal.h>
 #include <unistd.h>
 #include <cstring>
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <zubax_chibios/os.hpp>
-#include <zubax_chibios/platform/stm32/config_storage.hpp>
 
 #include "board/board.hpp"
+#include "board/config_journal.hpp"
 #include "bootloader_interface/bootloader_interface.hpp"
 #include "uavcan_node/uavcan_node.hpp"
 #include "cli/cli.hpp"
@@ -40,6 +41,7 @@
 #include "params.hpp"
 #include "aux_cmd_iface.hpp"
 #include "led_indicator.hpp"
+#include "boot_profiler.hpp"
 
 #if __GNUC__ < 5
 # error "GCC version 5.x or newer is required"
@@ -54,68 +56,53 @@ namespace
 constexpr unsigned WatchdogTimeoutMSec = 1500;
 
 /**
- * This wrapper prohibits flash access when normal operation cannot be interrupted.
+ * The journal accepts changes at any time and appends them to the flash in the background once the motor is inactive.
+ * Compaction requires the sector to be erased, which can't be done while the motor is running.
  */
-class CustomConfigStorageBackend : public os::stm32::ConfigStorageBackend
+class CustomConfigStorageBackend : public board::ConfigJournal
 {
     os::Logger logger{"CustomConfigStorageBackend"};
 
-    int write(std::size_t offset, const void* data, std::size_t len) override
+public:
+    CustomConfigStorageBackend() :
+        board::ConfigJournal(reinterpret_cast<void*>(0x08008000),
+                             0x4000,
+                             2)
+    { }
+
+    static bool canEraseStorageNow()
     {
-        // Raising priority allows to prevent race condition when accessing the inverter driver
-        os::TemporaryPriorityChanger priority_adjustment_expert(HIGHPRIO);
+        return foc::isInactive() &&
+               (board::motor::PWMHandle::getTotalNumberOfActiveHandles() == 0) &&
+               !board::motor::isCalibrationInProgress();
+    }
 
-        if (canModifyStorageNow() &&
-            board::motor::suspend())
-        {
-            const int res = os::stm32::ConfigStorageBackend::write(offset, data, len);
-            board::motor::unsuspend();
-            if (res < 0)
-            {
-                logger.println("Write error %d", res);
-            }
-            return res;
-        }
-        else
+    /**
+     * Compacts the journal if needed and if possible; returns true if the journal was compacted.
+     */
+    bool compactIfNeeded()
+    {
+        if (!isCompactionRequired() || !canEraseStorageNow())
         {
-            logger.println("WRITE DENIED");
-            return -EACCES;
+            return false;
         }
-    }
 
-    int erase() override
-    {
+        // Raising priority allows to prevent race condition when accessing the inverter driver
         os::TemporaryPriorityChanger priority_adjustment_expert(HIGHPRIO);
 
-        if (canModifyStorageNow() &&
-            board::motor::suspend())
+        if (!board::motor::suspend())
         {
-            const int res = os::stm32::ConfigStorageBackend::erase();
-            board::motor::unsuspend();
-            if (res < 0)
-            {
-                logger.println("Erase error %d", res);
-            }
-            return res;
+            return false;
         }
-        else
-        {
-            logger.println("ERASE DENIED");
-            return -EACCES;
-        }
-    }
 
-public:
-    CustomConfigStorageBackend() :
-        os::stm32::ConfigStorageBackend(reinterpret_cast<void*>(0x08008000),
-                                        0x4000)
-    { }
+        const int res = compact();
+        board::motor::unsuspend();
 
-    static bool canModifyStorageNow()
-    {
-        return foc::isInactive() &&
-               (board::motor::PWMHandle::getTotalNumberOfActiveHandles() == 0) &&
-               !board::motor::isCalibrationInProgress();
+        if (res < 0)
+        {
+            logger.println("Compaction error %d", res);
+        }
+        return res >= 0;
     }
 } g_config_storage_backend;
 
@@ -191,6 +178,11 @@ auto onFirmwareUpdateRequestedFromUAVCAN(
 
 /**
  * This is invoked once immediately after boot.
+ * The interfaces are started only once the power-on self test has finished and its faults have been cleared, so that
+ * no command can reach the motor controller before that.
+ * If the persisted calibration results are available, the calibration is reduced to a short verification pass;
+ * additionally, after a brown-out reset the self test is skipped, allowing the system to come up operational almost
+ * immediately. A watchdog reset doesn't qualify, since it indicates that something may be faulty.
  */
 os::watchdog::Timer init()
 {
@@ -199,6 +191,8 @@ os::watchdog::Timer init()
      */
     auto watchdog = board::init(WatchdogTimeoutMSec, g_config_storage_backend);
 
+    boot_profiler::mark("Board and config initialized");
+
     board::setRGBLED(board::RGB::Ones());
 
     const auto fw_version = bootloader_interface::getFirmwareVersion();
@@ -221,24 +215,43 @@ os::watchdog::Timer init()
      * Motor initialization
      */
     board::motor::init();
-    foc::init(params::readFOCParameters());
 
-    // Power on self test
-    g_logger.puts("Testing hardware...");
+    const bool calibration_restored = board::motor::restoreCalibration();
 
-    foc::beginHardwareTest();
-
-    while (foc::isHardwareTestInProgress())
+    const bool fast_boot = board::wasLastResetCausedByBrownOut() && calibration_restored;
+    if (fast_boot)
     {
-        ::sleep(1);
+        g_logger.puts("Brown-out reset, self test will be skipped");
     }
 
-    g_logger.puts(foc::getHardwareTestReport().toString().c_str());
+    foc::init(params::readFOCParameters());
+    foc::setSpinupProfile(params::readSpinupProfile());
 
-    board::motor::printStatus();
+    boot_profiler::mark("Motor control initialized");
+
+    /*
+     * Power on self test
+     */
+    if (!fast_boot)
+    {
+        g_logger.puts("Testing hardware...");
 
-    // Clearing faults
-    foc::stop();
+        foc::beginHardwareTest();
+
+        while (foc::isHardwareTestInProgress())
+        {
+            ::usleep(10000);
+        }
+
+        g_logger.puts(foc::getHardwareTestReport().toString().c_str());
+
+        board::motor::printStatus();
+
+        // Clearing faults
+        foc::stop();
+
+        boot_profiler::mark("Self test completed");
+    }
 
     /*
      * Interfaces
@@ -255,6 +268,8 @@ os::watchdog::Timer init()
 
     aux_cmd_iface::init();
 
+    boot_profiler::mark("Interfaces started");
+
     return watchdog;
 }
 
@@ -302,6 +317,16 @@ class BackgroundConfigManager
 public:
     void poll()
     {
+        if (board::motor::persistCalibration())
+        {
+            logger.puts("Calibration results updated");
+        }
+
+        if (params::writeSpinupProfile(foc::getSpinupProfile()))
+        {
+            logger.puts("Spinup profile updated");
+        }
+
         const auto new_mod_cnt = os::config::getModificationCounter();
 
         if (new_mod_cnt != modification_counter_)
@@ -326,8 +351,7 @@ public:
 
         if (pending_save_)
         {
-            if (getTimeSinceModification() > (last_save_failed_ ? SaveDelayAfterError : SaveDelay) &&
-                g_config_storage_backend.canModifyStorageNow())
+            if (getTimeSinceModification() > (last_save_failed_ ? SaveDelayAfterError : SaveDelay))
             {
                 logger.println("Saving [modcnt=%u]", modification_counter_);
                 const int res = os::config::save();
@@ -344,6 +368,26 @@ public:
                 }
             }
         }
+
+        /*
+         * Saving only updates the image in RAM; the changes are written into the flash in the background.
+         */
+        if (g_config_storage_backend.hasUncommittedChanges())
+        {
+            const int res = g_config_storage_backend.commit();
+            if (res == -ENOSPC)
+            {
+                logger.puts("Journal is full, compaction is pending");
+            }
+        }
+
+        if (g_config_storage_backend.compactIfNeeded())
+        {
+            const auto st = g_config_storage_backend.getStatistics();
+            logger.println("Journal compacted: %u/%u bytes, %u records, %u compactions, %u errors",
+                           st.used_bytes, st.total_bytes, st.num_records_written, st.num_compactions,
+                           st.num_flash_errors);
+        }
     }
 
     bool hasBeenReloaded() { return doDestructiveTruthTest(just_reloaded_); }
@@ -514,6 +558,8 @@ int main()
     ::usleep(100000);
     foc::beep(6000.0F, 0.1F);
 
+    boot_profiler::mark("Main loop started");
+
     /*
      * Main loop
      */
@@ -85,6 +85,16 @@ inline Scalar normalizeAngle(Scalar x)
     }
 }
 
+/**
+ * Converts the difference of two angles into the range [-Pi, Pi].
+ * The input is expected to be within (-Pi*3, Pi*3), e.g. a difference of two normalized angles.
+ */
+inline Scalar normalizeAngleDifference(Scalar x)
+{
+    x = normalizeAngle(x);
+    return (x > Pi) ? (x - Pi2) : x;
+}
+
 /**
  * Inclusive range of the form [min, max].
  */
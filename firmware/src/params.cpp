@@ -26,6 +26,7 @@
 #include <zubax_chibios/os.hpp>
 #include <zubax_chibios/util/heapless.hpp>
 #include <initializer_list>
+#include <cmath>
 
 
 namespace params
@@ -44,6 +45,16 @@ using Default = foc::ControllerParameters;
 
 Real g_spinup_duration    ("ctrl.spinup_sec",     Default().nominal_spinup_duration,       0.1F,    10.0F);
 Natural g_num_attempts    ("ctrl.num_attempt",    Default().num_stalls_to_latch,              1, 10000000);
+Real g_current_loop_bw    ("ctrl.cur_loop_bw",    Default().current_loop_bandwidth,       0.005F,     0.2F);
+Natural g_idq_filter      ("ctrl.idq_filter",     unsigned(Default().idq_filter_mode),          0,        2);
+Real g_idq_iir_weight     ("ctrl.idq_iir_w",      Default().idq_filter_iir_weight,          0.01F,     1.0F);
+Natural g_estimator       ("ctrl.estimator",      unsigned(Default().estimator),                0,        1);
+Natural g_shadow_estimator("ctrl.est_shadow",     unsigned(Default().shadow_estimator_enabled), 0,        1);
+Real g_hfi_voltage        ("ctrl.hfi_voltage",    Default().hfi_voltage,                     0.0F,    10.0F);
+Natural g_ipd_enabled     ("ctrl.ipd_enable",     unsigned(Default().initial_position_detection_enabled), 0, 1);
+Natural g_adaptation_mode ("ctrl.adapt_mode",     unsigned(Default().parameter_adaptation_mode),  0,        2);
+Natural g_spinup_learning ("ctrl.spup_learn",     unsigned(Default().adaptive_spinup_enabled),  0,        1);
+Natural g_thermal_derating("ctrl.thrm_derate",    unsigned(Default().thermal_derating_enabled), 0,        1);
 
 }
 
@@ -62,6 +73,31 @@ Real g_inductance_quadr   ("m.lq_microhenry",   0.0F,                         0.
 Real g_min_electr_ang_vel ("m.min_eradsec",     D().min_electrical_ang_vel,  10.0F,     1000.0F);
 Real g_current_ramp       ("m.ampere_per_sec",  D().current_ramp_amp_per_s,   0.1F,    10000.0F);
 Real g_voltage_ramp       ("m.volt_per_sec",    D().voltage_ramp_volt_per_s, 0.01F,     1000.0F);
+Real g_rotor_inertia      ("m.inertia_kgmm2",   0.0F,                         0.0F,
+                           D::getRotorInertiaLimits().max * 1e6F);
+Real g_viscous_friction   ("m.visc_unm_srad",   0.0F,                         0.0F,
+                           D::getViscousFrictionLimits().max * 1e6F);
+Real g_coulomb_friction   ("m.coulomb_mnm",     0.0F,                         0.0F,
+                           D::getCoulombFrictionLimits().max * 1e3F);
+Real g_winding_rth        ("m.wind_rth_kw",     0.0F,                         0.0F,      100.0F);
+Real g_winding_tau        ("m.wind_tau_sec",    D().winding_thermal_time_constant,   1.0F,     3600.0F);
+Real g_winding_max_temp   ("m.wind_tmax_c",     math::convertKelvinToCelsius(D().max_winding_temperature),
+                           40.0F,   200.0F);
+
+}
+
+/**
+ * Learned spinup profile, see @ref foc::SpinupProfile. The number of starts is not stored to spare the flash.
+ */
+namespace spinup
+{
+
+Real g_ramp_duration      ("ctrl.spup_ramp",      0.0F,                            0.0F,    60.0F);
+Real g_handover_ratio     ("ctrl.spup_vratio",    0.0F,                            0.0F,    10.0F);
+Natural g_motor_signature ("ctrl.spup_motor",     0,                                  0,    65535);
+
+/// Smaller changes are not written, otherwise every start would cause a write to the flash
+constexpr float MinRelativeChangeToPersist = 0.02F;
 
 }
 
@@ -73,6 +109,9 @@ using Default = foc::motor_id::Parameters;
 Real g_frac_of_max_current("mid.max_cur_frac",  Default().fraction_of_max_current,                     0.1F,    1.0F);
 Real g_high_frequency     ("mid.hifreq_hertz",  Default().current_injection_frequency,               100.0F, 5000.0F);
 Real g_phi_eradsec        ("mid.phi_eradsec",   Default().phi_estimation_electrical_angular_velocity, 50.0F,  900.0F);
+Natural g_num_runs        ("mid.num_runs",      Default().num_runs,                                    1,
+                           Default::MaxRuns);
+Real g_max_rel_deviation  ("mid.max_rel_dev",   Default().max_relative_deviation,                     0.001F,   1.0F);
 
 }
 
@@ -96,6 +135,31 @@ Real g_P0_44   ("obs.p0_44",    Default().P0.diagonal()[3], 1e-6F,  1e+6F);
 
 Real g_cross_coupling_comp("obs.crosscp_comp", Default().cross_coupling_compensation, 0.0F, 1.0F);
 
+Real g_fo_gain ("obs.fo_gain",  Default().flux_observer_gain,           1.0F,  1e+5F);
+Real g_fo_pll  ("obs.fo_pll_bw", Default().flux_observer_pll_bandwidth, 1.0F,  1e+4F);
+
+Real g_gs0_w   ("obs.gs0_w",     Default().gain_schedule[0].angular_velocity,   0.0F,  1e+5F);
+Real g_gs0_q   ("obs.gs0_q",     Default().gain_schedule[0].Q_multiplier,      1e-3F,  1e+3F);
+Real g_gs0_r   ("obs.gs0_r",     Default().gain_schedule[0].R_multiplier,      1e-3F,  1e+3F);
+Real g_gs1_w   ("obs.gs1_w",     Default().gain_schedule[1].angular_velocity,   0.0F,  1e+5F);
+Real g_gs1_q   ("obs.gs1_q",     Default().gain_schedule[1].Q_multiplier,      1e-3F,  1e+3F);
+Real g_gs1_r   ("obs.gs1_r",     Default().gain_schedule[1].R_multiplier,      1e-3F,  1e+3F);
+Real g_gs2_w   ("obs.gs2_w",     Default().gain_schedule[2].angular_velocity,   0.0F,  1e+5F);
+Real g_gs2_q   ("obs.gs2_q",     Default().gain_schedule[2].Q_multiplier,      1e-3F,  1e+3F);
+Real g_gs2_r   ("obs.gs2_r",     Default().gain_schedule[2].R_multiplier,      1e-3F,  1e+3F);
+Real g_gs3_w   ("obs.gs3_w",     Default().gain_schedule[3].angular_velocity,   0.0F,  1e+5F);
+Real g_gs3_q   ("obs.gs3_q",     Default().gain_schedule[3].Q_multiplier,      1e-3F,  1e+3F);
+Real g_gs3_r   ("obs.gs3_r",     Default().gain_schedule[3].R_multiplier,      1e-3F,  1e+3F);
+
+/// Indexed by the gain schedule point number
+Real* const g_gain_schedule[foc::observer::NumGainSchedulePoints][3]
+{
+    { &g_gs0_w, &g_gs0_q, &g_gs0_r },
+    { &g_gs1_w, &g_gs1_q, &g_gs1_r },
+    { &g_gs2_w, &g_gs2_q, &g_gs2_r },
+    { &g_gs3_w, &g_gs3_q, &g_gs3_r }
+};
+
 }
 
 
@@ -129,6 +193,23 @@ foc::Parameters readFOCParameters()
         using namespace controller;
         out.controller.nominal_spinup_duration = g_spinup_duration.get();
         out.controller.num_stalls_to_latch = g_num_attempts.get();
+        out.controller.current_loop_bandwidth = g_current_loop_bw.get();
+        out.controller.idq_filter_mode = foc::IdqFilterMode(g_idq_filter.get());
+        out.controller.idq_filter_iir_weight = g_idq_iir_weight.get();
+        out.controller.estimator = foc::EstimatorType(g_estimator.get());
+        out.controller.shadow_estimator_enabled = g_shadow_estimator.get() != 0;
+        out.controller.hfi_voltage = g_hfi_voltage.get();
+        out.controller.initial_position_detection_enabled = g_ipd_enabled.get() != 0;
+        out.controller.parameter_adaptation_mode = foc::ParameterAdaptationMode(g_adaptation_mode.get());
+        out.controller.adaptive_spinup_enabled = g_spinup_learning.get() != 0;
+        out.controller.thermal_derating_enabled = g_thermal_derating.get() != 0;
+        if (os::float_eq::positive(out.controller.hfi_voltage) &&
+            (out.controller.idq_filter_mode != foc::IdqFilterMode::MovingAverage))
+        {
+            // The parameter ranges can't enforce this combination, and the controller would reject it
+            g_logger.println("HF injection requires ctrl.idq_filter=2, disabled");
+            out.controller.hfi_voltage = 0.0F;
+        }
         assert(out.controller.isValid());
     }
     {
@@ -143,6 +224,12 @@ foc::Parameters readFOCParameters()
         out.motor.min_electrical_ang_vel  = g_min_electr_ang_vel.get();
         out.motor.current_ramp_amp_per_s  = g_current_ramp.get();
         out.motor.voltage_ramp_volt_per_s = g_voltage_ramp.get();
+        out.motor.rotor_inertia           = g_rotor_inertia.get() * 1e-6F;
+        out.motor.viscous_friction        = g_viscous_friction.get() * 1e-6F;
+        out.motor.coulomb_friction        = g_coulomb_friction.get() * 1e-3F;
+        out.motor.winding_thermal_resistance    = g_winding_rth.get();
+        out.motor.winding_thermal_time_constant = g_winding_tau.get();
+        out.motor.max_winding_temperature       = math::convertCelsiusToKelvin(g_winding_max_temp.get());
         out.motor.deduceMissingParameters();
         // May be invalid
     }
@@ -151,6 +238,8 @@ foc::Parameters readFOCParameters()
         out.motor_id.fraction_of_max_current = g_frac_of_max_current.get();
         out.motor_id.current_injection_frequency = g_high_frequency.get();
         out.motor_id.phi_estimation_electrical_angular_velocity = g_phi_eradsec.get();
+        out.motor_id.num_runs = g_num_runs.get();
+        out.motor_id.max_relative_deviation = g_max_rel_deviation.get();
         assert(out.motor_id.isValid());
     }
     {
@@ -166,6 +255,20 @@ foc::Parameters readFOCParameters()
                                                    g_P0_33.get(),
                                                    g_P0_44.get());
         out.observer.cross_coupling_compensation = g_cross_coupling_comp.get();
+        out.observer.flux_observer_gain = g_fo_gain.get();
+        out.observer.flux_observer_pll_bandwidth = g_fo_pll.get();
+        for (unsigned i = 0; i < foc::observer::NumGainSchedulePoints; i++)
+        {
+            out.observer.gain_schedule[i].angular_velocity = g_gain_schedule[i][0]->get();
+            out.observer.gain_schedule[i].Q_multiplier     = g_gain_schedule[i][1]->get();
+            out.observer.gain_schedule[i].R_multiplier     = g_gain_schedule[i][2]->get();
+        }
+        if (!out.observer.isValid())
+        {
+            // The only thing that cannot be enforced by the parameter ranges is the ordering of the schedule points
+            g_logger.println("Invalid gain schedule ignored");
+            out.observer.gain_schedule = foc::observer::Parameters().gain_schedule;
+        }
         assert(out.observer.isValid());
     }
     return out;
@@ -179,6 +282,16 @@ void writeFOCParameters(const foc::Parameters& obj)
         using namespace controller;
         assign(g_spinup_duration,           obj.controller.nominal_spinup_duration);
         assign(g_num_attempts,              obj.controller.num_stalls_to_latch);
+        assign(g_current_loop_bw,           obj.controller.current_loop_bandwidth);
+        assign(g_idq_filter,                unsigned(obj.controller.idq_filter_mode));
+        assign(g_idq_iir_weight,            obj.controller.idq_filter_iir_weight);
+        assign(g_estimator,                 unsigned(obj.controller.estimator));
+        assign(g_shadow_estimator,          unsigned(obj.controller.shadow_estimator_enabled));
+        assign(g_hfi_voltage,               obj.controller.hfi_voltage);
+        assign(g_ipd_enabled,               unsigned(obj.controller.initial_position_detection_enabled));
+        assign(g_adaptation_mode,           unsigned(obj.controller.parameter_adaptation_mode));
+        assign(g_spinup_learning,           unsigned(obj.controller.adaptive_spinup_enabled));
+        assign(g_thermal_derating,          unsigned(obj.controller.thermal_derating_enabled));
     }
 
     writeMotorParameters(obj.motor);
@@ -188,6 +301,8 @@ void writeFOCParameters(const foc::Parameters& obj)
         assign(g_frac_of_max_current,       obj.motor_id.fraction_of_max_current);
         assign(g_high_frequency,            obj.motor_id.current_injection_frequency);
         assign(g_phi_eradsec,               obj.motor_id.phi_estimation_electrical_angular_velocity);
+        assign(g_num_runs,                  obj.motor_id.num_runs);
+        assign(g_max_rel_deviation,         obj.motor_id.max_relative_deviation);
     }
 
     {
@@ -216,6 +331,14 @@ void writeFOCParameters(const foc::Parameters& obj)
                                    &g_P0_33,
                                    &g_P0_44});
         assign(g_cross_coupling_comp, obj.observer.cross_coupling_compensation);
+        assign(g_fo_gain, obj.observer.flux_observer_gain);
+        assign(g_fo_pll, obj.observer.flux_observer_pll_bandwidth);
+        for (unsigned i = 0; i < foc::observer::NumGainSchedulePoints; i++)
+        {
+            assign(*g_gain_schedule[i][0], obj.observer.gain_schedule[i].angular_velocity);
+            assign(*g_gain_schedule[i][1], obj.observer.gain_schedule[i].Q_multiplier);
+            assign(*g_gain_schedule[i][2], obj.observer.gain_schedule[i].R_multiplier);
+        }
     }
 }
 
@@ -235,6 +358,54 @@ void writeMotorParameters(const foc::MotorParameters& obj)
     assign(g_min_electr_ang_vel, obj.min_electrical_ang_vel);
     assign(g_current_ramp,       obj.current_ramp_amp_per_s);
     assign(g_voltage_ramp,       obj.voltage_ramp_volt_per_s);
+    assign(g_rotor_inertia,      obj.rotor_inertia * 1e6F);
+    assign(g_viscous_friction,   obj.viscous_friction * 1e6F);
+    assign(g_coulomb_friction,   obj.coulomb_friction * 1e3F);
+    assign(g_winding_rth,        obj.winding_thermal_resistance);
+    assign(g_winding_tau,        obj.winding_thermal_time_constant);
+    assign(g_winding_max_temp,   math::convertKelvinToCelsius(obj.max_winding_temperature));
+}
+
+foc::SpinupProfile readSpinupProfile()
+{
+    os::MutexLocker locker(g_mutex);
+
+    using namespace spinup;
+
+    foc::SpinupProfile out;
+    out.ramp_duration           = g_ramp_duration.get();
+    out.handover_velocity_ratio = g_handover_ratio.get();
+    out.motor_signature         = std::uint16_t(g_motor_signature.get());
+    return out;
+}
+
+bool writeSpinupProfile(const foc::SpinupProfile& obj)
+{
+    os::MutexLocker locker(g_mutex);
+
+    using namespace spinup;
+
+    if (!obj.isLearned())
+    {
+        return false;
+    }
+
+    static const auto changed = [](const float stored, const float fresh)
+    {
+        return std::abs(fresh - stored) > (std::abs(stored) * MinRelativeChangeToPersist);
+    };
+
+    if ((g_motor_signature.get() == obj.motor_signature) &&
+        !changed(g_ramp_duration.get(), obj.ramp_duration) &&
+        !changed(g_handover_ratio.get(), obj.handover_velocity_ratio))
+    {
+        return false;
+    }
+
+    assign(g_ramp_duration,     obj.ramp_duration);
+    assign(g_handover_ratio,    obj.handover_velocity_ratio);
+    assign(g_motor_signature,   obj.motor_signature);
+    return true;
 }
 
 }
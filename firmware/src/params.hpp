@@ -38,4 +38,11 @@ void writeFOCParameters(const foc::Parameters& obj);
  */
 void writeMotorParameters(const foc::MotorParameters& obj);
 
+/**
+ * The spinup profile is stored separately from the FOC parameters because it is updated by the controller itself.
+ * The write function returns true if the stored profile has been changed; minor changes are not written.
+ */
+foc::SpinupProfile readSpinupProfile();
+bool writeSpinupProfile(const foc::SpinupProfile& obj);
+
 }
@@ -33,11 +33,17 @@
 #include <uavcan/protocol/param_server.hpp>
 #include <uavcan/protocol/dynamic_node_id_client.hpp>
 #include <uavcan/protocol/restart_request_server.hpp>
+#include <uavcan/protocol/file/Read.hpp>
+#include <uavcan/protocol/file/Write.hpp>
 
 #include <board/board.hpp>
 #include <foc/foc.hpp>
+#include <boot_profiler.hpp>
 
 #include <unistd.h>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
 
 
 namespace uavcan_node
@@ -51,6 +57,8 @@ static constexpr unsigned MemoryPoolSize = 8192;
 static constexpr unsigned RxQueueDepth = 254;           ///< Can be safely reduced if we're tight on memory
 static constexpr unsigned NodeThreadPriority = (HIGHPRIO + NORMALPRIO) / 2;
 static constexpr unsigned FixedBitrateInitTimeoutSec = 10;
+static constexpr unsigned MaxLogMessagesPerSpin = 4;   ///< Limited to avoid flooding the TX queue
+static constexpr const char* ParamImageFilePath = "param_image";
 
 /**
  * Node declarations.
@@ -74,6 +82,9 @@ volatile bool g_do_print_status = false;
  */
 os::config::Param<std::uint8_t> g_param_node_id("uavcan.node_id",       0,      0,      125);
 
+/// Last known good bit rate, learned automatically. Zero means unknown.
+os::config::Param<unsigned>     g_param_bit_rate("uavcan.bit_rate",      0,      0,      1000000);
+
 /**
  * Callbacks.
  */
@@ -82,40 +93,148 @@ RebootRequestCallback g_on_reboot_requested;
 
 os::Logger g_logger("UAVCAN");
 
-/// An experiment in minimalism.
+/**
+ * Bounded lock-free multi-producer single-consumer queue of log messages.
+ * Producers are arbitrary threads, the consumer is the node thread. Neither side ever blocks; if there is no room
+ * for a new message, it is discarded and the drop counter for its severity level is incremented.
+ *
+ * Each cell carries a sequence number that tells whether it is free for the producer at the given position or
+ * ready for the consumer (the classic Vyukov scheme). A producer that got preempted while writing its cell delays
+ * the consumer, but never corrupts the queue.
+ *
+ * Severity-based eviction: messages below WARNING may occupy only a fraction of the queue, so that a burst of
+ * debug or info output cannot push out warnings and errors that follow it.
+ */
 class LogMessageQueue
 {
-    chibios_rt::Mutex mutex_;
-    std::array<std::pair<bool, uavcan::protocol::debug::LogMessage>, 2> buffer_{};
-    bool write_pos_ = false;
+    typedef uavcan::protocol::debug::LogMessage Message;
+
+    static constexpr unsigned Capacity = 8;
+    static constexpr unsigned LowSeverityCapacity = Capacity * 3 / 4;
+    static constexpr unsigned NumLevels = 4;
+
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+
+    struct Cell
+    {
+        std::atomic<unsigned> sequence;
+        Message message;
+    };
+
+    std::array<Cell, Capacity> cells_;
+    std::atomic<unsigned> enqueue_pos_;
+    std::atomic<unsigned> dequeue_pos_;
+    std::array<std::atomic<std::uint32_t>, NumLevels> drop_counters_;
+
+    void registerDrop(std::uint8_t level)
+    {
+        drop_counters_[std::min<unsigned>(level, NumLevels - 1U)].fetch_add(1, std::memory_order_relaxed);
+    }
 
 public:
-    void push(const uavcan::protocol::debug::LogMessage& msg)
+    LogMessageQueue() :
+        enqueue_pos_(0),
+        dequeue_pos_(0)
     {
-        os::MutexLocker locker(mutex_);
-        buffer_[int(write_pos_)] = {true, msg};
-        write_pos_ = !write_pos_;
+        for (unsigned i = 0; i < Capacity; i++)
+        {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        for (auto& x : drop_counters_)
+        {
+            x.store(0, std::memory_order_relaxed);
+        }
     }
 
-    bool pop(uavcan::protocol::debug::LogMessage& out_msg)
+    /**
+     * Safe to call from any thread concurrently. Never blocks.
+     * @return true if the message was enqueued, false if it was dropped.
+     */
+    bool push(const Message& msg)
     {
-        if (std::any_of(buffer_.begin(), buffer_.end(), [](auto& x) { return x.first; }))
+        const unsigned limit = (msg.level.value >= uavcan::protocol::debug::LogLevel::WARNING) ?
+                               Capacity : LowSeverityCapacity;
+
+        unsigned pos = enqueue_pos_.load(std::memory_order_relaxed);
+        Cell* cell = nullptr;
+
+        for (;;)
         {
-            os::MutexLocker locker(mutex_);
-            for (auto& x : buffer_)
+            cell = &cells_[pos % Capacity];
+            const int diff = int(cell->sequence.load(std::memory_order_acquire) - pos);
+
+            if (diff == 0)
             {
-                if (x.first)
+                if ((pos - dequeue_pos_.load(std::memory_order_relaxed)) >= limit)
                 {
-                    x.first = false;
-                    out_msg = x.second;
-                    return true;
+                    registerDrop(msg.level.value);
+                    return false;
+                }
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
                 }
             }
+            else if (diff < 0)
+            {
+                registerDrop(msg.level.value);          // Full
+                return false;
+            }
+            else
+            {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
         }
-        return false;
+
+        cell->message = msg;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Must be invoked from the consumer thread only.
+     */
+    bool pop(Message& out_msg)
+    {
+        const unsigned pos = dequeue_pos_.load(std::memory_order_relaxed);
+        Cell& cell = cells_[pos % Capacity];
+
+        if (int(cell.sequence.load(std::memory_order_acquire) - (pos + 1)) < 0)
+        {
+            return false;
+        }
+
+        out_msg = cell.message;
+        cell.sequence.store(pos + Capacity, std::memory_order_release);
+        dequeue_pos_.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * Pops up to max_messages messages and feeds each into the handler.
+     * Must be invoked from the consumer thread only.
+     * @return number of messages processed.
+     */
+    template <typename Handler>
+    unsigned popBatch(unsigned max_messages, Handler handler)
+    {
+        unsigned count = 0;
+        Message msg;
+        while ((count < max_messages) && pop(msg))
+        {
+            handler(msg);
+            count++;
+        }
+        return count;
+    }
+
+    std::uint32_t getDropCount(std::uint8_t level) const
+    {
+        return drop_counters_[std::min<unsigned>(level, NumLevels - 1U)].load(std::memory_order_relaxed);
     }
 } g_log_message_queue_;
 
+
 /**
  * Implementation details.
  * Functions that return references to statics are designed this way as means to implement late initialization.
@@ -132,6 +251,80 @@ uavcan::ParamServer& getParamServer()
     return server;
 }
 
+/**
+ * Precomputed index over the configuration parameters.
+ * The set of parameters is fixed once the static constructors are done, so the descriptors are read once and kept
+ * in RAM, and the names are sorted for binary search. This way a name-based request resolves in O(log N) without
+ * touching the linear search in the config module, and an index-based request is O(1).
+ */
+class ParamIndex
+{
+    /// The config module cannot register more parameters than this, see the Makefile
+    static constexpr unsigned MaxParams = CONFIG_PARAMS_MAX;
+
+    static_assert(MaxParams <= 255, "Config indexes must fit the sort table and the image header");
+
+    std::array<ConfigParam, MaxParams> descriptors_{};          ///< Ordered by config index
+    std::array<std::uint8_t, MaxParams> sorted_by_name_{};      ///< Config indexes ordered by name
+    unsigned size_ = 0;
+
+public:
+    void build()
+    {
+        size_ = 0;
+        while (size_ < MaxParams)
+        {
+            const char* const name = configNameByIndex(int(size_));
+            if ((name == nullptr) ||
+                (configGetDescr(name, &descriptors_[size_]) < 0))
+            {
+                break;
+            }
+            sorted_by_name_[size_] = std::uint8_t(size_);
+            size_++;
+        }
+
+        assert((size_ < MaxParams) || (configNameByIndex(int(size_)) == nullptr));
+
+        std::sort(sorted_by_name_.begin(), sorted_by_name_.begin() + size_,
+                  [this](std::uint8_t a, std::uint8_t b)
+                  {
+                      return std::strcmp(descriptors_[a].name, descriptors_[b].name) < 0;
+                  });
+    }
+
+    /**
+     * @return Config index of the parameter, or negative if there's no such parameter.
+     */
+    int find(const char* const name) const
+    {
+        const auto end = sorted_by_name_.begin() + size_;
+        const auto it = std::lower_bound(sorted_by_name_.begin(), end, name,
+                                         [this](std::uint8_t index, const char* key)
+                                         {
+                                             return std::strcmp(descriptors_[index].name, key) < 0;
+                                         });
+        if ((it != end) && (std::strcmp(descriptors_[*it].name, name) == 0))
+        {
+            return *it;
+        }
+        return -1;
+    }
+
+    const ConfigParam* getDescriptor(unsigned index) const
+    {
+        return (index < size_) ? &descriptors_[index] : nullptr;
+    }
+
+    const ConfigParam* getDescriptor(const char* const name) const
+    {
+        const int index = find(name);
+        return (index >= 0) ? &descriptors_[unsigned(index)] : nullptr;
+    }
+
+    unsigned getSize() const { return size_; }
+} g_param_index;
+
 /**
  * Param access server
  * TODO: Rewrite to use pure C++ API to Zubax ChibiOS.
@@ -176,10 +369,10 @@ class ParamManager : public uavcan::IParamManager
 
     void getParamNameByIndex(Index index, Name& out_name) const override
     {
-        const char* name = configNameByIndex(index);
-        if (name != nullptr)
+        const auto descr = g_param_index.getDescriptor(index);
+        if (descr != nullptr)
         {
-            out_name = name;
+            out_name = descr->name;
         }
     }
 
@@ -204,29 +397,31 @@ class ParamManager : public uavcan::IParamManager
             return;
         }
 
-        (void)configSet(name.c_str(), native_value);
+        const auto descr = g_param_index.getDescriptor(name.c_str());
+        if (descr != nullptr)
+        {
+            (void)configSet(descr->name, native_value);
+        }
     }
 
     void readParamValue(const Name& name, Value& out_value) const override
     {
-        ConfigParam descr;
-        const int res = configGetDescr(name.c_str(), &descr);
-        if (res >= 0)
+        const auto descr = g_param_index.getDescriptor(name.c_str());
+        if (descr != nullptr)
         {
-            convert(configGet(name.c_str()), descr.type, out_value);
+            convert(configGet(descr->name), descr->type, out_value);
         }
     }
 
     void readParamDefaultMaxMin(const Name& name, Value& out_default,
                                 NumericValue& out_max, NumericValue& out_min) const override
     {
-        ConfigParam descr;
-        const int res = configGetDescr(name.c_str(), &descr);
-        if (res >= 0)
+        const auto descr = g_param_index.getDescriptor(name.c_str());
+        if (descr != nullptr)
         {
-            convert(descr.default_, descr.type, out_default);
-            convert(descr.max, descr.type, out_max);
-            convert(descr.min, descr.type, out_min);
+            convert(descr->default_, descr->type, out_default);
+            convert(descr->max, descr->type, out_max);
+            convert(descr->min, descr->type, out_min);
         }
     }
 
@@ -241,6 +436,268 @@ class ParamManager : public uavcan::IParamManager
     }
 } g_param_manager;
 
+/**
+ * Compact binary image of the whole configuration, exposed as a virtual file via the standard UAVCAN file services.
+ * This allows configuration tools to read or write all parameters with a handful of file transfers instead of
+ * one GetSet request per parameter.
+ *
+ * Layout (all numbers little endian):
+ *      uint8       format version
+ *      uint8       number of records
+ *      record[]:
+ *          uint8   name length N
+ *          uint8   name[N]
+ *          uint8   type (ConfigDataType)
+ *          float32 value
+ *
+ * Writes must be sequential; writing at offset zero starts a new image. Records that refer to unknown parameters
+ * or carry invalid values are skipped and counted. Parameters whose names don't fit the record are left out of the
+ * image rather than truncated, since a truncated name would not load back.
+ */
+class ParamImage
+{
+    static constexpr std::uint8_t FormatVersion = 1;
+    static constexpr unsigned HeaderSize = 2;
+    static constexpr unsigned MaxNameLength = 32;
+    static constexpr unsigned MaxRecordSize = 1 + MaxNameLength + 1 + 4;
+
+    static_assert(CONFIG_PARAM_MAX_NAME_LENGTH <= MaxNameLength, "Param names may not fit the image");
+
+    typedef std::array<std::uint8_t, MaxRecordSize> RecordBuffer;
+
+    // Write state
+    std::uint64_t write_offset_ = 0;
+    RecordBuffer record_{};
+    unsigned record_len_ = 0;
+    unsigned num_applied_ = 0;
+    unsigned num_rejected_ = 0;
+
+    static bool isSerializable(unsigned index)
+    {
+        const auto descr = g_param_index.getDescriptor(index);
+        assert(descr != nullptr);
+        return std::strlen(descr->name) <= MaxNameLength;
+    }
+
+    /**
+     * @return record length; zero if the parameter can't be represented in the image.
+     */
+    static unsigned serializeRecord(unsigned index, RecordBuffer& out)
+    {
+        if (!isSerializable(index))
+        {
+            return 0;
+        }
+
+        const auto descr = g_param_index.getDescriptor(index);
+        const unsigned name_len = unsigned(std::strlen(descr->name));
+        const float value = configGet(descr->name);
+
+        unsigned pos = 0;
+        out[pos++] = std::uint8_t(name_len);
+        std::memcpy(&out[pos], descr->name, name_len);
+        pos += name_len;
+        out[pos++] = std::uint8_t(descr->type);
+        std::memcpy(&out[pos], &value, sizeof(value));
+        pos += sizeof(value);
+        return pos;
+    }
+
+    static unsigned computeExpectedRecordSize(const RecordBuffer& rec, unsigned len)
+    {
+        return (len > 0) ? (1U + rec[0] + 1U + 4U) : MaxRecordSize;
+    }
+
+    void applyRecord()
+    {
+        const unsigned name_len = record_[0];
+        char name[MaxNameLength + 1] = {};
+        std::memcpy(name, &record_[1], name_len);
+
+        float value = 0.F;
+        std::memcpy(&value, &record_[1 + name_len + 1], sizeof(value));
+
+        const auto descr = g_param_index.getDescriptor(name);
+        if ((descr != nullptr) && (configSet(descr->name, value) >= 0))
+        {
+            num_applied_++;
+        }
+        else
+        {
+            num_rejected_++;
+        }
+    }
+
+public:
+    /**
+     * Number of parameters that go into the image. The rest is excluded because their names are too long;
+     * they are reported once at startup, see @ref reportUnserializable().
+     */
+    static unsigned countSerializable()
+    {
+        unsigned num = 0;
+        for (unsigned i = 0; i < g_param_index.getSize(); i++)
+        {
+            num += isSerializable(i) ? 1U : 0U;
+        }
+        return num;
+    }
+
+    static void reportUnserializable()
+    {
+        for (unsigned i = 0; i < g_param_index.getSize(); i++)
+        {
+            if (!isSerializable(i))
+            {
+                g_logger.println("Param image: name too long, excluded: %s", g_param_index.getDescriptor(i)->name);
+            }
+        }
+    }
+
+    /**
+     * Reads up to max_len bytes of the image starting from the specified offset.
+     * @return number of bytes read; less than max_len means end of file.
+     */
+    template <typename Container>
+    unsigned read(const std::uint64_t offset, Container& out, const unsigned max_len) const
+    {
+        std::uint64_t pos = 0;
+        unsigned num_read = 0;
+
+        const auto emit = [&](const std::uint8_t* data, unsigned len)
+        {
+            for (unsigned i = 0; (i < len) && (num_read < max_len); i++, pos++)
+            {
+                if (pos >= offset)
+                {
+                    out.push_back(data[i]);
+                    num_read++;
+                }
+            }
+        };
+
+        const std::uint8_t header[HeaderSize] = { FormatVersion, std::uint8_t(countSerializable()) };
+        emit(header, HeaderSize);
+
+        RecordBuffer rec;
+        for (unsigned i = 0; (i < g_param_index.getSize()) && (num_read < max_len); i++)
+        {
+            const unsigned len = serializeRecord(i, rec);
+            if (len == 0)
+            {
+                continue;                       // Not representable, see countSerializable()
+            }
+            if ((pos + len) <= offset)
+            {
+                pos += len;                     // Skipping records that precede the requested offset
+                continue;
+            }
+            emit(rec.data(), len);
+        }
+
+        return num_read;
+    }
+
+    /**
+     * @return UAVCAN file error code.
+     */
+    std::int16_t write(const std::uint64_t offset, const std::uint8_t* data, const unsigned len)
+    {
+        using uavcan::protocol::file::Error;
+
+        if (offset == 0)
+        {
+            write_offset_ = 0;
+            record_len_ = 0;
+            num_applied_ = 0;
+            num_rejected_ = 0;
+        }
+
+        if (offset != write_offset_)
+        {
+            return Error::INVALID_VALUE;        // Writes must be sequential
+        }
+
+        for (unsigned i = 0; i < len; i++, write_offset_++)
+        {
+            if (write_offset_ < HeaderSize)
+            {
+                if ((write_offset_ == 0) && (data[i] != FormatVersion))
+                {
+                    return Error::INVALID_VALUE;
+                }
+                continue;                       // Number of records is informational
+            }
+
+            if ((record_len_ == 0) && (data[i] > MaxNameLength))
+            {
+                return Error::INVALID_VALUE;
+            }
+
+            record_[record_len_++] = data[i];
+
+            if (record_len_ >= computeExpectedRecordSize(record_, record_len_))
+            {
+                applyRecord();
+                record_len_ = 0;
+            }
+        }
+
+        return Error::OK;
+    }
+
+    unsigned getNumApplied() const { return num_applied_; }
+    unsigned getNumRejected() const { return num_rejected_; }
+} g_param_image;
+
+auto& getFileReadServer()
+{
+    static uavcan::ServiceServer<uavcan::protocol::file::Read,
+        void (*)(const uavcan::ReceivedDataStructure<uavcan::protocol::file::Read::Request>&,
+                 uavcan::protocol::file::Read::Response&)> srv(getNode());
+    return srv;
+}
+
+auto& getFileWriteServer()
+{
+    static uavcan::ServiceServer<uavcan::protocol::file::Write,
+        void (*)(const uavcan::ReceivedDataStructure<uavcan::protocol::file::Write::Request>&,
+                 uavcan::protocol::file::Write::Response&)> srv(getNode());
+    return srv;
+}
+
+void handleFileReadRequest(const uavcan::ReceivedDataStructure<uavcan::protocol::file::Read::Request>& request,
+                           uavcan::protocol::file::Read::Response& response)
+{
+    if (request.path.path == ParamImageFilePath)
+    {
+        (void) g_param_image.read(request.offset, response.data, response.data.capacity());
+        response.error.value = uavcan::protocol::file::Error::OK;
+    }
+    else
+    {
+        response.error.value = uavcan::protocol::file::Error::NOT_FOUND;
+    }
+}
+
+void handleFileWriteRequest(const uavcan::ReceivedDataStructure<uavcan::protocol::file::Write::Request>& request,
+                            uavcan::protocol::file::Write::Response& response)
+{
+    if (request.path.path == ParamImageFilePath)
+    {
+        response.error.value = g_param_image.write(request.offset, request.data.begin(), request.data.size());
+        if (response.error.value != uavcan::protocol::file::Error::OK)
+        {
+            g_logger.println("Param image write error %d at offset %u",
+                             int(response.error.value), unsigned(request.offset));
+        }
+    }
+    else
+    {
+        response.error.value = uavcan::protocol::file::Error::NOT_FOUND;
+    }
+}
+
 /**
  * Restart handler
  */
@@ -346,6 +803,12 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
             std::printf("    RX overflows: %lu\n", g_can.driver.getIface(i)->getRxQueueOverflowCount());
             std::printf("    Errors:       %llu\n", iface_perf[i].errors);
         }
+
+        std::printf("Log messages dropped (debug/info/warning/error): %lu / %lu / %lu / %lu\n",
+                    g_log_message_queue_.getDropCount(uavcan::protocol::debug::LogLevel::DEBUG),
+                    g_log_message_queue_.getDropCount(uavcan::protocol::debug::LogLevel::INFO),
+                    g_log_message_queue_.getDropCount(uavcan::protocol::debug::LogLevel::WARNING),
+                    g_log_message_queue_.getDropCount(uavcan::protocol::debug::LogLevel::ERROR));
     }
 
     void pollCommandFlags()     // TODO: This is ugly, needs to be refactored later!
@@ -357,16 +820,62 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
         }
     }
 
+    /**
+     * Listens to the bus at the specified bit rate, returns true as soon as a frame is received.
+     * Unlike the standard autodetection procedure, this one returns early if the bus is busy,
+     * which is normally the case on an operating vehicle.
+     */
+    bool probeBitRate(std::uint32_t bitrate)
+    {
+        static constexpr unsigned PollIntervalMSec = 2;
+
+        if (g_can.driver.init(bitrate, uavcan_stm32::CanIface::SilentMode) < 0)
+        {
+            return false;
+        }
+
+        const auto deadline = uavcan_stm32::SystemClock::instance().getMonotonic() +
+                              g_can.getRecommendedListeningDelay();
+
+        while (uavcan_stm32::SystemClock::instance().getMonotonic() < deadline)
+        {
+            for (std::uint8_t i = 0; i < g_can.driver.getNumIfaces(); i++)
+            {
+                if (!g_can.driver.getIface(i)->isRxBufferEmpty())
+                {
+                    return true;
+                }
+            }
+            ::usleep(PollIntervalMSec * 1000);
+        }
+
+        return false;
+    }
+
     void initCAN()
     {
         int res = 0;
 
         unsigned fixed_failures_cnt = 0;
 
+        /*
+         * If the bit rate is not known from the bootloader, trying the last known good one first.
+         */
+        if ((g_can_bit_rate == 0) && (g_param_bit_rate.get() > 0))
+        {
+            if (probeBitRate(g_param_bit_rate.get()))
+            {
+                g_can_bit_rate = g_param_bit_rate.get();
+            }
+            else
+            {
+                g_logger.println("Last known good bitrate %u not confirmed", unsigned(g_param_bit_rate.get()));
+            }
+        }
+
         do
         {
             wdt_.reset();
-            ::sleep(1);
             pollCommandFlags();
 
             auto bitrate = g_can_bit_rate;
@@ -396,12 +905,21 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
                         g_can_bit_rate = 0;
                     }
                 }
+
+                ::sleep(1);
             }
         }
         while (res < 0);
 
         assert(g_can_bit_rate > 0);
         g_logger.println("CAN inited at %u bps", unsigned(g_can_bit_rate));
+
+        boot_profiler::mark("CAN bus initialized");
+
+        if (g_param_bit_rate.get() != g_can_bit_rate)
+        {
+            (void) g_param_bit_rate.set(unsigned(g_can_bit_rate));      // Will be committed by the config manager
+        }
     }
 
     void initNode()
@@ -496,12 +1014,27 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
          */
         getNode().setRestartRequestHandler(&g_restart_request_handler);
 
+        g_param_index.build();
+        ParamImage::reportUnserializable();
+
         int res = getParamServer().start(&g_param_manager);
         if (res < 0)
         {
             board::die(res);
         }
 
+        res = getFileReadServer().start(&handleFileReadRequest);
+        if (res < 0)
+        {
+            board::die(res);
+        }
+
+        res = getFileWriteServer().start(&handleFileWriteRequest);
+        if (res < 0)
+        {
+            board::die(res);
+        }
+
         res = getBeginFirmwareUpdateServer().start(&handleBeginFirmwareUpdateRequest);
         if (res < 0)
         {
@@ -518,6 +1051,7 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
         // TODO: Enumeration API
 
         g_logger.println("Node started, ID %i", int(getNode().getNodeID().get()));
+        boot_profiler::mark("UAVCAN node started");
     }
 
     void main() override
@@ -550,15 +1084,15 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
 
             pollCommandFlags();
 
-            uavcan::protocol::debug::LogMessage log_message;
-            if (g_log_message_queue_.pop(log_message))
-            {
-                const int result = getNode().getLogger().log(log_message);
-                if (result < 0)
+            (void) g_log_message_queue_.popBatch(MaxLogMessagesPerSpin,
+                                                 [](const uavcan::protocol::debug::LogMessage& msg)
                 {
-                    g_logger.println("Log: %d", result);
-                }
-            }
+                    const int result = getNode().getLogger().log(msg);
+                    if (result < 0)
+                    {
+                        g_logger.println("Log: %d", result);
+                    }
+                });
         }
 
         g_logger.puts("Goodbye");
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+#
+# Fits the observer gain schedule (obs.gs*_w, obs.gs*_q, obs.gs*_r) from recorded runs.
+#
+# Input files are raw serial port logs captured while the motor was running with the debug plotter enabled
+# (see serial_plot); only lines that start with '$' are used. The expected columns are the debug variables
+# of the motor runner:
+#
+#   $time, Ud, Uq, Id, Iq, setpoint, angular_velocity[, unused]
+#
+# The samples are binned by the absolute angular velocity around the schedule points. For every bin, the
+# measurement noise is estimated from the sample-to-sample differences of Idq, and the process noise is
+# estimated from the rate of change of the angular velocity. The multipliers are normalized so that the
+# first point is 1.0, since the base Q and R (obs.q_*, obs.r_*) are tuned for spinup.
+#
+# Usage:
+#   fit_gain_schedule.py [--points 0,500,1500,3000] log1.txt [log2.txt ...]
+#
+# The output is a list of CLI commands that can be pasted into the ESC console.
+#
+
+import argparse
+import sys
+import numpy
+
+COLUMN_TIME = 0
+COLUMN_ID = 3
+COLUMN_IQ = 4
+COLUMN_W = 6
+
+MIN_SAMPLES_PER_BIN = 50
+
+
+def load_log(path):
+    rows = []
+    with open(path, errors='ignore') as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith('$'):
+                continue
+            try:
+                values = [float(x) for x in line[1:].split(',')]
+            except ValueError:
+                continue
+            if len(values) > COLUMN_W:
+                rows.append(values[:COLUMN_W + 1])
+    return numpy.array(rows)
+
+
+def estimate_noise(data):
+    """Returns (measurement noise, process noise) estimates for a contiguous chunk of samples."""
+    dt = numpy.diff(data[:, COLUMN_TIME])
+    valid = dt > 0
+    if numpy.count_nonzero(valid) < 2:
+        return None
+    # Difference of two samples of white noise has twice the variance
+    d_idq = numpy.diff(data[:, [COLUMN_ID, COLUMN_IQ]], axis=0)[valid]
+    measurement = numpy.mean(numpy.var(d_idq, axis=0)) / 2
+    # Random walk model of the angular velocity: variance of the increments per unit of time
+    d_w = numpy.diff(data[:, COLUMN_W])[valid]
+    process = numpy.var(d_w / numpy.sqrt(dt[valid]))
+    return measurement, process
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Observer gain schedule fitting tool')
+    parser.add_argument('--points', default='0,500,1500,3000',
+                        help='electrical angular velocity of the schedule points, rad/s, comma separated')
+    parser.add_argument('logs', nargs='+', help='serial port logs')
+    args = parser.parse_args()
+
+    points = numpy.array([float(x) for x in args.points.split(',')])
+    if len(points) != 4 or numpy.any(numpy.diff(points) <= 0):
+        sys.exit('Exactly 4 points in ascending order are required')
+
+    # Bins are bounded by the midpoints between the schedule points
+    edges = numpy.concatenate(([-numpy.inf], (points[1:] + points[:-1]) / 2, [numpy.inf]))
+
+    estimates = [[] for _ in points]
+    for path in args.logs:
+        data = load_log(path)
+        if len(data) == 0:
+            print('No samples in', path, file=sys.stderr)
+            continue
+        bin_index = numpy.digitize(numpy.abs(data[:, COLUMN_W]), edges) - 1
+        # Splitting into contiguous runs within the same bin, so that the differences are not taken across bins
+        boundaries = numpy.flatnonzero(numpy.diff(bin_index)) + 1
+        for chunk, index in zip(numpy.split(data, boundaries), bin_index[numpy.concatenate(([0], boundaries))]):
+            if len(chunk) >= MIN_SAMPLES_PER_BIN:
+                est = estimate_noise(chunk)
+                if est is not None:
+                    estimates[index].append(est + (len(chunk),))
+
+    fitted = []
+    for index, point in enumerate(points):
+        if not estimates[index]:
+            print('No data for the point %.0f rad/s, it will be interpolated' % point, file=sys.stderr)
+            fitted.append(None)
+            continue
+        e = numpy.array(estimates[index])
+        weights = e[:, 2]
+        fitted.append((numpy.average(e[:, 0], weights=weights), numpy.average(e[:, 1], weights=weights)))
+
+    known = [i for i, x in enumerate(fitted) if x is not None]
+    if not known:
+        sys.exit('Not enough data')
+
+    measurement = numpy.interp(points, points[known], [fitted[i][0] for i in known])
+    process = numpy.interp(points, points[known], [fitted[i][1] for i in known])
+
+    r_mult = numpy.clip(measurement / measurement[0], 1e-3, 1e3)
+    q_mult = numpy.clip(process / process[0], 1e-3, 1e3)
+
+    for index, point in enumerate(points):
+        print('cfg set obs.gs%d_w %.0f' % (index, point))
+        print('cfg set obs.gs%d_q %.4f' % (index, q_mult[index]))
+        print('cfg set obs.gs%d_r %.4f' % (index, r_mult[index]))
+
+
+if __name__ == '__main__':
+    main()